@@ -21,6 +21,7 @@
 
 # General Python imports
 from datetime import datetime
+import hashlib
 import logging
 import math
 import numpy as np
@@ -41,7 +42,7 @@ logging.basicConfig(
 
 class ASMCDecoder(object):
     def __init__(self, site_positions, asmc_obj,
-                 hasher=None, backup_hasher=None, asmc_pad_cm=100.0):
+                 hasher=None, backup_hasher=None, asmc_pad_cm=100.0, hash_index_file=None):
         self.site_positions = site_positions
         self.asmc_obj = asmc_obj
         if hasher is not None:
@@ -52,9 +53,11 @@ class ASMCDecoder(object):
         self.cache_mean = None
         self.expected_times = np.array(self.asmc_obj.get_expected_times())
         self.num_hash_queries = 0
+        self.prefetched_cousins = None  # (query, hashing future, cousins future)
         self.chunk_start = 0
         self.chunk_end = len(self.site_positions)
         self.asmc_pad_cm = asmc_pad_cm
+        self.hash_index_file = hash_index_file
 
     def __call__(self, i, j):
         """Decodes pair (i, j) between self.chunk_start and self.chunk_end.
@@ -80,6 +83,27 @@ class ASMCDecoder(object):
                 self.cache_map[j],
                 self.cache_mean[j])
 
+    def load_hash_index(self, start_thread_id):
+        """Restores the hash indexes saved by an earlier run, if a file was given, before any
+        haplotype is hashed. Snapshots holding haplotypes at or above start_thread_id, which are
+        not threaded yet, are not used.
+        """
+        if self.hash_index_file is None or len(self.hasher.hashed_hap_ids) > 0:
+            return
+        load_hash_index(self.hasher, self.hash_index_file, start_thread_id)
+        if self.backup_hasher is not None and len(self.backup_hasher.hashed_hap_ids) == 0:
+            load_hash_index(self.backup_hasher, self.hash_index_file + ".backup", start_thread_id)
+
+    def save_hash_index(self):
+        """Saves the hash indexes for a later run to resume from, if a file was given."""
+        if self.hash_index_file is None or len(self.hasher.hashed_hap_ids) == 0:
+            return
+        self.hasher.save_hash_index(self.hash_index_file)
+        if self.backup_hasher is not None:
+            self.backup_hasher.save_hash_index(self.hash_index_file + ".backup")
+        logging.info("Saved hash index of {} haplotypes to {}".format(
+            len(self.hasher.hashed_hap_ids), self.hash_index_file))
+
     def reset_chunked_upgma(self, start=None, end=None):
         self.cache_i = -1
         self.cache_map = None
@@ -94,10 +118,14 @@ class ASMCDecoder(object):
             self.chunk_end = end
 
     def compute_with_hashing(self, i, hash_topk, hash_cm, tmrca_mean=None,
-                             tolerance=0, verbose=False, time_dict=None):
+                             tolerance=0, verbose=False, time_dict=None, next_i=None):
         """Given sample i, decodes for the hash_topk closest samples in each region
 
         See Supplementary Note 1 of our paper for more details.
+
+        If next_i is given, sample i is added to the hasher (but not the backup hasher) and the
+        search for the cousins of next_i starts in the background while sample i is decoded, so
+        the caller must not add sample i to the hasher itself.
         """
         if time_dict is None:
             time_dict = {"hash": 0, "asmc": 0, "smooth": 0, "thread": 0}
@@ -107,36 +135,48 @@ class ASMCDecoder(object):
         def foo_func(x):
             time_dict["hash"] += x
         with btime(foo_func):
-            closest_cousins = self.hasher.get_closest_cousins(i, hash_topk, tolerance, hash_cm)
-
-            nothing_found = False
-            low_score = False
-            first_bad_id = 0
-            for closest_cousin_id, entry in enumerate(closest_cousins):
-                other_ids = [thing[0] for thing in entry[2]]
-                # Heuristic 1: if a window finds nothing, then definitely refine
-                if len(other_ids) == 0:
-                    nothing_found = True
-                    first_bad_id = closest_cousin_id
-                else:
-                    window_num_words = (entry[1] - entry[0]) // self.hasher.word_size + 1
-                    sum_scores = sum([score_entry[1] for score_entry in entry[2]])
-                    # Heuristic 2: if the sum of scores in a window is low, then also refine
-                    if sum_scores < math.ceil(math.sqrt(hash_topk)) * window_num_words:
-                        low_score = True
-                        first_bad_id = closest_cousin_id
-
-            if self.backup_hasher is not None and (nothing_found or low_score):
+            # cousins as arrays: first and last site of each window, and windows x hash_topk
+            # matrices of cousin IDs (padded with -1) and scores (padded with 0). A hasher with
+            # refinements re-scores the windows that fail the heuristics below by itself.
+            refined = len(self.hasher.refinement_word_sizes) > 0
+            min_cousins, min_score_per_word = (1, math.ceil(math.sqrt(hash_topk))) if refined else (0, 0)
+            query = (i, hash_topk, tolerance, hash_cm)
+            cousins = None
+            if self.prefetched_cousins is not None:
+                prefetched_query, hash_future, cousins_future = self.prefetched_cousins
+                self.prefetched_cousins = None
+                hash_future.result()  # raises if hashing the previous sample failed
+                if prefetched_query == query:
+                    cousins = cousins_future.result_arrays(hash_topk)
+            if cousins is None:
+                cousins = self.hasher.get_closest_cousins_arrays(
+                    i, hash_topk, tolerance, hash_cm, min_cousins, min_score_per_word)
+            starts, ends, cousin_ids, scores = cousins
+
+            # Heuristic 1: if a window finds nothing, then definitely refine
+            found = cousin_ids[:, 0] >= 0
+            nothing_found = not found.all()
+            # Heuristic 2: if the sum of scores in a window is low, then also refine
+            # (the PBWT engine scores in sites, the LSH engine in collisions over all its tables, and
+            # windows also span the sites below the MAF threshold, which do not score)
+            score_unit = 1 if self.hasher.match_engine == "pbwt" else self.hasher.word_size
+            hashed_fraction = self.hasher.num_hashed_sites / self.hasher.num_sites
+            window_num_words = (ends - starts) * hashed_fraction // score_unit + 1
+            if self.hasher.match_engine == "lsh":
+                window_num_words *= self.hasher.lsh_num_tables
+            low_score = bool(np.any(
+                found & (scores.sum(axis=1) < math.ceil(math.sqrt(hash_topk)) * window_num_words)))
+
+            if refined:
+                if i > 2*hash_topk and nothing_found:
+                    logging.warning("Warning: no cousins found for ID {}, even after refining. Consider decreasing the backup hash word size.".format(i))
+            elif self.backup_hasher is not None and (nothing_found or low_score):
                 if verbose:
                     logging.info("Refining hashing on ID {} using backup hasher".format(i))
-                mid_bit = (closest_cousins[first_bad_id][0] + closest_cousins[first_bad_id][1]) // 2
-                closest_cousins = self.backup_hasher.get_closest_cousins(i, hash_topk, tolerance, hash_cm)
+                starts, ends, cousin_ids, scores = self.backup_hasher.get_closest_cousins_arrays(
+                    i, hash_topk, tolerance, hash_cm)
 
-                nothing_found = False
-                for entry in closest_cousins:
-                    other_ids = [thing[0] for thing in entry[2]]
-                    if len(other_ids) == 0:
-                        nothing_found = True
+                nothing_found = not np.all(cousin_ids[:, 0] >= 0)
 
                 if i > 2*hash_topk and nothing_found:
                     logging.warning("Warning: no cousins found for ID {}, even after refining. Consider decreasing the backup hash word size.".format(i))
@@ -152,28 +192,40 @@ class ASMCDecoder(object):
             if verbose:
                 if self.num_hash_queries % 100 == 0:
                     logging.info("Selected hash results for {}:".format(i))
-                    whole_length = len(closest_cousins)
+                    whole_length = len(starts)
                     logging.info("Length = {}, middle = {}".format(whole_length, whole_length // 2))
+                    shown = []
                     if whole_length > 2:
-                        logging.info(closest_cousins[0])
+                        shown.append(0)
                     if whole_length > 0:
-                        logging.info(closest_cousins[whole_length // 2])
+                        shown.append(whole_length // 2)
                     if whole_length > 2:
-                        logging.info(closest_cousins[whole_length - 1])
+                        shown.append(whole_length - 1)
+                    for w in shown:
+                        logging.info((starts[w], ends[w], cousin_ids[w], scores[w]))
 
             self.num_hash_queries += 1
 
-        for entry in closest_cousins:
+            if next_i is not None:
+                self.prefetched_cousins = (
+                    (next_i, hash_topk, tolerance, hash_cm),
+                    self.hasher.add_to_hash_async(i),
+                    self.hasher.get_closest_cousins_async(
+                        next_i, hash_topk, tolerance, hash_cm, min_cousins, min_score_per_word))
+
+        for w in range(len(starts)):
             def foo_func(x):
                 time_dict["asmc"] += x
             with btime(foo_func):
-                from_pos = entry[0]
-                to_pos = entry[1] + 1
-                other_ids = [thing[0] for thing in entry[2]]
+                from_pos = int(starts[w])
+                to_pos = int(ends[w]) + 1
+                other_ids = cousin_ids[w]
+                other_ids = other_ids[other_ids >= 0]
 
                 # TODO: be smarter by excluding already sampled IDs, and no replacement
-                other_ids.extend(np.random.randint(0, i, size=(hash_topk - len(other_ids))))
-                other_ids = np.array(other_ids, dtype=np.int32)
+                other_ids = np.concatenate((
+                    other_ids, np.random.randint(0, i, size=(hash_topk - len(other_ids)))))
+                other_ids = other_ids.astype(np.int32)
                 assert len(other_ids) == hash_topk
 
                 self.asmc_obj.decode_pairs(
@@ -224,9 +276,10 @@ def make_asmc_decoder_simulation(
         logging.info("Using temporary directory " + asmc_tmp_dir)
     os.makedirs(asmc_tmp_dir, exist_ok=True)
 
-    # Write .hap file
+    # Write .hap file, keeping the genotypes in memory to build the hasher without re-parsing
     out_path = os.path.join(asmc_tmp_dir, in_prefix + ".hap")
     site_positions = []
+    genotype_rows = []
     with open(out_path, 'w') as out_file:
         last = -1
         snp_ids_index = 0
@@ -242,6 +295,8 @@ def make_asmc_decoder_simulation(
                 for i in range(augment_factor):
                     row_list += [str(entry) for entry in variant.genotypes]
                 out_file.write(' '.join(row_list))
+                if use_hashing:
+                    genotype_rows.append(np.tile(variant.genotypes, augment_factor).astype(np.uint8))
                 out_file.write('\n')
 
                 snp_ids_index += 1
@@ -293,16 +348,25 @@ def make_asmc_decoder_simulation(
         # In this case, just multiply by the rate
         assert recomb_rate is not None
         chrom_string = "chr"
+        site_cms = (recomb_rate * 1e8) * site_positions / 1e6
         # Write out result
         out_path = os.path.join(asmc_tmp_dir, in_prefix + ".map")
         with open(out_path, "w") as out_file:
-            for site_pos in site_positions:
-                site_cm = (recomb_rate * 1e8) * site_pos / 1e6
+            for site_pos, site_cm in zip(site_positions, site_cms):
                 out_file.write('\t'.join([chrom_string, "SNP_" + str(site_pos),
                     str(site_cm), str(site_pos)]) + '\n')
 
     haps_file_root = os.path.join(asmc_tmp_dir, in_prefix)
 
+    hasher = None
+    if use_hashing:
+        if verbose:
+            logging.info("Making HapData object from in-memory genotypes")
+        genotypes = np.vstack(genotype_rows)
+        del genotype_rows
+        hasher = HapData(mode, genotypes, site_positions, site_cms, hash_word_size, fill_sites=False)
+        del genotypes
+
     decoder_with_hasher = make_asmc_decoder(
         haps_file_root,
         decoding_quant_file,
@@ -312,36 +376,108 @@ def make_asmc_decoder_simulation(
         backup_hash_word_size=0,
         asmc_pad_cm=asmc_pad_cm,
         use_hashing=use_hashing,
-        verbose=verbose
+        verbose=verbose,
+        hasher=hasher
         )
     shutil.rmtree(asmc_tmp_dir)
     return decoder_with_hasher
 
 
+def make_hap_data(mode, haps_file_root, word_size, mapfile="", hash_cache_dir=None, match_engine="hash"):
+    """Makes a HapData object that finds cousins with match_engine, going through a binary cache
+    if hash_cache_dir is given.
+
+    The cache is named after the absolute paths of the inputs and the word size. It is written
+    on first use and memory-mapped on later calls, and rewritten when the size or modification
+    time of an input file no longer matches the files it was written from.
+    """
+    if hash_cache_dir is None:
+        return HapData(mode, haps_file_root, word_size, mapfile, fill_sites=False, match_engine=match_engine)
+
+    inputs_key = hashlib.sha1("\0".join([
+        os.path.abspath(haps_file_root), os.path.abspath(mapfile) if mapfile else ""]).encode()).hexdigest()
+    cache_path = os.path.join(hash_cache_dir, "{}.{}.w{}.hapdata".format(
+        os.path.basename(haps_file_root), inputs_key[:12], word_size))
+    if HapData.is_cache_current(cache_path, haps_file_root, mapfile):
+        logging.info("Loading HapData from binary cache " + cache_path)
+        return HapData(mode, cache_path, word_size, mapfile, fill_sites=False, match_engine=match_engine)
+
+    hap_data = HapData(mode, haps_file_root, word_size, mapfile, fill_sites=False, match_engine=match_engine)
+    os.makedirs(hash_cache_dir, exist_ok=True)
+    # write next to the cache and rename, so that processes mapping an older cache keep a whole file
+    temp_path = "{}.{}.tmp".format(cache_path, os.getpid())
+    hap_data.save(temp_path)
+    os.replace(temp_path, cache_path)
+    logging.info("Wrote HapData binary cache " + cache_path)
+    return hap_data
+
+
+def load_hash_index(hasher, path, id_limit):
+    """Restores the hash index saved by an earlier run, if there is one built from the same data
+    that only holds haplotypes below id_limit, i.e. ones already threaded.
+
+    Returns whether the index was loaded.
+    """
+    if id_limit == 0 or not os.path.exists(path):
+        return False
+    try:
+        hasher.load_hash_index(path, id_limit)
+        logging.info("Loaded hash index of {} haplotypes from {}".format(len(hasher.hashed_hap_ids), path))
+        return True
+    except RuntimeError as e:
+        logging.warning("Not using hash index {}: {}".format(path, e))
+        return False
+
+
 def make_asmc_decoder(
     haps_file_root, decoding_quant_file, mapfile="", mode="array",
     hash_word_size=64, backup_hash_word_size=0, asmc_pad_cm=100.0,
-    use_hashing=False, verbose=False):
+    use_hashing=False, verbose=False, hash_cache_dir=None, hasher=None, hash_rerank_pool=0,
+    cousin_engine="hash", lsh_tables=4, lsh_bits_per_key=0, hash_min_maf=0, hash_index_file=None):
 
     # start to set up ASMC object
     noBatches = False
-    hasher = None
-    if use_hashing:
+    if use_hashing and hasher is None:
         if verbose:
             logging.info("Making HapData object")
-        hasher = HapData(
-            mode, haps_file_root, hash_word_size, mapfile, fill_sites=False)
+        hasher = make_hap_data(mode, haps_file_root, hash_word_size, mapfile, hash_cache_dir, cousin_engine)
         logging.info("Hashing data is {} by {}".format(hasher.num_haps, hasher.num_sites))
 
+    if use_hashing and hash_min_maf > 0:
+        hasher.set_min_maf(hash_min_maf)
+        logging.info("Hashing {} sites with MAF at least {}".format(hasher.num_hashed_sites, hash_min_maf))
+
     backup_hasher = None
-    if use_hashing and backup_hash_word_size > 0:
+    if use_hashing and cousin_engine != "hash":
+        # matches are found at site resolution or within words, so there is nothing to refine
+        if cousin_engine == "lsh":
+            hasher.set_lsh_parameters(lsh_tables, lsh_bits_per_key)
+        if hasher.match_engine != cousin_engine:
+            hasher.set_match_engine(cousin_engine)
+        logging.info("Finding cousins with the {} engine".format(cousin_engine))
+    elif use_hashing and 0 < backup_hash_word_size < hasher.word_size:
+        # refine failing windows inside the hasher, from the same haplotype words
+        hasher.add_refinement(backup_hash_word_size)
+        logging.info("Refining hashing with word size {}".format(backup_hash_word_size))
+    elif use_hashing and backup_hash_word_size > 0:
         if verbose:
             logging.info("Making backup HapData object")
-        backup_hasher = HapData(
-            mode, haps_file_root, backup_hash_word_size,
-            map_file_path=mapfile, fill_sites=False)
+        backup_hasher = make_hap_data(
+            mode, haps_file_root, backup_hash_word_size, mapfile, hash_cache_dir)
+        if hash_min_maf > 0:
+            backup_hasher.set_min_maf(hash_min_maf)
         logging.info("Backup hashing data is {} by {}".format(hasher.num_haps, hasher.num_sites))
 
+    if use_hashing and hash_rerank_pool > 0:
+        # rank cousins by mismatches in each window and fill short windows with the nearest samples
+        hasher.set_rerank_pool(hash_rerank_pool)
+        if backup_hasher is not None:
+            backup_hasher.set_rerank_pool(hash_rerank_pool)
+        logging.info("Re-ranking hashing cousins from pools of {}".format(hash_rerank_pool))
+
+    if not use_hashing:
+        hash_index_file = None
+
     if mode == "sequence":
         params = DecodingParams(
             in_file_root=haps_file_root,
@@ -380,5 +516,5 @@ def make_asmc_decoder(
 
     decoder = ASMCDecoder(site_positions, asmc_obj,
                           hasher=hasher, backup_hasher=backup_hasher,
-                          asmc_pad_cm=asmc_pad_cm)
+                          asmc_pad_cm=asmc_pad_cm, hash_index_file=hash_index_file)
     return decoder
@@ -78,12 +78,38 @@ def add_default_arg_building_arguments(parser):
         help="Hashing word size, must be between 1 and 64 (default=16)")
     parser.add_argument("--backup_hash_word_size", action="store", default=8, type=int,
         help="Backup hashing word size (must be between 0 and 64, 0 means no backup for real data inference, default=8)")
+    parser.add_argument("--cousin_engine", action="store", default="hash", choices=["hash", "pbwt", "lsh"],
+        help="How to find cousins: hash tables of words, exact matches from a PBWT, which "
+            "needs no backup hashing but 24 bytes per haplotype and site, or hash tables of random "
+            "subsets of each word's sites, which tolerate mismatches within words (default=hash)")
+    parser.add_argument("--lsh_tables", action="store", default=4, type=int,
+        help="Number of hash tables per word with --cousin_engine lsh (default=4)")
+    parser.add_argument("--lsh_bits_per_key", action="store", default=0, type=int,
+        help="Sites per hash key with --cousin_engine lsh, at most hash_word_size "
+            "(default=0 meaning half the word size)")
+    parser.add_argument("--hash_min_maf", action="store", default=0, type=float,
+        help="Build hashing words from the sites with at least this minor allele frequency only "
+            "(default=0 meaning all sites)")
+    parser.add_argument("--hash_index_file", action="store", default=None,
+        help="Load the hash index from this file if an earlier run saved one from the same "
+            "haplotypes, and save it there after threading (default=None meaning not used)")
+    parser.add_argument("--hash_rerank_pool", action="store", default=0, type=int,
+        help="Re-rank the hashing cousins of each window by mismatches among this many best matches, "
+            "filling windows with too few matches with the nearest samples (default=0 meaning not used)")
 
 def check_hash_word_sizes(args):
     if args.hash_word_size > 64 or args.hash_word_size <= 0:
         raise ValueError("hash_word_size must be between 1 and 64")
     if args.backup_hash_word_size > 64 or args.backup_hash_word_size < 0:
         raise ValueError("backup_hash_word_size must be between 0 and 64")
+    if args.hash_rerank_pool < 0:
+        raise ValueError("hash_rerank_pool must be non-negative")
+    if args.hash_min_maf < 0 or args.hash_min_maf > 0.5:
+        raise ValueError("hash_min_maf must be between 0 and 0.5")
+    if args.lsh_tables <= 0:
+        raise ValueError("lsh_tables must be positive")
+    if args.lsh_bits_per_key > args.hash_word_size or args.lsh_bits_per_key < 0:
+        raise ValueError("lsh_bits_per_key must be between 0 and hash_word_size")
 
 
 # To use this function, must also define args.rho or args.mapfile before passing in
@@ -215,6 +241,10 @@ def build_arg(args, haps_file_root, map_file, mode="array",
         haps_file_root, args.asmc_decoding_file, map_file,
         mode=mode, hash_word_size=args.hash_word_size,
         backup_hash_word_size=args.backup_hash_word_size,
+        hash_rerank_pool=args.hash_rerank_pool, hash_min_maf=args.hash_min_maf,
+        hash_index_file=args.hash_index_file,
+        cousin_engine=args.cousin_engine,
+        lsh_tables=args.lsh_tables, lsh_bits_per_key=args.lsh_bits_per_key,
         asmc_pad_cm=args.asmc_pad_cm, use_hashing=use_hashing,
         verbose=verbose)
 
@@ -299,6 +329,10 @@ def extend_arg(args, initial_arg, haps_file_root, map_file,
         haps_file_root, args.asmc_decoding_file, map_file,
         mode=mode, hash_word_size=args.hash_word_size,
         backup_hash_word_size=args.backup_hash_word_size,
+        hash_rerank_pool=args.hash_rerank_pool, hash_min_maf=args.hash_min_maf,
+        hash_index_file=args.hash_index_file,
+        cousin_engine=args.cousin_engine,
+        lsh_tables=args.lsh_tables, lsh_bits_per_key=args.lsh_bits_per_key,
         asmc_pad_cm=args.asmc_pad_cm, use_hashing=use_hashing,
         verbose=verbose)
 
@@ -411,13 +445,27 @@ def thread_samples(initial_arg, pairwise_decoder, num_next_samples,
 
     if hash_topk > 0:
         hasher = pairwise_decoder.hasher
-        id_set = hasher.hashed_hap_ids
-        for i in range(start_thread_id):
-            if i not in id_set:
-                hasher.add_to_hash(i)
-                if pairwise_decoder.backup_hasher is not None:
-                    pairwise_decoder.backup_hasher.add_to_hash(i)
-        assert len(hasher.hashed_hap_ids) == start_thread_id
+        pairwise_decoder.load_hash_index(start_thread_id)
+        # hash each run of missing IDs below start_thread_id in one call, split across cores; the
+        # backup may have loaded a different index
+        num_hash_threads = os.cpu_count() or 1
+        for h in [hasher, pairwise_decoder.backup_hasher]:
+            if h is None:
+                continue
+            id_set = h.hashed_hap_ids
+            begin = 0
+            while begin < start_thread_id:
+                while begin < start_thread_id and begin in id_set:
+                    begin += 1
+                end = begin
+                while end < start_thread_id and end not in id_set:
+                    end += 1
+                if begin < end:
+                    h.add_range_to_hash(begin, end, num_hash_threads)
+                begin = end
+            if len(h.hashed_hap_ids) != start_thread_id:
+                raise ValueError("Hashed {} haplotypes before threading, expected the first {}".format(
+                    len(h.hashed_hap_ids), start_thread_id))
 
     posterior_phys_pos = None
     for i in range(start_thread_id, start_thread_id + num_next_samples):
@@ -432,6 +480,11 @@ def thread_samples(initial_arg, pairwise_decoder, num_next_samples,
             logging.info("Threading sample {}".format(i))
             if verbose:
                 logging.info("Memory: {}".format(process.memory_info().rss))
+                if hash_topk > 0:
+                    logging.info("Hasher memory: {}".format(hasher.memory_usage()))
+                    if pairwise_decoder.backup_hasher is not None:
+                        logging.info("Backup hasher memory: {}".format(
+                            pairwise_decoder.backup_hasher.memory_usage()))
         if verbose:
             if i % 10 == 0:
                 logging.info(i)
@@ -478,13 +531,16 @@ def thread_samples(initial_arg, pairwise_decoder, num_next_samples,
             if i == start_thread_id or i == 1:
                 tmrca_mean = np.full((start_thread_id + num_next_samples - 1, len(posterior_phys_pos)), np.nan)
 
-            # modifies tmrca_mean
+            # modifies tmrca_mean. Unless this is the last sample, sample i is hashed and the
+            # cousins of sample i + 1 are searched for in the background while i is decoded
+            next_i = i + 1 if i + 1 < start_thread_id + num_next_samples else None
             indices, times = pairwise_decoder.compute_with_hashing(
-                i, hash_topk, hash_cm, tmrca_mean, tolerance, verbose, time_dict)
+                i, hash_topk, hash_cm, tmrca_mean, tolerance, verbose, time_dict, next_i)
             def foo_func(x):
                 time_dict["hash"] += x
             with btime(foo_func):
-                pairwise_decoder.hasher.add_to_hash(i)
+                if next_i is None:
+                    pairwise_decoder.hasher.add_to_hash(i)
                 if pairwise_decoder.backup_hasher is not None:
                     pairwise_decoder.backup_hasher.add_to_hash(i)
 
@@ -536,6 +592,9 @@ def thread_samples(initial_arg, pairwise_decoder, num_next_samples,
                 indices[c],
                 times_to_use * (1 + 1e-6*np.random.randn(c.shape[0])))
 
+    if hash_topk > 0:
+        pairwise_decoder.save_hash_index()
+
     return arg
 
 
@@ -0,0 +1,117 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_BINARY_IO_HPP
+#define ARG_NEEDLE_BINARY_IO_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+/**
+ * Binary snapshot files: values and vectors of trivially copyable types are written as their
+ * bytes, vectors prefixed with their length, and read back through a bounds-checked cursor over
+ * a memory-mapped file.
+ */
+namespace BinaryIO {
+
+inline void write_bytes(std::ostream& out, const void* data, std::size_t size) {
+  out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+}
+
+template <typename T>
+void write_value(std::ostream& out, const T& value) {
+  static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values are written as bytes");
+  write_bytes(out, &value, sizeof(T));
+}
+
+template <typename T>
+void write_vector(std::ostream& out, const std::vector<T>& values) {
+  static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values are written as bytes");
+  write_value<uint64_t>(out, values.size());
+  write_bytes(out, values.data(), values.size() * sizeof(T));
+}
+
+class Reader {
+public:
+  /**
+   * @param name Used in error messages, e.g. the path of the file.
+   */
+  Reader(const char* _data, std::size_t _size, std::string _name)
+      : data(_data), remaining(_size), name(std::move(_name)) {
+  }
+
+  void read_bytes(void* destination, std::size_t size) {
+    if (size > remaining) {
+      throw std::logic_error(MAKE_ERROR("Truncated " + name + "."));
+    }
+    std::memcpy(destination, data, size);
+    data += size;
+    remaining -= size;
+  }
+
+  template <typename T>
+  T read_value() {
+    static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values are read as bytes");
+    T value;
+    read_bytes(&value, sizeof(T));
+    return value;
+  }
+
+  template <typename T>
+  void read_vector(std::vector<T>& values) {
+    static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values are read as bytes");
+    const auto size = read_value<uint64_t>();
+    if (size > remaining / sizeof(T)) {
+      throw std::logic_error(MAKE_ERROR("Truncated " + name + "."));
+    }
+    values.resize(size);
+    read_bytes(values.data(), size * sizeof(T));
+  }
+
+  std::size_t bytes_left() const noexcept {
+    return remaining;
+  }
+
+  /**
+   * @brief Throw unless condition holds, for checks of what was read.
+   */
+  void check(bool condition) const {
+    if (!condition) {
+      throw std::logic_error(MAKE_ERROR("Corrupt " + name + "."));
+    }
+  }
+
+private:
+  const char* data;
+  std::size_t remaining;
+  std::string name;
+};
+
+} // namespace BinaryIO
+
+#endif // ARG_NEEDLE_BINARY_IO_HPP
@@ -0,0 +1,371 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "BinaryIO.hpp"
+#include "DynamicPbwt.hpp"
+#include "utils.hpp"
+
+// Chunk capacities run 2, 4, ..., max_chunk_capacity, then stay there, as in HashIndex, so the
+// first 2 * max_chunk_capacity - 2 slots fill the doubling chunks
+DynamicPbwt::id_type DynamicPbwt::chunk_capacity(id_type slot) noexcept {
+  constexpr id_type ramp_slots = 2 * max_chunk_capacity - 2;
+  return slot < ramp_slots ? 1u << (31 - __builtin_clz(slot + 2)) : max_chunk_capacity;
+}
+
+DynamicPbwt::id_type DynamicPbwt::chunk_index(id_type slot) noexcept {
+  constexpr id_type ramp_slots = 2 * max_chunk_capacity - 2;
+  constexpr auto ramp_chunks = static_cast<id_type>(30 - __builtin_clz(ramp_slots + 2));
+  return slot < ramp_slots ? static_cast<id_type>(30 - __builtin_clz(slot + 2))
+                           : ramp_chunks + (slot - ramp_slots) / max_chunk_capacity;
+}
+
+DynamicPbwt::id_type DynamicPbwt::index_in_chunk(id_type slot) noexcept {
+  constexpr id_type ramp_slots = 2 * max_chunk_capacity - 2;
+  return slot < ramp_slots ? slot + 2 - chunk_capacity(slot) : (slot - ramp_slots) % max_chunk_capacity;
+}
+
+void DynamicPbwt::reset(std::size_t _num_sites, unsigned int _word_size) {
+  if (_num_sites >= (1ul << 31)) {
+    throw std::logic_error(MAKE_ERROR("Too many sites for the PBWT."));
+  }
+  num_sites = _num_sites;
+  word_size = _word_size;
+  ascending = true;
+  ids.clear();
+  chunks.clear();
+  heads.assign(num_sites + 1, none);
+  tails.assign(num_sites + 1, none);
+  last_zeros.assign(num_sites, none);
+  run_firsts.assign(num_sites, {});
+}
+
+std::size_t DynamicPbwt::memory_usage() const noexcept {
+  std::size_t bytes = ids.capacity() * sizeof(id_type) + chunks.capacity() * sizeof(Chunk) +
+                      (heads.capacity() + tails.capacity() + last_zeros.capacity()) * sizeof(id_type) +
+                      run_firsts.capacity() * sizeof(std::vector<id_type>);
+  for (const Chunk& chunk : chunks) {
+    bytes += chunk.nodes.capacity() * sizeof(Node) + chunk.words.capacity() * sizeof(word_type);
+  }
+  for (const std::vector<id_type>& firsts : run_firsts) {
+    bytes += firsts.capacity() * sizeof(id_type);
+  }
+  return bytes;
+}
+
+void DynamicPbwt::write(std::ostream& out) const {
+  BinaryIO::write_value<uint64_t>(out, num_sites);
+  BinaryIO::write_value<uint32_t>(out, word_size);
+  BinaryIO::write_vector(out, ids);
+  // the nodes and alleles of inserted haplotypes only, as if every chunk were full
+  std::size_t first = 0;
+  for (const Chunk& chunk : chunks) {
+    const std::size_t used = std::min<std::size_t>(chunk.capacity, ids.size() - first);
+    for (std::size_t column = 0; column <= num_sites; ++column) {
+      BinaryIO::write_bytes(out, chunk.nodes.data() + column * chunk.capacity, used * sizeof(Node));
+    }
+    BinaryIO::write_bytes(out, chunk.words.data(), used * num_words() * sizeof(word_type));
+    first += chunk.capacity;
+  }
+  BinaryIO::write_vector(out, heads);
+  BinaryIO::write_vector(out, tails);
+  BinaryIO::write_vector(out, last_zeros);
+  for (const std::vector<id_type>& firsts : run_firsts) {
+    BinaryIO::write_vector(out, firsts);
+  }
+}
+
+void DynamicPbwt::read(BinaryIO::Reader& in) {
+  DynamicPbwt loaded;
+  loaded.num_sites = in.read_value<uint64_t>();
+  loaded.word_size = in.read_value<uint32_t>();
+  in.check(loaded.num_sites < (1ul << 31) && loaded.word_size > 0 && loaded.word_size <= 64);
+  in.read_vector(loaded.ids);
+  in.check(loaded.ids.size() < none);
+  for (std::size_t first = 0; first < loaded.ids.size(); first += loaded.chunks.back().capacity) {
+    loaded.add_chunk();
+    Chunk& chunk = loaded.chunks.back();
+    const std::size_t used = std::min<std::size_t>(chunk.capacity, loaded.ids.size() - first);
+    in.check(used * (loaded.num_sites + 1) <= in.bytes_left() / sizeof(Node));
+    for (std::size_t column = 0; column <= loaded.num_sites; ++column) {
+      in.read_bytes(chunk.nodes.data() + column * chunk.capacity, used * sizeof(Node));
+    }
+    in.read_bytes(chunk.words.data(), used * loaded.num_words() * sizeof(word_type));
+  }
+  for (std::size_t slot = 1; slot < loaded.ids.size(); ++slot) {
+    loaded.ascending = loaded.ascending && loaded.ids[slot] > loaded.ids[slot - 1];
+  }
+  in.read_vector(loaded.heads);
+  in.read_vector(loaded.tails);
+  in.read_vector(loaded.last_zeros);
+  in.check(loaded.heads.size() == loaded.num_sites + 1 && loaded.tails.size() == loaded.num_sites + 1 &&
+           loaded.last_zeros.size() == loaded.num_sites);
+  loaded.run_firsts.resize(loaded.num_sites);
+  for (std::vector<id_type>& firsts : loaded.run_firsts) {
+    in.read_vector(firsts);
+  }
+  *this = std::move(loaded);
+}
+
+uint32_t DynamicPbwt::match_start(const word_type* a, const word_type* b, std::size_t end) const noexcept {
+  std::size_t word = end / word_size;
+  std::size_t num_bits = end % word_size;
+  for (;;) {
+    if (num_bits > 0) {
+      const word_type mask = num_bits == 64 ? ~word_type(0) : (word_type(1) << num_bits) - 1;
+      const word_type diff = (a[word] ^ b[word]) & mask;
+      if (diff != 0) {
+        // one past the last mismatching site
+        return static_cast<uint32_t>(word * word_size + 64 - static_cast<std::size_t>(__builtin_clzll(diff)));
+      }
+    }
+    if (word == 0) {
+      return 0;
+    }
+    --word;
+    num_bits = word_size;
+  }
+}
+
+void DynamicPbwt::add_chunk() {
+  std::size_t first = 0;
+  for (const Chunk& chunk : chunks) {
+    first += chunk.capacity;
+  }
+  const id_type capacity = chunk_capacity(static_cast<id_type>(first));
+  chunks.push_back({capacity, std::vector<Node>((num_sites + 1) * capacity), std::vector<word_type>(capacity * num_words())});
+}
+
+DynamicPbwt::id_type DynamicPbwt::nearest_above(std::size_t column, id_type slot,
+                                                unsigned int with_allele) const noexcept {
+  if (slot == none || node(column, slot).allele == with_allele) {
+    return slot;
+  }
+  // the node above a run has the other allele
+  return node(column, run_firsts[column][node(column, slot).run]).above;
+}
+
+DynamicPbwt::Position DynamicPbwt::next_position(std::size_t site, const word_type* hap_words,
+                                                 const Position& position) const noexcept {
+  // nodes with the same allele keep their order in the next column, and nodes with allele 0 come
+  // before those with allele 1
+  const unsigned int hap_allele = allele(hap_words, site);
+  const std::size_t column = site + 1;
+  const auto no_match = static_cast<uint32_t>(column);
+  Position next;
+  next.above = nearest_above(site, position.above, hap_allele);
+  if (next.above == none && hap_allele == 1) {
+    next.above = last_zeros[site];
+  }
+  next.below = next.above != none ? node(column, next.above).below : heads[column];
+
+  // a neighbour that was already next to the haplotype and shares its allele keeps its match,
+  // and any other is compared
+  if (next.above == none) {
+    next.divergence = no_match;
+  }
+  else if (next.above == position.above && node(site, next.above).allele == hap_allele) {
+    next.divergence = position.divergence;
+  }
+  else {
+    next.divergence = match_start(hap_words, slot_words(next.above), column);
+  }
+  if (next.below == none) {
+    next.divergence_below = no_match;
+  }
+  else if (next.below == position.below && node(site, next.below).allele == hap_allele) {
+    next.divergence_below = position.divergence_below;
+  }
+  else {
+    next.divergence_below = match_start(hap_words, slot_words(next.below), column);
+  }
+  return next;
+}
+
+void DynamicPbwt::split_run(std::size_t column, id_type above, id_type below) {
+  // walk to both ends of the run at once, and relabel the part whose end comes first
+  std::vector<id_type>& firsts = run_firsts[column];
+  const id_type run = node(column, above).run;
+  const auto new_run = static_cast<id_type>(firsts.size());
+  for (id_type up = above, down = below;; up = node(column, up).above, down = node(column, down).below) {
+    const id_type next_up = node(column, up).above;
+    if (next_up == none || node(column, next_up).run != run) {
+      firsts.push_back(up);
+      firsts[run] = below;
+      for (id_type slot = above; slot != next_up; slot = node(column, slot).above) {
+        node(column, slot).run = new_run;
+      }
+      return;
+    }
+    const id_type next_down = node(column, down).below;
+    if (next_down == none || node(column, next_down).run != run) {
+      firsts.push_back(below);
+      for (id_type slot = below; slot != next_down; slot = node(column, slot).below) {
+        node(column, slot).run = new_run;
+      }
+      return;
+    }
+  }
+}
+
+void DynamicPbwt::link(std::size_t column, id_type slot, const Position& position, unsigned int hap_allele) {
+  if (column < num_sites) {
+    if (hap_allele == 0 && nearest_above(column, position.above, 0) == last_zeros[column]) {
+      last_zeros[column] = slot;
+    }
+    // join the run of a neighbour with the same allele, or start one
+    std::vector<id_type>& firsts = run_firsts[column];
+    if (position.above != none && node(column, position.above).allele == hap_allele) {
+      node(column, slot).run = node(column, position.above).run;
+    }
+    else if (position.below != none && node(column, position.below).allele == hap_allele) {
+      node(column, slot).run = node(column, position.below).run;
+      firsts[node(column, slot).run] = slot;
+    }
+    else {
+      if (position.above != none && position.below != none &&
+          node(column, position.above).run == node(column, position.below).run) {
+        split_run(column, position.above, position.below);
+      }
+      node(column, slot).run = static_cast<id_type>(firsts.size());
+      firsts.push_back(slot);
+    }
+  }
+
+  Node& n = node(column, slot);
+  n.above = position.above;
+  n.below = position.below;
+  n.inserted_above = position.above;
+  n.inserted_below = position.below;
+  n.divergence = position.divergence & 0x7fffffffu;
+  n.allele = hap_allele & 1u;
+  if (position.above != none) {
+    node(column, position.above).below = slot;
+  }
+  else {
+    heads[column] = slot;
+  }
+  if (position.below != none) {
+    node(column, position.below).above = slot;
+    node(column, position.below).divergence = position.divergence_below & 0x7fffffffu;
+  }
+  else {
+    tails[column] = slot;
+  }
+}
+
+void DynamicPbwt::insert(id_type id, const word_type* hap_words) {
+  if (empty()) {
+    throw std::logic_error(MAKE_ERROR("The PBWT must be reset before inserting haplotypes."));
+  }
+  if (id == none || ids.size() + 1 >= none) {
+    throw std::logic_error(MAKE_ERROR("Too many haplotypes for the PBWT."));
+  }
+  const auto slot = static_cast<id_type>(ids.size());
+  if (chunk_index(slot) == chunks.size()) {
+    add_chunk();
+  }
+  ascending = ascending && (ids.empty() || id > ids.back());
+  ids.push_back(id);
+  std::copy(hap_words, hap_words + num_words(),
+            chunks.back().words.begin() + static_cast<std::ptrdiff_t>(index_in_chunk(slot) * num_words()));
+
+  // the first column keeps the order of insertion
+  Position position = {tails[0], none, 0, 0};
+  for (std::size_t site = 0;; ++site) {
+    link(site, slot, position, site < num_sites ? allele(hap_words, site) : 0);
+    if (site == num_sites) {
+      break;
+    }
+    position = next_position(site, hap_words, position);
+  }
+}
+
+void DynamicPbwt::skip_ineligible(std::size_t column, const word_type* query_words, id_type num_eligible,
+                                  bool upwards, id_type& slot, uint32_t& start) const noexcept {
+  if (slot == none || slot < num_eligible) {
+    return;
+  }
+  // the nodes between a node and its insertion neighbours were inserted later
+  do {
+    slot = upwards ? node(column, slot).inserted_above : node(column, slot).inserted_below;
+  } while (slot != none && slot >= num_eligible);
+  if (slot != none) {
+    start = match_start(query_words, slot_words(slot), column);
+  }
+}
+
+void DynamicPbwt::find_long_matches(const word_type* query_words, id_type id_limit, unsigned int k,
+                                    std::vector<Match>& matches) const {
+  if (ids.empty() || k == 0) {
+    return;
+  }
+  // while IDs ascend with slots, those below id_limit are the first num_eligible slots
+  const auto num_eligible = ascending
+                                ? static_cast<id_type>(std::lower_bound(ids.begin(), ids.end(), id_limit) - ids.begin())
+                                : none;
+  // the query is placed after every inserted haplotype in the first column
+  Position position = {tails[0], none, 0, 0};
+  for (std::size_t site = 0; site < num_sites; ++site) {
+    position = next_position(site, query_words, position);
+    const std::size_t column = site + 1;
+    const auto no_match = static_cast<uint32_t>(column);
+    const unsigned int next_allele = column < num_sites ? allele(query_words, column) : 0;
+
+    // Walk away from the query in both directions at once, always taking the longer of the two
+    // next matches, until k haplotypes are found. Equally long matches are taken nearest first
+    // rather than by ID, as haplotypes with identical stretches may run to hundreds.
+    id_type above = position.above;
+    uint32_t above_start = position.divergence;
+    id_type below = position.below;
+    uint32_t below_start = position.divergence_below;
+    skip_ineligible(column, query_words, num_eligible, true, above, above_start);
+    skip_ineligible(column, query_words, num_eligible, false, below, below_start);
+    for (unsigned int found = 0; found < k;) {
+      const bool up = above != none && above_start < no_match &&
+                      (below == none || below_start >= no_match || above_start <= below_start);
+      if (!up && (below == none || below_start >= no_match)) {
+        break;
+      }
+      const id_type slot = up ? above : below;
+      if (ids[slot] < id_limit) {
+        ++found;
+        // matches that do not extend to the next site are maximal
+        if (column == num_sites || node(column, slot).allele != next_allele) {
+          matches.push_back({ids[slot], up ? above_start : below_start, no_match});
+        }
+      }
+      if (up) {
+        above_start = std::max(above_start, static_cast<uint32_t>(node(column, above).divergence));
+        above = node(column, above).above;
+        skip_ineligible(column, query_words, num_eligible, true, above, above_start);
+      }
+      else {
+        below = node(column, below).below;
+        if (below != none) {
+          below_start = std::max(below_start, static_cast<uint32_t>(node(column, below).divergence));
+        }
+        skip_ineligible(column, query_words, num_eligible, false, below, below_start);
+      }
+    }
+  }
+}
@@ -0,0 +1,226 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_DYNAMIC_PBWT_HPP
+#define ARG_NEEDLE_DYNAMIC_PBWT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <limits>
+#include <vector>
+
+namespace BinaryIO {
+class Reader;
+}
+
+/**
+ * @class DynamicPbwt
+ * @brief Positional Burrows-Wheeler transform of a growing set of haplotypes, for finding long
+ * exact matches at site resolution.
+ *
+ * Column k orders the inserted haplotypes by their prefixes over sites [0, k) read backwards, so
+ * that haplotypes sharing long matches ending at site k - 1 are neighbours. Each column is a
+ * doubly linked list rather than an array, as in the d-PBWT of Sanaullah et al. (2021), so that a
+ * haplotype is inserted without shifting the others. A node holds the haplotype's allele at site k
+ * and its divergence: the first site of its longest common suffix with the node above, or k if
+ * there is none. An inserted haplotype takes num_sites + 1 nodes of 24 bytes and a copy of its
+ * packed alleles, allocated in chunks of 2, 4, ..., max_chunk_capacity haplotypes, then
+ * max_chunk_capacity each, laid out column by column so that a column's nodes lie in few places.
+ * Nothing is allocated for IDs that are not inserted beyond the rest of the last chunk.
+ *
+ * A haplotype moves from column k to column k + 1 after the nearest node above it with the same
+ * allele at site k. Like the w pointers of the d-PBWT, which point from every node to the next
+ * column, each node knows the run of equal alleles it belongs to, and the node above a run is the
+ * nearest one above with the other allele, so a site takes O(1) steps. A haplotype inserted into a
+ * run of the other allele splits it and relabels the shorter part, which is O(1) on average and
+ * O(log num_inserted) amortized per site. Divergences are carried over from the previous column
+ * while the neighbours keep matching, and otherwise found by comparing packed alleles backwards,
+ * a word at a time, which happens about once per match ending.
+ *
+ * Each node also keeps its neighbours as of its insertion. While IDs are inserted in ascending
+ * order, the nodes between a node and those neighbours all have higher IDs, so queries limited to
+ * lower IDs jump over them instead of stepping through them.
+ */
+class DynamicPbwt {
+public:
+  typedef uint64_t word_type;
+  typedef uint32_t id_type;
+
+  /**
+   * @brief A maximal exact match over sites [start, end) with haplotype id.
+   */
+  struct Match {
+    id_type id;
+    uint32_t start;
+    uint32_t end;
+  };
+
+  DynamicPbwt() = default;
+
+  /**
+   * @brief Drop all haplotypes, and take num_sites sites packed into words of word_size sites.
+   */
+  void reset(std::size_t num_sites, unsigned int word_size);
+
+  /**
+   * @brief Whether reset() has not been called.
+   */
+  bool empty() const noexcept {
+    return heads.empty();
+  }
+
+  std::size_t num_inserted() const noexcept {
+    return ids.size();
+  }
+
+  /**
+   * @brief The IDs of the inserted haplotypes, in order of insertion.
+   */
+  const std::vector<id_type>& inserted_ids() const noexcept {
+    return ids;
+  }
+
+  std::size_t length() const noexcept {
+    return num_sites;
+  }
+
+  /**
+   * @brief Bytes allocated for the nodes, alleles and runs.
+   */
+  std::size_t memory_usage() const noexcept;
+
+  /**
+   * @brief Append the columns to a binary snapshot.
+   */
+  void write(std::ostream& out) const;
+  /**
+   * @brief Replace the columns with those written by write().
+   *
+   * @throws std::logic_error if the snapshot is truncated or its sizes are inconsistent. The node links
+   * are not checked, so the snapshot must come from a checksummed file.
+   */
+  void read(BinaryIO::Reader& in);
+
+  /**
+   * @brief Insert the haplotype id, whose packed alleles are hap_words. id must not have been
+   * inserted before.
+   */
+  void insert(id_type id, const word_type* hap_words);
+
+  /**
+   * @brief Append to matches the maximal exact matches between the query with packed alleles
+   * query_words and the haplotypes with IDs below id_limit that are among the k longest matches
+   * ending at the same site, in order of end. Which of several equally long matches count among
+   * the k longest is unspecified.
+   *
+   * Each site costs the steps of an insertion plus one per haplotype found. Haplotypes with IDs at
+   * or above id_limit are jumped over while IDs have been inserted in ascending order, and stepped
+   * over otherwise.
+   *
+   * For any range of sites, these include the longest match overlapping the range of k
+   * haplotypes whose matches are as long as those of any other k haplotypes.
+   */
+  void find_long_matches(const word_type* query_words, id_type id_limit, unsigned int k,
+                         std::vector<Match>& matches) const;
+
+private:
+  static constexpr id_type none = std::numeric_limits<id_type>::max();
+
+  struct Node {
+    id_type above;
+    id_type below;
+    id_type inserted_above; // the neighbours when this node was inserted
+    id_type inserted_below;
+    id_type run; // index into the column's run_firsts
+    uint32_t divergence : 31;
+    uint32_t allele : 1;
+  };
+
+  static constexpr id_type max_chunk_capacity = 64;
+
+  // the nodes and packed alleles of consecutive slots
+  struct Chunk {
+    id_type capacity;
+    std::vector<Node> nodes;      // num_sites + 1 columns of capacity nodes
+    std::vector<word_type> words; // capacity rows of num_words()
+  };
+
+  // A place in a column between two nodes, with the divergence of a haplotype placed there and
+  // that of the node below it
+  struct Position {
+    id_type above;
+    id_type below;
+    uint32_t divergence;
+    uint32_t divergence_below;
+  };
+
+  static id_type chunk_capacity(id_type slot) noexcept;
+  static id_type chunk_index(id_type slot) noexcept;
+  static id_type index_in_chunk(id_type slot) noexcept;
+
+  // nodes are addressed by the order of insertion of their haplotype, its slot
+  const Node& node(std::size_t column, id_type slot) const noexcept {
+    const Chunk& chunk = chunks[chunk_index(slot)];
+    return chunk.nodes[column * chunk.capacity + index_in_chunk(slot)];
+  }
+
+  Node& node(std::size_t column, id_type slot) noexcept {
+    Chunk& chunk = chunks[chunk_index(slot)];
+    return chunk.nodes[column * chunk.capacity + index_in_chunk(slot)];
+  }
+
+  const word_type* slot_words(id_type slot) const noexcept {
+    return chunks[chunk_index(slot)].words.data() + index_in_chunk(slot) * num_words();
+  }
+
+  unsigned int allele(const word_type* hap_words, std::size_t site) const noexcept {
+    return static_cast<unsigned int>((hap_words[site / word_size] >> (site % word_size)) & 1u);
+  }
+
+  std::size_t num_words() const noexcept {
+    return (num_sites + word_size - 1) / word_size;
+  }
+
+  // the first site of the longest common suffix of two haplotypes over sites [0, end)
+  uint32_t match_start(const word_type* a, const word_type* b, std::size_t end) const noexcept;
+  // the nearest node at or above slot in column with the given allele, or none
+  id_type nearest_above(std::size_t column, id_type slot, unsigned int with_allele) const noexcept;
+  // the place in column site + 1 of a haplotype with the given alleles, from its place in column site
+  Position next_position(std::size_t site, const word_type* hap_words, const Position& position) const noexcept;
+  void link(std::size_t column, id_type slot, const Position& position, unsigned int hap_allele);
+  void split_run(std::size_t column, id_type above, id_type below);
+  void add_chunk();
+  // move slot past the nodes with slots at or above num_eligible, by their insertion neighbours,
+  // and update the start of the query's match with it
+  void skip_ineligible(std::size_t column, const word_type* query_words, id_type num_eligible, bool upwards,
+                       id_type& slot, uint32_t& start) const noexcept;
+
+  std::size_t num_sites = 0;
+  unsigned int word_size = 64;
+  bool ascending = true;               // whether IDs were inserted in ascending order
+  std::vector<id_type> ids;            // per slot
+  std::vector<Chunk> chunks;
+  std::vector<id_type> heads;          // per column, none if empty
+  std::vector<id_type> tails;
+  std::vector<id_type> last_zeros;     // per column but the last, the last node with allele 0
+  std::vector<std::vector<id_type>> run_firsts; // per column but the last, the first node of each run
+};
+
+#endif // ARG_NEEDLE_DYNAMIC_PBWT_HPP
@@ -27,19 +27,285 @@
 
 #include "FileUtils.hpp"
 
+#include <boost/iostreams/categories.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
+#include <zlib.h>
 
+#include <algorithm>
+#include <array>
 #include <cstdio>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 
 namespace FileUtils {
 
+    namespace {
+        constexpr std::array<unsigned char, 4> bgzfMagic = {31, 139, 8, 4};
+        constexpr char lineIndexMagic[8] = {'A', 'N', 'L', 'I', 'D', 'X', '0', '3'};
+
+        // Number of BGZF blocks (each at most 64 KiB uncompressed) inflated per batch
+        constexpr std::size_t blocksPerBatch = 256;
+
+        std::uint32_t readLittleEndian32(const unsigned char *p) {
+            return static_cast<std::uint32_t>(p[0]) | (static_cast<std::uint32_t>(p[1]) << 8) |
+                   (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+        }
+
+        std::uint16_t readLittleEndian16(const unsigned char *p) {
+            return static_cast<std::uint16_t>(p[0] | (p[1] << 8));
+        }
+
+        // Whether c counts towards a line not being blank, as for the loaders, which skip lines
+        // of whitespace only
+        bool isLineContent(char c) {
+            return c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '\v' && c != '\f';
+        }
+
+        // The modification time of file, used with its size to reject stale indices
+        bool fileStamp(const std::filesystem::path &file, std::uint64_t &size, std::uint64_t &mtime) {
+            std::error_code ec;
+            size = std::filesystem::file_size(file, ec);
+            if (ec) {
+                return false;
+            }
+            mtime = static_cast<std::uint64_t>(std::filesystem::last_write_time(file, ec).time_since_epoch().count());
+            return !ec;
+        }
+
+        struct BgzfBlock {
+            std::uint64_t offset = 0;
+            std::vector<unsigned char> compressed;
+            std::vector<char> data;
+        };
+
+        // Read the next raw BGZF block from fin; returns false at end of file
+        bool readBgzfBlock(std::ifstream &fin, BgzfBlock &block) {
+            std::array<unsigned char, 12> header{};
+            block.offset = static_cast<std::uint64_t>(fin.tellg());
+            if (!fin.read(reinterpret_cast<char *>(header.data()), header.size())) {
+                return false;
+            }
+            if (!std::equal(bgzfMagic.begin(), bgzfMagic.end(), header.begin())) {
+                throw std::runtime_error("Malformed BGZF block header at offset " + std::to_string(block.offset));
+            }
+            std::uint16_t extraLength = readLittleEndian16(header.data() + 10);
+            std::vector<unsigned char> extra(extraLength);
+            fin.read(reinterpret_cast<char *>(extra.data()), extraLength);
+            std::size_t blockSize = 0;
+            for (std::size_t i = 0; i + 4 <= extra.size();) {
+                std::uint16_t fieldLength = readLittleEndian16(extra.data() + i + 2);
+                if (extra[i] == 'B' && extra[i + 1] == 'C' && fieldLength == 2) {
+                    blockSize = static_cast<std::size_t>(readLittleEndian16(extra.data() + i + 4)) + 1;
+                }
+                i += 4 + fieldLength;
+            }
+            if (!fin || blockSize < header.size() + extraLength + 8) {
+                throw std::runtime_error("Malformed BGZF block header at offset " + std::to_string(block.offset));
+            }
+            block.compressed.resize(blockSize - header.size() - extraLength);
+            if (!fin.read(reinterpret_cast<char *>(block.compressed.data()),
+                          static_cast<std::streamsize>(block.compressed.size()))) {
+                throw std::runtime_error("Truncated BGZF block at offset " + std::to_string(block.offset));
+            }
+            return true;
+        }
+
+        void inflateBgzfBlock(BgzfBlock &block) {
+            const std::size_t dataLength = block.compressed.size() - 8;
+            const unsigned char *footer = block.compressed.data() + dataLength;
+            block.data.resize(readLittleEndian32(footer + 4));
+            if (block.data.empty()) {
+                // e.g. the empty end-of-file marker block
+                block.compressed.clear();
+                return;
+            }
+
+            z_stream zs{};
+            if (inflateInit2(&zs, -15) != Z_OK) {
+                throw std::runtime_error("Could not initialise zlib");
+            }
+            zs.next_in = block.compressed.data();
+            zs.avail_in = static_cast<uInt>(dataLength);
+            zs.next_out = reinterpret_cast<Bytef *>(block.data.data());
+            zs.avail_out = static_cast<uInt>(block.data.size());
+            int status = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+            if (status != Z_STREAM_END || zs.avail_out != 0 ||
+                crc32(0L, reinterpret_cast<const Bytef *>(block.data.data()), static_cast<uInt>(block.data.size())) !=
+                    readLittleEndian32(footer)) {
+                throw std::runtime_error("Corrupt BGZF block at offset " + std::to_string(block.offset));
+            }
+            block.compressed.clear();
+            block.compressed.shrink_to_fit();
+        }
+
+        // Read up to blocksPerBatch blocks sequentially, then inflate them on numThreads threads
+        std::vector<BgzfBlock> readBgzfBatch(std::ifstream &fin, unsigned int numThreads) {
+            std::vector<BgzfBlock> batch;
+            BgzfBlock block;
+            while (batch.size() < blocksPerBatch && readBgzfBlock(fin, block)) {
+                batch.push_back(std::move(block));
+            }
+            const std::size_t numWorkers = std::min<std::size_t>(std::max(numThreads, 1u), batch.size());
+            if (numWorkers <= 1) {
+                for (auto &b : batch) {
+                    inflateBgzfBlock(b);
+                }
+                return batch;
+            }
+            std::vector<std::future<void>> workers;
+            for (std::size_t w = 0; w < numWorkers; ++w) {
+                workers.push_back(std::async(std::launch::async, [&batch, w, numWorkers] {
+                    for (std::size_t i = w; i < batch.size(); i += numWorkers) {
+                        inflateBgzfBlock(batch[i]);
+                    }
+                }));
+            }
+            for (auto &f : workers) {
+                f.get();
+            }
+            return batch;
+        }
+
+        // Inflates a BGZF file batch by batch, prefetching the next batch in the background
+        class BgzfReader {
+        public:
+            BgzfReader(std::ifstream &_fin, std::uint64_t offset, unsigned int _numThreads)
+                : fin(_fin), numThreads(_numThreads) {
+                fin.clear();
+                fin.seekg(static_cast<std::streamoff>(offset));
+            }
+
+            ~BgzfReader() {
+                if (prefetch.valid()) {
+                    prefetch.wait();
+                }
+            }
+
+            BgzfReader(const BgzfReader &) = delete;
+            BgzfReader &operator=(const BgzfReader &) = delete;
+
+            std::streamsize read(char *s, std::streamsize n) {
+                std::streamsize numRead = 0;
+                while (numRead < n) {
+                    if (blockIndex == batch.size()) {
+                        if (!nextBatch()) {
+                            break;
+                        }
+                        continue;
+                    }
+                    const std::vector<char> &data = batch[blockIndex].data;
+                    auto count = std::min<std::size_t>(data.size() - position, static_cast<std::size_t>(n - numRead));
+                    std::memcpy(s + numRead, data.data() + position, count);
+                    numRead += static_cast<std::streamsize>(count);
+                    position += count;
+                    if (position == data.size()) {
+                        ++blockIndex;
+                        position = 0;
+                    }
+                }
+                return numRead == 0 ? -1 : numRead;
+            }
+
+        private:
+            bool nextBatch() {
+                if (finished) {
+                    return false;
+                }
+                if (numThreads > 1) {
+                    if (!prefetch.valid()) {
+                        prefetch = startPrefetch();
+                    }
+                    batch = prefetch.get();
+                    if (!batch.empty()) {
+                        prefetch = startPrefetch();
+                    }
+                }
+                else {
+                    batch = readBgzfBatch(fin, numThreads);
+                }
+                blockIndex = 0;
+                position = 0;
+                finished = batch.empty();
+                return !finished;
+            }
+
+            std::future<std::vector<BgzfBlock>> startPrefetch() {
+                return std::async(std::launch::async, [this] { return readBgzfBatch(fin, numThreads); });
+            }
+
+            std::ifstream &fin;
+            unsigned int numThreads;
+            std::vector<BgzfBlock> batch;
+            std::future<std::vector<BgzfBlock>> prefetch;
+            std::size_t blockIndex = 0;
+            std::size_t position = 0;
+            bool finished = false;
+        };
+
+        // Boost source device forwarding to a shared BgzfReader, since boost copies devices
+        class BgzfSource {
+        public:
+            typedef char char_type;
+            typedef boost::iostreams::source_tag category;
+
+            explicit BgzfSource(std::shared_ptr<BgzfReader> _reader) : reader(std::move(_reader)) {
+            }
+
+            std::streamsize read(char *s, std::streamsize n) {
+                try {
+                    return reader->read(s, n);
+                }
+                catch (...) {
+                    // streams swallow exceptions thrown by devices, so end the stream and keep the
+                    // error for AutoGzIfstream to rethrow
+                    *error = std::current_exception();
+                    return -1;
+                }
+            }
+
+            std::shared_ptr<std::exception_ptr> errorSlot() const {
+                return error;
+            }
+
+        private:
+            std::shared_ptr<BgzfReader> reader;
+            std::shared_ptr<std::exception_ptr> error = std::make_shared<std::exception_ptr>();
+        };
+
+        constexpr std::streamsize bgzfBufferSize = 1 << 16;
+    } // namespace
+
     struct AutoGzIfstream::Impl {
-        boost::iostreams::filtering_istream boost_in;
         std::ifstream fin;
+        std::shared_ptr<BgzfReader> bgzf;
+        boost::iostreams::filtering_istream boost_in;
+        std::shared_ptr<std::exception_ptr> bgzfError;
+        std::filesystem::path path;
+        unsigned int numThreads = 1;
+
+        void pushBgzf(std::uint64_t offset) {
+            bgzf = std::make_shared<BgzfReader>(fin, offset, numThreads);
+            BgzfSource source(bgzf);
+            bgzfError = source.errorSlot();
+            boost_in.push(source, bgzfBufferSize);
+        }
+
+        // rethrow a decoding error that ended the stream
+        void checkBgzf() const {
+            if (bgzfError && *bgzfError) {
+                std::rethrow_exception(*bgzfError);
+            }
+        }
     };
 
     AutoGzIfstream::AutoGzIfstream() : pimpl(std::make_unique<Impl>()) {
@@ -52,33 +318,214 @@ namespace FileUtils {
         return f.good();
     }
 
+    bool isBgzf(const std::filesystem::path &file) {
+        std::ifstream f(file.c_str(), std::ios::binary);
+        std::array<unsigned char, 16> header{};
+        if (!f.read(reinterpret_cast<char *>(header.data()), header.size())) {
+            return false;
+        }
+        return std::equal(bgzfMagic.begin(), bgzfMagic.end(), header.begin()) && header[12] == 'B' &&
+               header[13] == 'C' && readLittleEndian16(header.data() + 14) == 2;
+    }
+
+    std::filesystem::path lineIndexPath(const std::filesystem::path &file) {
+        return std::filesystem::path(file.string() + ".lidx");
+    }
+
+    LineIndex buildLineIndex(const std::filesystem::path &file, unsigned int numThreads) {
+        if (!isBgzf(file)) {
+            throw std::runtime_error("Line indices require a BGZF-compressed file: " + file.string());
+        }
+        LineIndex index;
+        if (!fileStamp(file, index.fileSize, index.fileMtime)) {
+            throw std::runtime_error("Could not read the size and modification time of " + file.string());
+        }
+
+        std::ifstream fin(file.c_str(), std::ios::binary);
+        std::uint64_t numNewlines = 0;
+        std::uint64_t numContentLines = 0;
+        bool lineHasContent = false;
+        bool endsWithNewline = true;
+        while (true) {
+            std::vector<BgzfBlock> batch = readBgzfBatch(fin, numThreads);
+            if (batch.empty()) {
+                break;
+            }
+            for (const BgzfBlock &block : batch) {
+                if (block.data.empty()) {
+                    continue;
+                }
+                index.blockOffsets.push_back(block.offset);
+                index.linesBefore.push_back(numContentLines);
+                index.lineContinues.push_back(lineHasContent ? 1 : 0);
+                for (char c : block.data) {
+                    if (c == '\n') {
+                        ++numNewlines;
+                        numContentLines += lineHasContent ? 1 : 0;
+                        lineHasContent = false;
+                    }
+                    else if (isLineContent(c)) {
+                        lineHasContent = true;
+                    }
+                }
+                endsWithNewline = block.data.back() == '\n';
+            }
+        }
+        index.numLines = numNewlines + (endsWithNewline ? 0 : 1);
+        index.numRecords = numContentLines + (lineHasContent ? 1 : 0);
+
+        std::ofstream out(lineIndexPath(file).c_str(), std::ios::binary);
+        auto writeValue = [&out](std::uint64_t value) {
+            out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        };
+        out.write(lineIndexMagic, sizeof(lineIndexMagic));
+        writeValue(index.fileSize);
+        writeValue(index.fileMtime);
+        writeValue(index.numLines);
+        writeValue(index.numRecords);
+        writeValue(index.blockOffsets.size());
+        for (std::size_t i = 0; i < index.blockOffsets.size(); ++i) {
+            writeValue(index.blockOffsets[i]);
+            writeValue(index.linesBefore[i]);
+            writeValue(index.lineContinues[i]);
+        }
+        if (!out) {
+            throw std::runtime_error("Could not write line index " + lineIndexPath(file).string());
+        }
+        return index;
+    }
+
+    bool readLineIndex(const std::filesystem::path &file, LineIndex &index) {
+        std::ifstream in(lineIndexPath(file).c_str(), std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        char magic[sizeof(lineIndexMagic)];
+        std::uint64_t numBlocks = 0;
+        auto readValue = [&in](std::uint64_t &value) {
+            return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+        };
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, lineIndexMagic, sizeof(magic)) != 0 ||
+            !readValue(index.fileSize) || !readValue(index.fileMtime) || !readValue(index.numLines) ||
+            !readValue(index.numRecords) ||
+            !readValue(numBlocks)) {
+            return false;
+        }
+        std::uint64_t fileSize = 0;
+        std::uint64_t fileMtime = 0;
+        if (!fileStamp(file, fileSize, fileMtime) || fileSize != index.fileSize || fileMtime != index.fileMtime ||
+            numBlocks > fileSize) {
+            return false;
+        }
+        index.blockOffsets.resize(numBlocks);
+        index.linesBefore.resize(numBlocks);
+        index.lineContinues.resize(numBlocks);
+        for (std::size_t i = 0; i < numBlocks; ++i) {
+            if (!readValue(index.blockOffsets[i]) || !readValue(index.linesBefore[i]) ||
+                !readValue(index.lineContinues[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     int AutoGzIfstream::lineCount(const std::filesystem::path &file) {
+        LineIndex index;
+        if (readLineIndex(file, index)) {
+            return static_cast<int>(index.numLines);
+        }
         AutoGzIfstream fin;
         fin.openOrExit(file);
         int ctr = 0;
-        std::string line;
-        while (getline(fin, line)) {
-            ctr++;
+        char last = '\n';
+        std::vector<char> buffer(1 << 20);
+        std::streamsize numRead;
+        while ((numRead = fin.read(buffer.data(), static_cast<std::streamsize>(buffer.size()))) > 0) {
+            ctr += static_cast<int>(std::count(buffer.data(), buffer.data() + numRead, '\n'));
+            last = buffer[static_cast<std::size_t>(numRead - 1)];
+        }
+        fin.pimpl->checkBgzf();
+        fin.close();
+        return last == '\n' ? ctr : ctr + 1;
+    }
+
+    std::size_t AutoGzIfstream::recordCount(const std::filesystem::path &file) {
+        LineIndex index;
+        if (readLineIndex(file, index)) {
+            return index.numRecords;
+        }
+        AutoGzIfstream fin;
+        fin.openOrExit(file);
+        std::size_t ctr = 0;
+        bool lineHasContent = false;
+        std::vector<char> buffer(1 << 20);
+        std::streamsize numRead;
+        while ((numRead = fin.read(buffer.data(), static_cast<std::streamsize>(buffer.size()))) > 0) {
+            for (const char *c = buffer.data(); c != buffer.data() + numRead; ++c) {
+                if (*c == '\n') {
+                    ctr += lineHasContent ? 1 : 0;
+                    lineHasContent = false;
+                }
+                else if (isLineContent(*c)) {
+                    lineHasContent = true;
+                }
+            }
         }
+        fin.pimpl->checkBgzf();
         fin.close();
-        return ctr;
+        return lineHasContent ? ctr + 1 : ctr;
     }
 
-    void AutoGzIfstream::openOrExit(const std::filesystem::path &file, std::ios_base::openmode mode) {
+    void AutoGzIfstream::openOrExit(const std::filesystem::path &file, std::ios_base::openmode mode,
+                                    unsigned int numThreads) {
+        pimpl->path = file;
+        pimpl->numThreads = numThreads;
         pimpl->fin.open(file.c_str(), mode);
         if (!pimpl->fin) {
             std::cerr << "ERROR: Unable to open file: " << file << std::endl;
             exit(1);
         }
+        if (file.extension() == ".gz" && isBgzf(file)) {
+            pimpl->pushBgzf(0);
+            return;
+        }
         if (file.extension() == ".gz") {
             pimpl->boost_in.push(boost::iostreams::gzip_decompressor());
         }
         pimpl->boost_in.push(pimpl->fin);
     }
 
+    void AutoGzIfstream::seekToLine(std::size_t line) {
+        const std::uint64_t target = line;
+        std::uint64_t skipped = 0;
+        bool lineContinues = false;
+        LineIndex index;
+        if (line > 0 && pimpl->bgzf && readLineIndex(pimpl->path, index) && !index.blockOffsets.empty()) {
+            // the last block with fewer than `line` non-blank lines ending before it holds the end of
+            // the one before the target, so the target starts after the block does
+            auto it = std::lower_bound(index.linesBefore.begin(), index.linesBefore.end(), target);
+            auto block = static_cast<std::size_t>(std::max<std::ptrdiff_t>(it - index.linesBefore.begin() - 1, 0));
+            pimpl->boost_in.reset();
+            pimpl->bgzf.reset();
+            pimpl->pushBgzf(index.blockOffsets[block]);
+            skipped = index.linesBefore[block];
+            lineContinues = index.lineContinues[block] != 0;
+        }
+        // the first line read may be the rest of one that had content before the block
+        std::string rest;
+        while (skipped < target && std::getline(pimpl->boost_in, rest)) {
+            if (lineContinues || std::any_of(rest.begin(), rest.end(), isLineContent)) {
+                ++skipped;
+            }
+            lineContinues = false;
+        }
+        pimpl->checkBgzf();
+    }
+
     void AutoGzIfstream::close() {
-        pimpl->fin.close();
         pimpl->boost_in.reset();
+        pimpl->bgzf.reset();
+        pimpl->fin.close();
     }
 
     AutoGzIfstream::operator bool() const noexcept {
@@ -87,11 +534,19 @@ namespace FileUtils {
 
     AutoGzIfstream &getline(AutoGzIfstream &in, std::string &s) {
         std::getline(in.pimpl->boost_in, s);
+        in.pimpl->checkBgzf();
         return in;
     }
 
     AutoGzIfstream &AutoGzIfstream::operator>>(std::string &x) {
         pimpl->boost_in >> x;
+        pimpl->checkBgzf();
         return *this;
     }
+
+    std::streamsize AutoGzIfstream::read(char *buffer, std::streamsize count) {
+        pimpl->boost_in.read(buffer, count);
+        pimpl->checkBgzf();
+        return pimpl->boost_in.gcount();
+    }
 } // namespace FileUtils
@@ -28,9 +28,13 @@
 #ifndef ARG_NEEDLE_FILE_UTILS_HPP
 #define ARG_NEEDLE_FILE_UTILS_HPP
 
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <ios>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace FileUtils {
     /**
@@ -41,6 +45,62 @@ namespace FileUtils {
      */
     bool fileExists(const std::filesystem::path &file);
 
+    /**
+     * @brief Check whether a file is BGZF-compressed (blocked gzip, as written by bgzip).
+     *
+     * BGZF files are valid gzip files made of independent blocks of at most 64 KiB, which lets
+     * them be inflated in parallel and accessed at block granularity.
+     *
+     * @param file Path to the file to check.
+     * @return true if the file starts with a BGZF block header, false otherwise.
+     */
+    bool isBgzf(const std::filesystem::path &file);
+
+    /**
+     * @struct LineIndex
+     * @brief Sidecar index mapping line numbers of a BGZF file to the blocks that contain them.
+     *
+     * The index is stored next to the indexed file, at the path given by lineIndexPath.
+     */
+    struct LineIndex {
+        /** Size in bytes and modification time of the indexed file, used to reject stale indices. */
+        std::uint64_t fileSize = 0;
+        std::uint64_t fileMtime = 0;
+        /** Total number of lines, with the same semantics as lineCount. */
+        std::uint64_t numLines = 0;
+        /** Number of non-blank lines, with the same semantics as recordCount. */
+        std::uint64_t numRecords = 0;
+        /** Compressed offset of each non-empty block. */
+        std::vector<std::uint64_t> blockOffsets;
+        /** Number of non-blank lines that end before the start of each block. */
+        std::vector<std::uint64_t> linesBefore;
+        /** 1 if a non-blank line runs into each block from the one before, 0 otherwise. */
+        std::vector<std::uint64_t> lineContinues;
+    };
+
+    /**
+     * @brief Location of the sidecar line index of a file.
+     */
+    std::filesystem::path lineIndexPath(const std::filesystem::path &file);
+
+    /**
+     * @brief Scan a BGZF file and write its sidecar line index.
+     *
+     * @param file Path to a BGZF-compressed file.
+     * @param numThreads Number of threads used to inflate blocks.
+     * @return The index that was written.
+     */
+    LineIndex buildLineIndex(const std::filesystem::path &file, unsigned int numThreads = 1);
+
+    /**
+     * @brief Read the sidecar line index of a file, if there is an up-to-date one.
+     *
+     * @param file Path to the indexed file (not to the index itself).
+     * @param index Receives the index.
+     * @return true if an index was found and matches the current file size and modification time.
+     */
+    bool readLineIndex(const std::filesystem::path &file, LineIndex &index);
+
     /**
      * @class AutoGzIfstream
      * @brief Stream wrapper that transparently reads either plain-text or gzip-compressed files.
@@ -50,7 +110,8 @@ namespace FileUtils {
      * gzip-compressed streams without requiring explicit decompression by the caller.
      *
      * Internally uses a pimpl to hide implementation details and avoid exposing boost
-     * libraries at the interface level.
+     * libraries at the interface level. A BGZF block that cannot be decoded ends the stream and
+     * is thrown as std::runtime_error from the read that reached it.
      */
     class AutoGzIfstream {
         struct Impl;
@@ -70,21 +131,48 @@ namespace FileUtils {
         /**
          * @brief Count the number of lines in a file (supports gzipped and plain files).
          *
+         * Returns in constant time if the file has an up-to-date line index.
+         *
          * @param file Path to the file whose line count will be computed.
          * @return Number of lines in the file.
          */
         [[nodiscard]] static int lineCount(const std::filesystem::path &file);
 
+        /**
+         * @brief Count the lines of a file that are not blank, i.e. the records that the loaders
+         * read, such as the sites of a .hap file (supports gzipped and plain files).
+         *
+         * Returns in constant time if the file has an up-to-date line index.
+         *
+         * @param file Path to the file whose records will be counted.
+         * @return Number of lines holding anything but whitespace.
+         */
+        [[nodiscard]] static std::size_t recordCount(const std::filesystem::path &file);
+
         /**
          * @brief Open a file for reading or exit the program if opening fails.
          *
-         * Automatically detects gzip compression based on file contents.
+         * Automatically detects gzip compression based on file contents. BGZF files are
+         * inflated block-wise, on numThreads threads when numThreads > 1.
          *
          * @param file Path to the file to open.
          * @param mode Stream opening mode (defaults to std::ios::in).
+         * @param numThreads Number of threads used to inflate BGZF blocks.
          */
         void openOrExit(const std::filesystem::path &file,
-                        std::ios_base::openmode mode = std::ios::in);
+                        std::ios_base::openmode mode = std::ios::in, unsigned int numThreads = 1);
+
+        /**
+         * @brief Skip the given number of non-blank lines of a freshly opened stream.
+         *
+         * Lines of whitespace only are not counted, as the loaders skip them, so that line is
+         * the index of a record. Seeks directly to the right block when the file is BGZF with
+         * an up-to-date line index, and otherwise reads and discards the preceding lines.
+         *
+         * @param line Zero-based index among the non-blank lines.
+         * @throws std::runtime_error if a BGZF block cannot be decoded.
+         */
+        void seekToLine(std::size_t line);
 
         /**
          * @brief Close the underlying stream.
@@ -99,6 +187,17 @@ namespace FileUtils {
          */
         AutoGzIfstream &operator>>(std::string &x);
 
+        /**
+         * @brief Read up to count decompressed bytes into a caller-provided buffer.
+         *
+         * Intended for parsers that tokenize large blocks in place instead of line by line.
+         *
+         * @param buffer Destination with room for at least count bytes.
+         * @param count Maximum number of bytes to read.
+         * @return Number of bytes actually read; 0 once the end of the stream is reached.
+         */
+        std::streamsize read(char *buffer, std::streamsize count);
+
         /**
          * @brief Boolean conversion indicating whether the stream is currently valid.
          *
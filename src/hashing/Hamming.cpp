@@ -0,0 +1,146 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Hamming.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ARG_NEEDLE_HAMMING_X86 1
+#include <immintrin.h>
+#endif
+
+namespace Hamming {
+
+namespace {
+
+std::size_t distance_portable(const std::uint64_t* a, const std::uint64_t* b, std::size_t n) noexcept {
+  std::size_t bits = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    bits += static_cast<std::size_t>(__builtin_popcountll(a[i] ^ b[i]));
+  }
+  return bits;
+}
+
+#ifdef ARG_NEEDLE_HAMMING_X86
+
+// Popcount of 4 words at a time by looking up each nibble in a 16-entry table, then summing the
+// bytes of each word with a sum of absolute differences against zero
+__attribute__((target("avx2,popcnt"))) std::size_t distance_avx2(const std::uint64_t* a, const std::uint64_t* b,
+                                                                  std::size_t n) noexcept {
+  const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, //
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i sums = _mm256_setzero_si256();
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                       _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+    const __m256i low = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low_nibbles));
+    const __m256i high = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_nibbles));
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+  }
+  std::size_t bits = static_cast<std::size_t>(_mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                                              _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3));
+  for (; i < n; ++i) {
+    bits += static_cast<std::size_t>(__builtin_popcountll(a[i] ^ b[i]));
+  }
+  return bits;
+}
+
+// 8 words at a time with the vector popcount instruction, and a masked load for the tail
+__attribute__((target("avx512f,avx512vpopcntdq"))) std::size_t
+distance_avx512(const std::uint64_t* a, const std::uint64_t* b, std::size_t n) noexcept {
+  __m512i sums = _mm512_setzero_si512();
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+    sums = _mm512_add_epi64(sums, _mm512_popcnt_epi64(x));
+  }
+  if (i < n) {
+    const __mmask8 tail = static_cast<__mmask8>((1u << (n - i)) - 1);
+    const __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(tail, a + i), _mm512_maskz_loadu_epi64(tail, b + i));
+    sums = _mm512_add_epi64(sums, _mm512_popcnt_epi64(x));
+  }
+  alignas(64) std::uint64_t lanes[8];
+  _mm512_store_si512(lanes, sums);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+}
+
+#endif // ARG_NEEDLE_HAMMING_X86
+
+typedef std::size_t (*DistanceFunction)(const std::uint64_t*, const std::uint64_t*, std::size_t);
+
+DistanceFunction function_of(Implementation implementation) noexcept {
+  switch (implementation) {
+#ifdef ARG_NEEDLE_HAMMING_X86
+  case Implementation::avx512:
+    return distance_avx512;
+  case Implementation::avx2:
+    return distance_avx2;
+#endif
+  default:
+    return distance_portable;
+  }
+}
+
+} // namespace
+
+bool is_supported(Implementation implementation) noexcept {
+  switch (implementation) {
+  case Implementation::portable:
+    return true;
+#ifdef ARG_NEEDLE_HAMMING_X86
+  case Implementation::avx2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+  case Implementation::avx512:
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+  default:
+    return false;
+  }
+}
+
+Implementation best_implementation() noexcept {
+  static const Implementation best = is_supported(Implementation::avx512) ? Implementation::avx512
+                                     : is_supported(Implementation::avx2) ? Implementation::avx2
+                                                                          : Implementation::portable;
+  return best;
+}
+
+const char* name(Implementation implementation) noexcept {
+  switch (implementation) {
+  case Implementation::avx2:
+    return "avx2";
+  case Implementation::avx512:
+    return "avx512";
+  default:
+    return "portable";
+  }
+}
+
+std::size_t distance(const std::uint64_t* a, const std::uint64_t* b, std::size_t n) noexcept {
+  static const DistanceFunction best = function_of(best_implementation());
+  return best(a, b, n);
+}
+
+std::size_t distance_with(Implementation implementation, const std::uint64_t* a, const std::uint64_t* b,
+                          std::size_t n) noexcept {
+  return function_of(implementation)(a, b, n);
+}
+
+} // namespace Hamming
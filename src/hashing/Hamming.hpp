@@ -0,0 +1,61 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_HAMMING_HPP
+#define ARG_NEEDLE_HAMMING_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Hamming distances between runs of packed haplotype words, i.e. the number of sites at which two
+ * haplotypes differ.
+ *
+ * On x86-64, distance() picks the widest implementation the CPU supports when first called:
+ * AVX-512 with vector popcount, AVX2 with a nibble lookup table, or a portable loop. The library
+ * is built without any instruction set flags; the vector implementations are compiled for their
+ * own targets only.
+ */
+namespace Hamming {
+
+enum class Implementation { portable, avx2, avx512 };
+
+/**
+ * @brief Number of bits that differ between a[0, n) and b[0, n).
+ */
+std::size_t distance(const std::uint64_t* a, const std::uint64_t* b, std::size_t n) noexcept;
+
+/**
+ * @brief The implementation that distance() uses on this CPU.
+ */
+Implementation best_implementation() noexcept;
+
+bool is_supported(Implementation implementation) noexcept;
+
+const char* name(Implementation implementation) noexcept;
+
+/**
+ * @brief distance() with a given implementation, which must be supported.
+ */
+std::size_t distance_with(Implementation implementation, const std::uint64_t* a, const std::uint64_t* b,
+                          std::size_t n) noexcept;
+
+} // namespace Hamming
+
+#endif // ARG_NEEDLE_HAMMING_HPP
@@ -18,25 +18,385 @@
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <deque>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
-#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 
+#include "BinaryIO.hpp"
 #include "FileUtils.hpp"
+#include "Hamming.hpp"
 #include "HapData.hpp"
+#include "HapLoader.hpp"
+#include "HapParser.hpp"
 #include "utils.hpp"
 
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Binary cache layout: a CacheHeader, then length-prefixed sample names, then physical positions,
+// genetic positions and site MAFs, then the word matrix starting on a page boundary with rows
+// words_stride words apart, so that mapped rows keep the cache-line alignment of WordMatrix
+constexpr char cache_magic[8] = {'A', 'N', 'H', 'A', 'P', 'B', 'I', 'N'};
+constexpr uint32_t cache_version = 3;
+constexpr uint64_t cache_words_alignment = 4096;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t word_size;
+  uint64_t num_haps;
+  uint64_t num_sites;
+  uint64_t num_words; // per haplotype
+  uint64_t words_stride;
+  uint64_t names_offset;
+  uint64_t names_size;
+  uint64_t physical_offset;
+  uint64_t genetic_offset;
+  uint64_t mafs_offset;
+  uint64_t words_offset;
+  uint64_t source_fingerprint; // of the files the cache was written from, 0 if unknown
+};
+static_assert(sizeof(CacheHeader) == 104, "CacheHeader must not contain padding");
+
+// Hash index snapshot layout: an IndexHeader, then the refinement word sizes, the hashed sites
+// (empty if all are hashed) and the sorted hashed haplotype IDs as length-prefixed arrays, then
+// the index of the match engine: the word index and each refinement's, each LSH table's masks
+// and index, or the PBWT
+constexpr char index_magic[8] = {'A', 'N', 'H', 'A', 'S', 'H', 'I', 'X'};
+constexpr uint32_t index_version = 3;
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t word_size;
+  uint64_t num_sites;
+  uint64_t checksum; // of the data the index was built from
+  uint32_t engine;
+  uint32_t compressed;
+  uint32_t lsh_tables;
+  uint32_t lsh_bits_per_key;
+  uint64_t lsh_seed;
+  double min_maf;
+  uint64_t payload_checksum; // of the bytes after the header
+};
+static_assert(sizeof(IndexHeader) == 72, "IndexHeader must not contain padding");
+
+// A 64-bit checksum of runs of words, mixed in four independent lanes so that long runs are
+// read at memory speed
+class Checksum {
+public:
+  void add(const uint64_t* data, size_t size) noexcept {
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      for (size_t lane = 0; lane < 4; ++lane) {
+        lanes[lane] = mix(lanes[lane], data[i + lane]);
+      }
+    }
+    for (; i < size; ++i) {
+      lanes[i % 4] = mix(lanes[i % 4], data[i]);
+    }
+    length += size;
+  }
+
+  void add(uint64_t value) noexcept {
+    add(&value, 1);
+  }
+
+  // bytes as little-endian words, the last one padded with zeros
+  void add_bytes(const char* data, size_t size) noexcept {
+    uint64_t block[64];
+    while (size > 0) {
+      const size_t n = std::min(size, sizeof(block));
+      block[(n - 1) / 8] = 0;
+      std::memcpy(block, data, n);
+      add(block, (n + 7) / 8);
+      data += n;
+      size -= n;
+    }
+  }
+
+  uint64_t digest() const noexcept {
+    uint64_t h = length;
+    for (uint64_t lane : lanes) {
+      h = mix(h, lane);
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+  }
+
+private:
+  static uint64_t mix(uint64_t h, uint64_t value) noexcept {
+    h ^= value * 0x9e3779b97f4a7c15ull;
+    h = (h << 31) | (h >> 33);
+    return h * 0xc2b2ae3d27d4eb4full;
+  }
+
+  uint64_t lanes[4] = {1, 2, 3, 4};
+  uint64_t length = 0;
+};
+
+// How many word columns ahead to prefetch hash table slots when walking a haplotype's words
+constexpr size_t prefetch_distance = 4;
+
+// Append the low num_bits bits of bits to out at bit position, in words of word_size bits
+inline void append_bits(uint64_t* out, size_t& position, uint64_t bits, unsigned int num_bits,
+                        unsigned int word_size) noexcept {
+  if (num_bits == 0) {
+    return;
+  }
+  const size_t w = position / word_size;
+  const unsigned int offset = static_cast<unsigned int>(position % word_size);
+  const uint64_t word_mask = word_size < 64 ? (uint64_t{1} << word_size) - 1 : ~uint64_t{0};
+  out[w] |= (bits << offset) & word_mask;
+  if (offset + num_bits > word_size) {
+    out[w + 1] |= bits >> (word_size - offset);
+  }
+  position += num_bits;
+}
+
+// Pack the bits of words[i] under masks[i] for each word i, in order, into out
+void gather_bits(const uint64_t* words, const uint64_t* masks, size_t num_words, unsigned int word_size,
+                 uint64_t* out) noexcept {
+  size_t position = 0;
+  for (size_t i = 0; i < num_words; ++i) {
+    uint64_t bits = 0;
+    unsigned int num_bits = 0;
+    for (uint64_t mask = masks[i]; mask != 0; mask &= mask - 1, ++num_bits) {
+      bits |= ((words[i] >> __builtin_ctzll(mask)) & 1u) << num_bits;
+    }
+    append_bits(out, position, bits, num_bits, word_size);
+  }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+// gather_bits with one parallel bit extract per word
+__attribute__((target("bmi2,popcnt"))) void gather_bits_pext(const uint64_t* words, const uint64_t* masks,
+                                                              size_t num_words, unsigned int word_size,
+                                                              uint64_t* out) noexcept {
+  size_t position = 0;
+  for (size_t i = 0; i < num_words; ++i) {
+    append_bits(out, position, _pext_u64(words[i], masks[i]),
+                static_cast<unsigned int>(__builtin_popcountll(masks[i])), word_size);
+  }
+}
+
+bool has_pext() noexcept {
+  static const bool supported = __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+  return supported;
+}
+
+#else
+
+void gather_bits_pext(const uint64_t* words, const uint64_t* masks, size_t num_words, unsigned int word_size,
+                      uint64_t* out) noexcept {
+  gather_bits(words, masks, num_words, word_size, out);
+}
+
+bool has_pext() noexcept {
+  return false;
+}
+
+#endif
+
+uint64_t align_up(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+bool ends_with(const std::string& s, const std::string& suffix) {
+  return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool is_vcf_file(const std::string& path) {
+  return ends_with(path, ".vcf") || ends_with(path, ".vcf.gz");
+}
+
+// the .hap[s][.gz] file of a file set
+std::string find_hap_file(const std::string& file_root_path) {
+  for (const char* suffix : {".hap.gz", ".hap", ".haps.gz", ".haps"}) {
+    if (FileUtils::fileExists(file_root_path + suffix)) {
+      return file_root_path + suffix;
+    }
+  }
+  throw std::logic_error(MAKE_ERROR("Could not find hap file in " + file_root_path + ".hap.gz, " + file_root_path +
+                                    ".hap, " + file_root_path + ".haps.gz, or " + file_root_path + ".haps."));
+}
+
+void open_hap_file(const std::string& file_root_path, unsigned int num_threads, FileUtils::AutoGzIfstream& file_hap) {
+  file_hap.openOrExit(find_hap_file(file_root_path), std::ios::in, num_threads);
+}
+
+// add the alternate alleles of a row of num_cols packed words to the counts of their sites
+void count_alt_alleles(const uint64_t* row, size_t num_cols, unsigned int word_size, uint32_t* counts) noexcept {
+  for (size_t i = 0; i < num_cols; ++i) {
+    for (uint64_t word = row[i]; word != 0; word &= word - 1) {
+      ++counts[i * word_size + static_cast<size_t>(__builtin_ctzll(word))];
+    }
+  }
+}
+
+// A fingerprint of the absolute path, size and modification time of every input file that loading
+// file_root_path and map_file_path can read, and of the site range, so that a binary cache can tell
+// whether it was written from the same files
+uint64_t fingerprint_sources(const std::string& file_root_path, const std::string& map_file_path,
+                             size_t site_begin, size_t site_end) {
+  std::vector<std::string> candidates{file_root_path, map_file_path};
+  for (const char* suffix : {".samples", ".sample", ".hap.gz", ".hap", ".haps.gz", ".haps", ".map.gz", ".map"}) {
+    candidates.push_back(file_root_path + suffix);
+  }
+  Checksum checksum;
+  checksum.add(site_begin);
+  checksum.add(site_end);
+  for (const std::string& candidate : candidates) {
+    std::error_code ec;
+    if (candidate.empty() || !std::filesystem::is_regular_file(candidate, ec)) {
+      continue;
+    }
+    const std::string path = std::filesystem::absolute(candidate, ec).string();
+    const auto size = std::filesystem::file_size(candidate, ec);
+    const auto mtime = std::filesystem::last_write_time(candidate, ec);
+    if (ec) {
+      throw std::logic_error(MAKE_ERROR("Could not read the attributes of " + candidate + "."));
+    }
+    checksum.add(path.size());
+    checksum.add_bytes(path.data(), path.size());
+    checksum.add(size);
+    checksum.add(static_cast<uint64_t>(mtime.time_since_epoch().count()));
+  }
+  return checksum.digest() | 1; // never 0, which marks an unknown source
+}
+
+} // namespace
 
 HapData::HapData(std::string mode, std::string file_root_path, unsigned int _word_size, std::string map_file_path,
-                 bool fill_sites)
+                 bool /* fill_sites */, unsigned int num_threads, size_t site_begin, size_t site_end,
+                 const std::string& engine_name)
     : word_size(_word_size) {
+  set_mode(mode);
+  set_match_engine(engine_name);
+
+  if (is_cache_file(file_root_path)) {
+    if (site_begin > 0 || site_end > 0) {
+      throw std::logic_error(MAKE_ERROR("Site ranges are not supported when loading a binary cache."));
+    }
+    read_cache(file_root_path, map_file_path);
+    return;
+  }
+  if (is_vcf_file(file_root_path)) {
+    if (site_begin > 0 || site_end > 0) {
+      throw std::logic_error(MAKE_ERROR("Site ranges are not supported when loading a VCF."));
+    }
+    read_vcf(file_root_path, map_file_path, num_threads);
+    source_fingerprint = fingerprint_sources(file_root_path, map_file_path, site_begin, site_end);
+    return;
+  }
+  source_fingerprint = fingerprint_sources(file_root_path, map_file_path, site_begin, site_end);
+
+  sample_names = read_samples(file_root_path);
+  num_haps = sample_names.size();
+  read_map(file_root_path, map_file_path);
+
+  // optionally restrict to the half-open range of sites [site_begin, site_end)
+  const bool site_range = site_begin > 0 || site_end > 0;
+  if (site_range) {
+    if (site_end == 0 || site_end > genetic_positions.size()) {
+      site_end = genetic_positions.size();
+    }
+    if (site_begin >= site_end) {
+      throw std::logic_error(MAKE_ERROR("Empty site range."));
+    }
+    genetic_positions = std::vector<double>(genetic_positions.begin() + static_cast<ptrdiff_t>(site_begin),
+                                            genetic_positions.begin() + static_cast<ptrdiff_t>(site_end));
+    physical_positions = std::vector<unsigned long>(physical_positions.begin() + static_cast<ptrdiff_t>(site_begin),
+                                                    physical_positions.begin() + static_cast<ptrdiff_t>(site_end));
+  }
+  num_sites = genetic_positions.size();
+
+  read_haps(file_root_path, num_threads, site_begin, site_range);
+}
+
+HapData::HapData(std::string mode, const GenotypeView& genotypes, std::vector<unsigned long> _physical_positions,
+                 std::vector<double> _genetic_positions, unsigned int _word_size, bool /* fill_sites */,
+                 const std::string& engine_name)
+    : num_haps(genotypes.num_haps), num_sites(genotypes.num_sites), word_size(_word_size),
+      physical_positions(std::move(_physical_positions)), genetic_positions(std::move(_genetic_positions)) {
+  set_mode(mode);
+  set_match_engine(engine_name);
+  if (physical_positions.size() != num_sites || genetic_positions.size() != num_sites) {
+    throw std::logic_error(MAKE_ERROR("Expected one physical and one genetic position per site."));
+  }
+  if (num_haps == 0) {
+    throw std::logic_error(MAKE_ERROR("Expected at least one haplotype."));
+  }
+  for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+    sample_names.push_back("sample_" + std::to_string(hap_id / 2));
+  }
+
+  // pack a word-aligned chunk of sites into bit rows at a time, then hand them to the same
+  // transpose as the file loader
+  const size_t hap_words = (num_haps + 63) / 64;
+  const size_t chunk_sites = 8 * static_cast<size_t>(word_size);
+  std::vector<word_type> site_bits(chunk_sites * hap_words);
+  words = WordMatrix(num_haps, (num_sites + word_size - 1) / word_size);
+  site_mafs.reserve(num_sites);
+  for (size_t first_site = 0; first_site < num_sites; first_site += chunk_sites) {
+    const size_t chunk_end = std::min(num_sites, first_site + chunk_sites);
+    std::fill(site_bits.begin(), site_bits.end(), 0ull);
+    for (size_t site_id = first_site; site_id < chunk_end; ++site_id) {
+      const uint8_t* in = genotypes.data + static_cast<ptrdiff_t>(site_id) * genotypes.site_stride;
+      word_type* row = site_bits.data() + (site_id - first_site) * hap_words;
+      for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+        bool allele;
+        if (genotypes.bit_packed) {
+          allele = (in[static_cast<ptrdiff_t>(hap_id / 8) * genotypes.hap_stride] >> (7 - hap_id % 8)) & 1u;
+        }
+        else {
+          allele = in[static_cast<ptrdiff_t>(hap_id) * genotypes.hap_stride] == 1;
+        }
+        row[hap_id / 64] |= static_cast<word_type>(allele) << (hap_id % 64);
+      }
+    }
+    HapLoader::pack_sites(site_bits.data(), chunk_end - first_site, num_haps, word_size,
+                          words.mutable_row(0) + first_site / word_size, words.stride(), site_mafs);
+  }
+}
+
+HapData::~HapData() {
+  // asynchronous calls still queued use this object, so let the worker finish them
+  {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex);
+    async_stopping = true;
+  }
+  pending_changed.notify_all();
+  if (async_worker.joinable()) {
+    async_worker.join();
+  }
+}
+
+void HapData::set_mode(const std::string& mode) {
   if (mode == "sequence") {
     data_mode = HapDataMode::sequence;
   }
@@ -57,10 +417,9 @@ HapData::HapData(std::string mode, std::string file_root_path, unsigned int _wor
   if (word_size > 64 || word_size <= 0) {
     throw std::logic_error(MAKE_ERROR("Out of bounds word size."));
   }
+}
 
-  std::string line;
-  std::stringstream ss;
-
+std::vector<std::string> HapData::read_samples(const std::string& file_root_path) {
   // read in .sample[s] file
   FileUtils::AutoGzIfstream file_samples;
   if (FileUtils::fileExists(file_root_path + ".samples")) {
@@ -70,29 +429,38 @@ HapData::HapData(std::string mode, std::string file_root_path, unsigned int _wor
     file_samples.openOrExit(file_root_path + ".sample");
   }
   else {
-    std::cerr << "ERROR. Could not find sample file in " + file_root_path + ".sample[s]" << std::endl;
-    exit(1);
+    throw std::logic_error(MAKE_ERROR("Could not find sample file in " + file_root_path + ".sample[s]."));
   }
 
-  while (getline(file_samples, line)) {
-    std::vector<std::string> splitStr;
-    std::istringstream iss(line);
-    std::string buf;
-    while (iss >> buf)
-      splitStr.push_back(buf);
+  std::vector<std::string> names;
+  HapParser::LineReader samples_reader(file_samples);
+  std::string_view line;
+  while (samples_reader.next_line(line)) {
+    std::string_view field[3];
+    for (auto& f : field) {
+      f = HapParser::next_token(line);
+    }
+    if (field[0].empty()) {
+      continue;
+    }
+    if (field[1].empty()) {
+      throw std::logic_error(MAKE_ERROR("Expected at least 2 fields in sample file line."));
+    }
 
     // Skip first two lines (header) if present
-    if ((splitStr[0] == "ID_1" && splitStr[1] == "ID_2" && splitStr[2] == "missing") ||
-        (splitStr[0] == "0" && splitStr[1] == "0" && splitStr[2] == "0")) {
+    if ((field[0] == "ID_1" && field[1] == "ID_2" && field[2] == "missing") ||
+        (field[0] == "0" && field[1] == "0" && field[2] == "0")) {
       continue;
     }
 
-    sample_names.push_back(splitStr[0]);
-    sample_names.push_back(splitStr[1]);
+    names.emplace_back(field[0]);
+    names.emplace_back(field[1]);
   }
-  num_haps = sample_names.size();
   file_samples.close();
+  return names;
+}
 
+void HapData::read_map(const std::string& file_root_path, const std::string& map_file_path) {
   // Parse .map[.gz] file
   FileUtils::AutoGzIfstream file_map;
   if (!map_file_path.empty()) {
@@ -101,8 +469,7 @@ HapData::HapData(std::string mode, std::string file_root_path, unsigned int _wor
       file_map.openOrExit(map_file_path);
     }
     else {
-      std::cerr << "ERROR. Could not open map file " + map_file_path + ", no such file" << std::endl;
-      exit(1);
+      throw std::logic_error(MAKE_ERROR("Could not open map file " + map_file_path + ", no such file."));
     }
   }
   else {
@@ -114,103 +481,789 @@ HapData::HapData(std::string mode, std::string file_root_path, unsigned int _wor
       file_map.openOrExit(file_root_path + ".map");
     }
     else {
-      std::cerr << "ERROR. Could not find map file in " + file_root_path + ".map.gz or " +
-                  file_root_path + ".map"
-           << std::endl;
-      exit(1);
+      throw std::logic_error(
+          MAKE_ERROR("Could not find map file in " + file_root_path + ".map.gz or " + file_root_path + ".map."));
     }
   }
-  std::string map_field[4];
-  while (getline(file_map, line)) {
-    ss.clear();
-    ss.str(line);
-    ss >> map_field[0] >> map_field[1] >> map_field[2] >> map_field[3];
-    genetic_positions.push_back(stod(map_field[2]));
-    physical_positions.push_back(stoul(map_field[3]));
+  HapParser::LineReader map_reader(file_map);
+  std::string_view line;
+  HapParser::MapRecord record{};
+  while (map_reader.next_line(line)) {
+    if (HapParser::parse_map_line(line, record)) {
+      genetic_positions.push_back(record.genetic_position);
+      physical_positions.push_back(record.physical_position);
+    }
   }
-  num_sites = genetic_positions.size();
   file_map.close();
 
-  // read in .hap[s][.gz] file
+}
+
+void HapData::read_haps(const std::string& file_root_path, unsigned int num_threads,
+                        size_t site_begin, bool site_range) {
   FileUtils::AutoGzIfstream file_hap;
-  if (FileUtils::fileExists(file_root_path + ".hap.gz")) {
-    file_hap.openOrExit(file_root_path + ".hap.gz");
+  open_hap_file(file_root_path, num_threads, file_hap);
+
+  if (site_begin > 0) {
+    // direct seek if the hap file is BGZF with a line index, otherwise skips line by line
+    file_hap.seekToLine(site_begin);
   }
-  else if (FileUtils::fileExists(file_root_path + ".hap")) {
-    file_hap.openOrExit(file_root_path + ".hap");
+
+  const size_t num_words = (num_sites + word_size - 1) / word_size;
+  words = WordMatrix(num_haps, num_words);
+  size_t num_loaded_sites = 0;
+  const size_t max_sites = site_range ? num_sites : 0;
+  HapLoader::load(file_hap, num_haps, word_size, num_threads, max_sites, [&](const HapLoader::HapBlock& block) {
+    if (block.first_site + block.num_sites > num_sites) {
+      throw std::logic_error(MAKE_ERROR("Hap file has more sites than the map file (" +
+                                        std::to_string(num_sites) + ")."));
+    }
+    const size_t first_word = block.first_site / word_size;
+    for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      const word_type* block_words = block.words.data() + hap_id * block.num_words;
+      std::copy(block_words, block_words + block.num_words, words.mutable_row(hap_id) + first_word);
+    }
+    site_mafs.insert(site_mafs.end(), block.site_mafs.begin(), block.site_mafs.end());
+    num_loaded_sites += block.num_sites;
+  });
+  if (num_loaded_sites != num_sites) {
+    throw std::logic_error(MAKE_ERROR("Hap file has " + std::to_string(num_loaded_sites) +
+                                      " sites, but the map file has " + std::to_string(num_sites) + "."));
   }
-  else if (FileUtils::fileExists(file_root_path + ".haps.gz")) {
-    file_hap.openOrExit(file_root_path + ".haps.gz");
+  file_hap.close();
+}
+
+void HapData::read_vcf(const std::string& vcf_path, const std::string& map_file_path,
+                       unsigned int num_threads) {
+  if (map_file_path.empty()) {
+    throw std::logic_error(MAKE_ERROR("A map file is required for genetic positions when loading a VCF."));
   }
-  else if (FileUtils::fileExists(file_root_path + ".haps")) {
-    file_hap.openOrExit(file_root_path + ".haps");
+  if (!FileUtils::fileExists(vcf_path)) {
+    throw std::logic_error(MAKE_ERROR("Could not open VCF file " + vcf_path + ", no such file."));
   }
-  else {
-    std::cerr << "ERROR. Could not find hap file in " + file_root_path + ".hap.gz, " + file_root_path +
-                ".hap, " + ".haps.gz, or " + file_root_path + ".haps"
-         << std::endl;
-    exit(1);
-  }
-
-  if (fill_sites) {
-    sites = std::vector<std::vector<bool>>(num_haps, std::vector<bool>());
-  }
-  words = std::vector<std::vector<word_type>>(num_haps, std::vector<word_type>());
-  std::string marker_id;
-  unsigned long int marker_pos;
-  char al[2], inp;
-  unsigned int site_id = 0u;
-  while (getline(file_hap, line)) {
-    // read the meta data
-    ss.clear();
-    ss.str(line);
-    ss >> map_field[0] >> marker_id >> marker_pos >> al[0] >> al[1];
-    if (map_field[0].empty()) {
-      continue;
-    }
 
-    if (site_id % word_size == 0) {
-      for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
-        words[hap_id].push_back(0);
+  // sample names are the columns after FORMAT in the #CHROM header line, one per haplotype
+  FileUtils::AutoGzIfstream file_vcf;
+  file_vcf.openOrExit(vcf_path);
+  {
+    HapParser::LineReader header_reader(file_vcf);
+    std::string_view line;
+    bool found_header = false;
+    while (!found_header && header_reader.next_line(line)) {
+      if (line.substr(0, 2) == "##") {
+        continue;
+      }
+      if (line.substr(0, 6) != "#CHROM") {
+        break;
+      }
+      for (int i = 0; i < 9; ++i) {
+        HapParser::next_token(line);
       }
+      for (std::string_view name = HapParser::next_token(line); !name.empty();
+           name = HapParser::next_token(line)) {
+        sample_names.emplace_back(name);
+        sample_names.emplace_back(name);
+      }
+      found_header = true;
+    }
+    if (!found_header) {
+      throw std::logic_error(MAKE_ERROR("Could not find the #CHROM header line in " + vcf_path + "."));
     }
+  }
+  file_vcf.close();
+  num_haps = sample_names.size();
 
-    int maf_ctr = 0;
-    if (fill_sites) {
-      for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
-        ss >> inp;
-        if (inp == '1') {
-          ++maf_ctr;
-          sites[hap_id].push_back(true);
-          // important to use 1ull, not just 1!
-          words[hap_id][site_id / word_size] ^= (1ull << (site_id % word_size));
+  read_map("", map_file_path);
+  const std::vector<unsigned long> map_physical = std::move(physical_positions);
+  const std::vector<double> map_genetic = std::move(genetic_positions);
+  physical_positions.clear();
+  genetic_positions.clear();
+
+  // every retained site must appear in the map, so the map bounds the number of words
+  words = WordMatrix(num_haps, (map_physical.size() + word_size - 1) / word_size);
+  file_vcf.openOrExit(vcf_path, std::ios::in, num_threads);
+  HapLoader::load(
+      file_vcf, num_haps, word_size, num_threads, 0,
+      [&](const HapLoader::HapBlock& block) {
+        if (block.first_site + block.num_sites > map_physical.size()) {
+          throw std::logic_error(MAKE_ERROR("VCF has more biallelic sites than the map file (" +
+                                            std::to_string(map_physical.size()) + ")."));
         }
-        else {
-          sites[hap_id].push_back(false);
+        const size_t first_word = block.first_site / word_size;
+        for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+          const word_type* block_words = block.words.data() + hap_id * block.num_words;
+          std::copy(block_words, block_words + block.num_words, words.mutable_row(hap_id) + first_word);
         }
-      }
+        site_mafs.insert(site_mafs.end(), block.site_mafs.begin(), block.site_mafs.end());
+        physical_positions.insert(physical_positions.end(), block.physical_positions.begin(),
+                                  block.physical_positions.end());
+      },
+      HapLoader::InputFormat::vcf);
+  file_vcf.close();
+  num_sites = physical_positions.size();
+  words.shrink_cols((num_sites + word_size - 1) / word_size);
+
+  // match sites to map records by physical position; the map may list extra sites, such as
+  // multi-allelic records that were skipped here, but must be in the same order as the VCF
+  genetic_positions.reserve(num_sites);
+  size_t map_id = 0;
+  for (size_t site_id = 0; site_id < num_sites; ++site_id) {
+    while (map_id < map_physical.size() && map_physical[map_id] != physical_positions[site_id]) {
+      ++map_id;
     }
-    else {
-      for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
-        ss >> inp;
-        if (inp == '1') {
-          ++maf_ctr;
-          // important to use 1ull, not just 1!
-          words[hap_id][site_id / word_size] ^= (1ull << (site_id % word_size));
-        }
+    if (map_id == map_physical.size()) {
+      throw std::logic_error(MAKE_ERROR("VCF site at position " + std::to_string(physical_positions[site_id]) +
+                                        " not found in map file " + map_file_path + "."));
+    }
+    genetic_positions.push_back(map_genetic[map_id]);
+    ++map_id;
+  }
+
+}
+
+bool HapData::allele(size_t hap_id, size_t site_id) const {
+  return (words(hap_id, site_id / word_size) >> (site_id % word_size)) & 1ull;
+}
+
+bool HapData::is_cache_file(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(cache_magic)];
+  return in.read(magic, sizeof(magic)) && std::memcmp(magic, cache_magic, sizeof(magic)) == 0;
+}
+
+size_t HapData::count_sites(const std::string& file_root_path) {
+  if (is_cache_file(file_root_path)) {
+    std::ifstream in(file_root_path, std::ios::binary);
+    CacheHeader header{};
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version) {
+      throw std::logic_error(MAKE_ERROR("Could not read the header of binary cache " + file_root_path + "."));
+    }
+    return header.num_sites;
+  }
+  if (is_vcf_file(file_root_path)) {
+    throw std::logic_error(MAKE_ERROR("Counting sites is not supported for VCF input."));
+  }
+  return FileUtils::AutoGzIfstream::recordCount(find_hap_file(file_root_path));
+}
+
+bool HapData::is_cache_current(const std::string& cache_path, const std::string& file_root_path,
+                               const std::string& map_file_path) {
+  std::ifstream in(cache_path, std::ios::binary);
+  CacheHeader header{};
+  if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version) {
+    return false;
+  }
+  return header.source_fingerprint != 0 &&
+         header.source_fingerprint == fingerprint_sources(file_root_path, map_file_path, 0, 0);
+}
+
+void HapData::save(const std::string& path) const {
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  std::string names_blob;
+  for (const std::string& name : sample_names) {
+    const uint64_t length = name.size();
+    names_blob.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    names_blob.append(name);
+  }
+
+  CacheHeader header{};
+  std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+  header.version = cache_version;
+  header.word_size = word_size;
+  header.num_haps = num_haps;
+  header.num_sites = num_sites;
+  header.num_words = words.cols();
+  header.words_stride = words.stride();
+  header.names_offset = sizeof(CacheHeader);
+  header.names_size = names_blob.size();
+  header.physical_offset = align_up(header.names_offset + header.names_size, 8);
+  header.genetic_offset = header.physical_offset + num_sites * sizeof(uint64_t);
+  header.mafs_offset = header.genetic_offset + num_sites * sizeof(double);
+  header.words_offset = align_up(header.mafs_offset + num_sites * sizeof(float), cache_words_alignment);
+  header.source_fingerprint = source_fingerprint;
+
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    throw std::logic_error(MAKE_ERROR("Could not open " + path + " for writing."));
+  }
+  auto pad_to = [&out](uint64_t offset) {
+    const auto position = static_cast<uint64_t>(out.tellp());
+    const std::string padding(offset - position, '\0');
+    out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+  };
+  auto write_bytes = [&out](const void* data, uint64_t size) {
+    out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+  };
+
+  write_bytes(&header, sizeof(header));
+  write_bytes(names_blob.data(), names_blob.size());
+  pad_to(header.physical_offset);
+  const std::vector<uint64_t> physical(physical_positions.begin(), physical_positions.end());
+  write_bytes(physical.data(), physical.size() * sizeof(uint64_t));
+  write_bytes(genetic_positions.data(), genetic_positions.size() * sizeof(double));
+  write_bytes(site_mafs.data(), site_mafs.size() * sizeof(float));
+  pad_to(header.words_offset);
+  write_bytes(words.data(), words.rows() * words.stride() * sizeof(word_type));
+  if (!out) {
+    throw std::logic_error(MAKE_ERROR("Could not write binary cache " + path + "."));
+  }
+}
+
+void HapData::read_cache(const std::string& path, const std::string& map_file_path) {
+  auto file = std::make_shared<boost::iostreams::mapped_file_source>(path);
+  const char* base = file->data();
+  const uint64_t file_size = file->size();
+
+  CacheHeader header{};
+  if (file_size < sizeof(header)) {
+    throw std::logic_error(MAKE_ERROR("Truncated binary cache " + path + "."));
+  }
+  std::memcpy(&header, base, sizeof(header));
+  if (header.version != cache_version) {
+    throw std::logic_error(MAKE_ERROR("Binary cache " + path + " has version " +
+                                      std::to_string(header.version) + ", expected " +
+                                      std::to_string(cache_version) + "."));
+  }
+  if (header.word_size != word_size) {
+    throw std::logic_error(MAKE_ERROR("Binary cache " + path + " was written with word size " +
+                                      std::to_string(header.word_size) + ", but " +
+                                      std::to_string(word_size) + " was requested."));
+  }
+  num_haps = header.num_haps;
+  num_sites = header.num_sites;
+  source_fingerprint = header.source_fingerprint;
+  if (header.num_words != (num_sites + word_size - 1) / word_size || header.words_stride < header.num_words ||
+      header.words_offset + num_haps * header.words_stride * sizeof(word_type) > file_size ||
+      header.mafs_offset + num_sites * sizeof(float) > header.words_offset ||
+      header.names_offset + header.names_size > header.physical_offset) {
+    throw std::logic_error(MAKE_ERROR("Corrupt binary cache " + path + "."));
+  }
+
+  const char* names = base + header.names_offset;
+  const char* names_end = names + header.names_size;
+  while (names < names_end) {
+    uint64_t length = 0;
+    std::memcpy(&length, names, sizeof(length));
+    names += sizeof(length);
+    if (length > static_cast<uint64_t>(names_end - names)) {
+      throw std::logic_error(MAKE_ERROR("Corrupt binary cache " + path + "."));
+    }
+    sample_names.emplace_back(names, length);
+    names += length;
+  }
+
+  std::vector<uint64_t> physical(num_sites);
+  std::memcpy(physical.data(), base + header.physical_offset, num_sites * sizeof(uint64_t));
+  physical_positions.assign(physical.begin(), physical.end());
+  genetic_positions.resize(num_sites);
+  std::memcpy(genetic_positions.data(), base + header.genetic_offset, num_sites * sizeof(double));
+  site_mafs.resize(num_sites);
+  std::memcpy(site_mafs.data(), base + header.mafs_offset, num_sites * sizeof(float));
+
+  // the words are not copied: pages are only faulted in as haplotypes are accessed
+  words = WordMatrix(reinterpret_cast<const word_type*>(base + header.words_offset), num_haps,
+                     header.num_words, header.words_stride, file);
+
+  if (!map_file_path.empty()) {
+    // use genetic positions from a different map
+    physical_positions.clear();
+    genetic_positions.clear();
+    read_map("", map_file_path);
+    if (genetic_positions.size() != num_sites) {
+      throw std::logic_error(MAKE_ERROR("Map file " + map_file_path + " does not have " +
+                                        std::to_string(num_sites) + " sites."));
+    }
+  }
+}
+
+void HapData::append_haplotypes(const std::string& file_root_path, const std::string& map_file_path,
+                                unsigned int num_threads) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (is_cache_file(file_root_path) || is_vcf_file(file_root_path)) {
+    throw std::logic_error(MAKE_ERROR("Only .hap[s] / .sample[s] / .map file sets can be appended."));
+  }
+  std::vector<std::string> new_names = read_samples(file_root_path);
+  const size_t num_new = new_names.size();
+  if (num_new == 0) {
+    return;
+  }
+  if (num_haps + num_new > std::numeric_limits<HashIndex::id_type>::max()) {
+    throw std::logic_error(MAKE_ERROR("Too many haplotypes to append."));
+  }
+
+  // the new map must have our sites, as a run of consecutive sites if this data holds a site range
+  std::vector<unsigned long> kept_physical = std::move(physical_positions);
+  std::vector<double> kept_genetic = std::move(genetic_positions);
+  physical_positions.clear();
+  genetic_positions.clear();
+  try {
+    read_map(file_root_path, map_file_path);
+  }
+  catch (...) {
+    physical_positions = std::move(kept_physical);
+    genetic_positions = std::move(kept_genetic);
+    throw;
+  }
+  const size_t num_batch_sites = physical_positions.size();
+  const size_t site_begin =
+      num_sites == 0 ? 0
+                     : static_cast<size_t>(std::find(physical_positions.begin(), physical_positions.end(),
+                                                     kept_physical.front()) -
+                                           physical_positions.begin());
+  const bool same_sites = num_batch_sites - std::min(site_begin, num_batch_sites) >= num_sites &&
+                          std::equal(kept_physical.begin(), kept_physical.end(),
+                                     physical_positions.begin() + static_cast<ptrdiff_t>(site_begin));
+  physical_positions = std::move(kept_physical);
+  genetic_positions = std::move(kept_genetic);
+  if (!same_sites) {
+    throw std::logic_error(MAKE_ERROR("The sites of " + file_root_path + " do not match the " +
+                                      std::to_string(num_sites) + " sites of the data."));
+  }
+
+  // counts of the existing haplotypes, once, so that later MAFs only need the new ones
+  const size_t num_cols = words.cols();
+  if (site_alt_counts.empty() && num_sites > 0) {
+    site_alt_counts.assign(num_cols * word_size, 0);
+    for (size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      count_alt_alleles(words.row(hap_id), num_cols, word_size, site_alt_counts.data());
+    }
+  }
+  std::vector<uint32_t> new_counts(num_cols * word_size, 0);
+
+  // parse straight into new rows, dropping them again if the file is bad
+  words.resize_rows(num_haps + num_new);
+  try {
+    FileUtils::AutoGzIfstream file_hap;
+    open_hap_file(file_root_path, num_threads, file_hap);
+    if (site_begin > 0) {
+      file_hap.seekToLine(site_begin);
+    }
+    const size_t max_sites = num_batch_sites > num_sites ? num_sites : 0;
+    size_t num_loaded_sites = 0;
+    HapLoader::load(file_hap, num_new, word_size, num_threads, max_sites, [&](const HapLoader::HapBlock& block) {
+      if (block.first_site + block.num_sites > num_sites) {
+        throw std::logic_error(MAKE_ERROR("Hap file has more sites than the data (" + std::to_string(num_sites) + ")."));
+      }
+      const size_t first_word = block.first_site / word_size;
+      for (size_t i = 0; i < num_new; ++i) {
+        const word_type* block_words = block.words.data() + i * block.num_words;
+        std::copy(block_words, block_words + block.num_words, words.mutable_row(num_haps + i) + first_word);
+        count_alt_alleles(block_words, block.num_words, word_size, new_counts.data() + first_word * word_size);
       }
+      num_loaded_sites += block.num_sites;
+    });
+    if (num_loaded_sites != num_sites) {
+      throw std::logic_error(MAKE_ERROR("Hap file has " + std::to_string(num_loaded_sites) + " sites, but the data has " +
+                                        std::to_string(num_sites) + "."));
     }
-    float maf = static_cast<float>(maf_ctr) / static_cast<float>(num_haps);
+    file_hap.close();
+  }
+  catch (...) {
+    words.resize_rows(num_haps);
+    throw;
+  }
+
+  const size_t first_new = num_haps;
+  num_haps += num_new;
+  // no longer the data of the files loaded, so caches saved from now on are never current
+  source_fingerprint = 0;
+  sample_names.insert(sample_names.end(), std::make_move_iterator(new_names.begin()),
+                      std::make_move_iterator(new_names.end()));
+  for (size_t site_id = 0; site_id < num_sites; ++site_id) {
+    site_alt_counts[site_id] += new_counts[site_id];
+    float maf = static_cast<float>(site_alt_counts[site_id]) / static_cast<float>(num_haps);
     if (maf > 0.5f) {
       maf = 1.f - maf;
     }
-    site_mafs.push_back(maf);
-    ++site_id;
+    site_mafs[site_id] = maf;
   }
-  file_hap.close();
+
+  if (!hashed_sites.empty()) {
+    selected_words.resize_rows(num_haps);
+    gather_selected_words(first_new, num_haps);
+  }
+}
+
+void HapData::reserve_haplotypes(size_t total_haps) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  words.reserve_rows(total_haps);
+  if (!hashed_sites.empty()) {
+    selected_words.reserve_rows(total_haps);
+  }
+}
+
+uint64_t HapData::source_checksum(const std::vector<uint32_t>& hap_ids) const {
+  Checksum checksum;
+  checksum.add(word_size);
+  checksum.add(num_sites);
+  for (unsigned long position : physical_positions) {
+    checksum.add(position);
+  }
+  for (uint32_t hap_id : hap_ids) {
+    checksum.add(hap_id);
+    checksum.add(words.row(hap_id), words.cols());
+  }
+  return checksum.digest();
+}
+
+void HapData::save_hash_index(const std::string& path) const {
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  if (!hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("There is no hash index to save before hashing any haplotype."));
+  }
+  std::vector<uint32_t> hap_ids(hashed_hap_ids.begin(), hashed_hap_ids.end());
+  std::sort(hap_ids.begin(), hap_ids.end());
+
+  IndexHeader header{};
+  std::memcpy(header.magic, index_magic, sizeof(index_magic));
+  header.version = index_version;
+  header.word_size = word_size;
+  header.num_sites = num_sites;
+  header.checksum = source_checksum(hap_ids);
+  header.engine = static_cast<uint32_t>(engine);
+  header.compressed = compressed_hashes ? 1 : 0;
+  header.lsh_tables = lsh_tables_per_column;
+  header.lsh_bits_per_key = lsh_bits_per_key;
+  header.lsh_seed = lsh_seed;
+  header.min_maf = min_hashed_maf;
+
+  // the payload is checksummed before the header is written, so that corrupt files are caught
+  // before any of the links they hold are followed
+  std::ostringstream out;
+  BinaryIO::write_vector(out, refinement_word_sizes());
+  BinaryIO::write_vector(out, hashed_sites);
+  BinaryIO::write_vector(out, hap_ids);
+  if (engine == MatchEngine::pbwt) {
+    pbwt.write(out);
+  }
+  for (const LshTable& table : lsh_tables) {
+    BinaryIO::write_vector(out, table.masks);
+    table.hashes.write(out);
+  }
+  if (engine == MatchEngine::hash) {
+    hashes.write(out);
+    for (const Refinement& refinement : refinements) {
+      refinement.hashes.write(out);
+    }
+  }
+  const std::string payload = out.str();
+  Checksum checksum;
+  checksum.add_bytes(payload.data(), payload.size());
+  header.payload_checksum = checksum.digest();
+
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::logic_error(MAKE_ERROR("Could not open " + path + " for writing."));
+  }
+  BinaryIO::write_value(file, header);
+  BinaryIO::write_bytes(file, payload.data(), payload.size());
+  if (!file) {
+    throw std::logic_error(MAKE_ERROR("Could not write hash index " + path + "."));
+  }
+}
+
+void HapData::load_hash_index(const std::string& path, size_t id_limit) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("A hash index must be loaded before hashing any haplotype."));
+  }
+  boost::iostreams::mapped_file_source file(path);
+  BinaryIO::Reader in(file.data(), file.size(), "hash index " + path);
+
+  const auto header = in.read_value<IndexHeader>();
+  if (std::memcmp(header.magic, index_magic, sizeof(index_magic)) != 0) {
+    throw std::logic_error(MAKE_ERROR(path + " is not a hash index."));
+  }
+  if (header.version != index_version) {
+    throw std::logic_error(MAKE_ERROR("Hash index " + path + " has version " + std::to_string(header.version) +
+                                      ", expected " + std::to_string(index_version) + "."));
+  }
+  Checksum payload_checksum;
+  payload_checksum.add_bytes(file.data() + sizeof(IndexHeader), in.bytes_left());
+  in.check(payload_checksum.digest() == header.payload_checksum);
+  std::vector<unsigned int> sizes;
+  std::vector<size_t> sites;
+  std::vector<uint32_t> hap_ids;
+  in.read_vector(sizes);
+  in.read_vector(sites);
+  in.read_vector(hap_ids);
+  if (header.word_size != word_size || header.engine != static_cast<uint32_t>(engine) ||
+      (header.compressed != 0) != compressed_hashes || header.min_maf != min_hashed_maf ||
+      sizes != refinement_word_sizes() ||
+      (engine == MatchEngine::lsh && (header.lsh_tables != lsh_tables_per_column ||
+                                      header.lsh_bits_per_key != lsh_bits_per_key || header.lsh_seed != lsh_seed))) {
+    throw std::logic_error(MAKE_ERROR("Hash index " + path + " was saved with a different hashing configuration."));
+  }
+  if (header.num_sites != num_sites || !std::is_sorted(hap_ids.begin(), hap_ids.end()) ||
+      (!hap_ids.empty() && hap_ids.back() >= num_haps) || header.checksum != source_checksum(hap_ids)) {
+    throw std::logic_error(MAKE_ERROR("Hash index " + path + " is stale: the haplotypes or sites it was built "
+                                      "from have changed."));
+  }
+  if (!hap_ids.empty() && hap_ids.back() >= id_limit) {
+    throw std::logic_error(MAKE_ERROR("Hash index " + path + " holds haplotype " + std::to_string(hap_ids.back()) +
+                                      ", but only haplotypes below " + std::to_string(id_limit) +
+                                      " may be hashed."));
+  }
+  in.check(std::adjacent_find(hap_ids.begin(), hap_ids.end()) == hap_ids.end() &&
+           std::is_sorted(sites.begin(), sites.end()) && (sites.empty() || sites.back() < num_sites));
+
+  // read everything before replacing anything
+  const size_t num_word_sites = sites.empty() ? num_sites : sites.size();
+  const size_t num_cols = (num_word_sites + word_size - 1) / word_size;
+  HashIndex loaded_hashes;
+  std::vector<Refinement> loaded_refinements;
+  std::vector<LshTable> loaded_tables;
+  DynamicPbwt loaded_pbwt;
+  if (engine == MatchEngine::pbwt) {
+    loaded_pbwt.read(in);
+    std::vector<uint32_t> pbwt_ids = loaded_pbwt.inserted_ids();
+    std::sort(pbwt_ids.begin(), pbwt_ids.end());
+    in.check(pbwt_ids == hap_ids && loaded_pbwt.length() == num_word_sites);
+  }
+  else if (engine == MatchEngine::lsh) {
+    loaded_tables.resize(lsh_tables_per_column);
+    for (LshTable& table : loaded_tables) {
+      in.read_vector(table.masks);
+      table.hashes.read(in);
+      in.check(table.masks.size() == num_cols && table.hashes.num_columns() == num_cols);
+    }
+  }
+  else {
+    loaded_hashes.read(in);
+    in.check(loaded_hashes.num_columns() == num_cols);
+    for (unsigned int size : sizes) {
+      loaded_refinements.push_back({size, HashIndex()});
+      loaded_refinements.back().hashes.read(in);
+      in.check(loaded_refinements.back().hashes.num_columns() == (num_word_sites + size - 1) / size);
+    }
+  }
+  in.check(in.bytes_left() == 0);
+
+  select_sites(std::move(sites));
+  hashes = std::move(loaded_hashes);
+  refinements = std::move(loaded_refinements);
+  lsh_tables = std::move(loaded_tables);
+  pbwt = std::move(loaded_pbwt);
+  hashed_hap_ids.clear();
+  hashed_hap_ids.reserve(hap_ids.size());
+  hashed_hap_ids.insert(hap_ids.begin(), hap_ids.end());
+}
+
+bool HapData::hashing_started() const noexcept {
+  return !hashes.empty() || !pbwt.empty() || !lsh_tables.empty();
+}
+
+void HapData::set_compressed_hashes(bool compressed) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("Hash compression must be chosen before hashing any haplotype."));
+  }
+  compressed_hashes = compressed;
+}
+
+void HapData::set_match_engine(const std::string& _engine) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("The match engine must be chosen before hashing any haplotype."));
+  }
+  MatchEngine chosen;
+  if (_engine == "hash") {
+    chosen = MatchEngine::hash;
+  }
+  else if (_engine == "pbwt") {
+    chosen = MatchEngine::pbwt;
+  }
+  else if (_engine == "lsh") {
+    chosen = MatchEngine::lsh;
+  }
+  else {
+    throw std::logic_error(MAKE_ERROR("Match engine must be hash, pbwt or lsh."));
+  }
+  if (chosen != MatchEngine::hash && !refinements.empty()) {
+    throw std::logic_error(MAKE_ERROR("Refinements are only available with the hash engine."));
+  }
+  engine = chosen;
+}
+
+std::string HapData::match_engine() const {
+  switch (engine) {
+  case MatchEngine::pbwt:
+    return "pbwt";
+  case MatchEngine::lsh:
+    return "lsh";
+  default:
+    return "hash";
+  }
+}
+
+void HapData::set_lsh_parameters(unsigned int num_tables, unsigned int bits_per_key, uint64_t seed) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("LSH parameters must be set before hashing any haplotype."));
+  }
+  if (num_tables == 0 || bits_per_key > word_size) {
+    throw std::logic_error(MAKE_ERROR("LSH needs at least one table and at most word_size bits per key."));
+  }
+  lsh_tables_per_column = num_tables;
+  lsh_bits_per_key = bits_per_key;
+  lsh_seed = seed;
+}
+
+unsigned int HapData::lsh_num_tables() const {
+  return lsh_tables_per_column;
+}
+
+void HapData::set_min_maf(double min_maf) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("The hashed sites must be chosen before hashing any haplotype."));
+  }
+  if (!(min_maf >= 0 && min_maf <= 0.5)) {
+    throw std::logic_error(MAKE_ERROR("Minimum MAF must be between 0 and 0.5."));
+  }
+  std::vector<size_t> sites;
+  for (size_t site_id = 0; site_id < num_sites; ++site_id) {
+    if (site_mafs[site_id] >= static_cast<float>(min_maf)) {
+      sites.push_back(site_id);
+    }
+  }
+  if (sites.empty() && num_sites > 0) {
+    throw std::logic_error(MAKE_ERROR("No site has a MAF of at least " + std::to_string(min_maf) + "."));
+  }
+  min_hashed_maf = min_maf;
+  if (sites.size() == num_sites) {
+    sites.clear();
+  }
+  select_sites(std::move(sites));
+}
+
+void HapData::select_sites(std::vector<size_t> sites) {
+  // the layouts of every context were made from the previous words
+  ++layout_generation;
+  hashed_sites = std::move(sites);
+  if (hashed_sites.empty()) {
+    selected_words = WordMatrix();
+    return;
+  }
+
+  selected_words = WordMatrix(num_haps, (hashed_sites.size() + word_size - 1) / word_size);
+  gather_selected_words(0, num_haps);
+}
+
+void HapData::gather_selected_words(size_t begin, size_t end) {
+  // the hashed bits of each word of all sites
+  std::vector<word_type> masks(words.cols(), 0);
+  for (size_t site_id : hashed_sites) {
+    masks[site_id / word_size] |= word_type(1) << (site_id % word_size);
+  }
+  const bool pext = has_pext();
+  for (size_t hap_id = begin; hap_id < end; ++hap_id) {
+    if (pext) {
+      gather_bits_pext(words.row(hap_id), masks.data(), masks.size(), word_size, selected_words.mutable_row(hap_id));
+    }
+    else {
+      gather_bits(words.row(hap_id), masks.data(), masks.size(), word_size, selected_words.mutable_row(hap_id));
+    }
+  }
+}
+
+double HapData::min_maf() const {
+  return min_hashed_maf;
+}
+
+size_t HapData::num_hashed_sites() const noexcept {
+  return hashed_sites.empty() ? num_sites : hashed_sites.size();
 }
 
 void HapData::add_to_hash(size_t hap_id) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  hash_haplotype(hap_id);
+}
+
+void HapData::add_refinement(unsigned int refine_word_size) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (hashing_started()) {
+    throw std::logic_error(MAKE_ERROR("Refinements must be added before hashing any haplotype."));
+  }
+  if (engine != MatchEngine::hash) {
+    throw std::logic_error(MAKE_ERROR("Refinements are only available with the hash engine."));
+  }
+  const unsigned int coarser = refinements.empty() ? word_size : refinements.back().word_size;
+  if (refine_word_size == 0 || refine_word_size >= coarser) {
+    throw std::logic_error(MAKE_ERROR("Refinement word sizes must be positive and decrease."));
+  }
+  refinements.push_back({refine_word_size, HashIndex()});
+}
+
+void HapData::set_rerank_pool(unsigned int pool_size) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  rerank_pool_size = pool_size;
+}
+
+unsigned int HapData::rerank_pool() const {
+  return rerank_pool_size;
+}
+
+std::vector<unsigned int> HapData::refinement_word_sizes() const {
+  std::vector<unsigned int> sizes;
+  for (const Refinement& refinement : refinements) {
+    sizes.push_back(refinement.word_size);
+  }
+  return sizes;
+}
+
+void HapData::reset_hashes() {
+  const size_t num_word_sites = num_hashed_sites();
+  const size_t num_cols = hashed_words().cols();
+  if (engine == MatchEngine::pbwt) {
+    pbwt.reset(num_word_sites, word_size);
+    return;
+  }
+  if (engine == MatchEngine::lsh) {
+    // each table keys a column on bits_per_key of its sites, drawn without replacement
+    const unsigned int bits_per_key = lsh_bits_per_key > 0 ? lsh_bits_per_key : std::max(1u, word_size / 2);
+    std::mt19937_64 rng(lsh_seed);
+    std::vector<unsigned int> sites(word_size);
+    lsh_tables.assign(lsh_tables_per_column, LshTable());
+    for (LshTable& table : lsh_tables) {
+      table.masks.resize(num_cols);
+      for (size_t i = 0; i < num_cols; ++i) {
+        const auto column_sites =
+            static_cast<unsigned int>(std::min<size_t>(word_size, num_word_sites - i * word_size));
+        for (unsigned int j = 0; j < column_sites; ++j) {
+          sites[j] = j;
+        }
+        word_type mask = 0;
+        for (unsigned int j = 0; j < std::min(bits_per_key, column_sites); ++j) {
+          std::swap(sites[j], sites[j + rng() % (column_sites - j)]);
+          mask |= word_type(1) << sites[j];
+        }
+        table.masks[i] = mask;
+      }
+      table.hashes.reset(num_cols, compressed_hashes);
+    }
+    return;
+  }
+  hashes.reset(num_cols, compressed_hashes);
+  for (Refinement& refinement : refinements) {
+    refinement.hashes.reset((num_word_sites + refinement.word_size - 1) / refinement.word_size, compressed_hashes);
+  }
+}
+
+void HapData::hash_haplotype(size_t hap_id) {
   if (hashed_hap_ids.find(hap_id) != hashed_hap_ids.end()) {
     throw std::logic_error(MAKE_ERROR("This haplotype has already been hashed."));
   }
@@ -218,27 +1271,235 @@ void HapData::add_to_hash(size_t hap_id) {
     throw std::logic_error(MAKE_ERROR("Haplotype ID out of bounds."));
   }
 
-  if (hashes.empty()) {
-    hashes = std::vector<std::unordered_map<word_type, std::vector<size_t>>>(
-        words[hap_id].size(), std::unordered_map<word_type, std::vector<size_t>>());
+  if (hap_id > std::numeric_limits<HashIndex::id_type>::max()) {
+    throw std::logic_error(MAKE_ERROR("Haplotype ID does not fit in the hash index."));
+  }
+
+  if (!hashing_started()) {
+    reset_hashes();
   }
 
-  for (size_t i = 0; i < words[hap_id].size(); ++i) {
-    std::vector<size_t>& hash_value =
-        hashes[i][words[hap_id][i]]; // creates if not present, only hashes once
-    hash_value.push_back(hap_id);
+  const WordMatrix& hashed = hashed_words();
+  const word_type* hap_words = hashed.row(hap_id);
+  const auto id = static_cast<HashIndex::id_type>(hap_id);
+  if (engine == MatchEngine::pbwt) {
+    pbwt.insert(id, hap_words);
+    hashed_hap_ids.insert(hap_id);
+    return;
+  }
+  if (engine == MatchEngine::lsh) {
+    for (LshTable& table : lsh_tables) {
+      for (size_t i = 0; i < hashed.cols(); ++i) {
+        table.hashes.insert(i, hap_words[i] & table.masks[i], id);
+      }
+    }
+    hashed_hap_ids.insert(hap_id);
+    return;
+  }
+  for (size_t i = 0; i < hashed.cols(); ++i) {
+    if (i + prefetch_distance < hashed.cols()) {
+      hashes.prefetch(i + prefetch_distance, hap_words[i + prefetch_distance]);
+    }
+    hashes.insert(i, hap_words[i], id);
+  }
+  for (Refinement& refinement : refinements) {
+    const unsigned int size = refinement.word_size;
+    for (size_t j = 0; j < refinement.hashes.num_columns(); ++j) {
+      refinement.hashes.insert(j, refined_word(hap_words, size, j), id);
+    }
   }
 
   hashed_hap_ids.insert(hap_id);
 }
 
+void HapData::add_range_to_hash(size_t begin, size_t end, unsigned int num_threads) {
+  wait_pending();
+  std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+  if (begin > end || end > num_haps) {
+    throw std::logic_error(MAKE_ERROR("Haplotype ID out of bounds."));
+  }
+  if (end - 1 > std::numeric_limits<HashIndex::id_type>::max()) {
+    throw std::logic_error(MAKE_ERROR("Haplotype ID does not fit in the hash index."));
+  }
+  if (begin == end) {
+    return;
+  }
+  // one pass over whichever is smaller, the hashed IDs or the range
+  if (hashed_hap_ids.size() < end - begin || compressed_hashes) {
+    for (size_t hap_id : hashed_hap_ids) {
+      if (hap_id >= begin && hap_id < end) {
+        throw std::logic_error(MAKE_ERROR("This haplotype has already been hashed."));
+      }
+      if (compressed_hashes && hap_id >= end) {
+        throw std::logic_error(MAKE_ERROR("Compressed hashes must be added in increasing ID order."));
+      }
+    }
+  }
+  else {
+    for (size_t hap_id = begin; hap_id < end; ++hap_id) {
+      if (hashed_hap_ids.find(hap_id) != hashed_hap_ids.end()) {
+        throw std::logic_error(MAKE_ERROR("This haplotype has already been hashed."));
+      }
+    }
+  }
+
+  if (!hashing_started()) {
+    reset_hashes();
+  }
+  const WordMatrix& hashed = hashed_words();
+  if (engine == MatchEngine::pbwt) {
+    // each insertion walks through every column, so haplotypes go in one at a time
+    hashed_hap_ids.reserve(hashed_hap_ids.size() + (end - begin));
+    for (size_t hap_id = begin; hap_id < end; ++hap_id) {
+      pbwt.insert(static_cast<DynamicPbwt::id_type>(hap_id), hashed.row(hap_id));
+      hashed_hap_ids.insert(hap_id);
+    }
+    return;
+  }
+
+  // Columns are independent tables, so each thread fills its own run of columns. Within a run,
+  // a cache line of columns is hashed at a time, so each haplotype's words are read once.
+  auto hash_columns = [&](HashIndex& index, const auto& key_of, size_t first_col, size_t last_col) {
+    for (size_t block = first_col; block < last_col; block += WordMatrix::words_per_line) {
+      const size_t block_end = std::min(last_col, block + WordMatrix::words_per_line);
+      for (size_t hap_id = begin; hap_id < end; ++hap_id) {
+        const word_type* hap_words = hashed.row(hap_id);
+        if (hap_id + prefetch_distance < end) {
+          const word_type* ahead = hashed.row(hap_id + prefetch_distance);
+          for (size_t i = block; i < block_end; ++i) {
+            index.prefetch(i, key_of(ahead, i));
+          }
+        }
+        const auto id = static_cast<HashIndex::id_type>(hap_id);
+        for (size_t i = block; i < block_end; ++i) {
+          index.insert(i, key_of(hap_words, i), id);
+        }
+      }
+    }
+  };
+  auto hash_index = [&](HashIndex& index, size_t num_cols, const auto& key_of) {
+    const size_t num_workers = std::min<size_t>(std::max(num_threads, 1u), num_cols);
+    if (num_workers <= 1) {
+      hash_columns(index, key_of, 0, num_cols);
+      return;
+    }
+    // runs start on cache-line boundaries so that threads do not share lines of words
+    const size_t num_blocks = (num_cols + WordMatrix::words_per_line - 1) / WordMatrix::words_per_line;
+    std::vector<std::thread> workers;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    for (size_t t = 0; t < num_workers; ++t) {
+      const size_t first_col = std::min(num_cols, num_blocks * t / num_workers * WordMatrix::words_per_line);
+      const size_t last_col = std::min(num_cols, num_blocks * (t + 1) / num_workers * WordMatrix::words_per_line);
+      workers.emplace_back([&, first_col, last_col]() {
+        try {
+          hash_columns(index, key_of, first_col, last_col);
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      });
+    }
+    for (auto& t : workers) {
+      t.join();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  };
+
+  if (engine == MatchEngine::hash) {
+    hash_index(hashes, hashed.cols(), [](const word_type* hap_words, size_t i) { return hap_words[i]; });
+  }
+  for (LshTable& table : lsh_tables) {
+    const word_type* masks = table.masks.data();
+    hash_index(table.hashes, hashed.cols(),
+               [masks](const word_type* hap_words, size_t i) { return hap_words[i] & masks[i]; });
+  }
+  for (Refinement& refinement : refinements) {
+    const unsigned int size = refinement.word_size;
+    hash_index(refinement.hashes, (num_hashed_sites() + size - 1) / size,
+               [this, size](const word_type* hap_words, size_t j) { return refined_word(hap_words, size, j); });
+  }
+
+  hashed_hap_ids.reserve(hashed_hap_ids.size() + (end - begin));
+  for (size_t hap_id = begin; hap_id < end; ++hap_id) {
+    hashed_hap_ids.insert(hap_id);
+  }
+}
+
+HapData::MemoryUsage HapData::memory_usage() const {
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  MemoryUsage usage;
+  usage.words = words.row_capacity() * words.stride() * sizeof(word_type);
+  usage.words += selected_words.row_capacity() * selected_words.stride() * sizeof(word_type);
+  usage.words_mapped = words.is_view();
+  const HashIndex::MemoryUsage index = hashes.memory_usage();
+  usage.hash_tables = index.tables;
+  usage.posting_lists = index.posting_lists;
+  for (const Refinement& refinement : refinements) {
+    const HashIndex::MemoryUsage refined = refinement.hashes.memory_usage();
+    usage.hash_tables += refined.tables;
+    usage.posting_lists += refined.posting_lists;
+  }
+  for (const LshTable& table : lsh_tables) {
+    const HashIndex::MemoryUsage lsh = table.hashes.memory_usage();
+    usage.hash_tables += lsh.tables + table.masks.capacity() * sizeof(word_type);
+    usage.posting_lists += lsh.posting_lists;
+  }
+  usage.pbwt = pbwt.memory_usage();
+  // one node per ID holding the ID and a link, plus one pointer per bucket
+  usage.hashed_hap_ids = hashed_hap_ids.size() * (sizeof(size_t) + sizeof(void*)) +
+                         hashed_hap_ids.bucket_count() * sizeof(void*);
+  usage.positions = physical_positions.capacity() * sizeof(unsigned long) +
+                    genetic_positions.capacity() * sizeof(double);
+  usage.site_mafs = site_mafs.capacity() * sizeof(float) + site_alt_counts.capacity() * sizeof(uint32_t);
+  usage.sample_names = sample_names.capacity() * sizeof(std::string);
+  for (const std::string& name : sample_names) {
+    // short names are stored inside the string object itself
+    const char* inline_begin = reinterpret_cast<const char*>(&name);
+    if (name.data() < inline_begin || name.data() >= inline_begin + sizeof(std::string)) {
+      usage.sample_names += name.capacity() + 1;
+    }
+  }
+  return usage;
+}
+
+HapData::MemoryUsage HapData::predict_memory_usage(size_t num_haps, size_t num_sites, unsigned int word_size,
+                                                   unsigned int num_threads, bool compressed_hashes,
+                                                   size_t distinct_words) {
+  if (word_size > 64 || word_size == 0) {
+    throw std::logic_error(MAKE_ERROR("Out of bounds word size."));
+  }
+  const size_t num_words = (num_sites + word_size - 1) / word_size;
+  MemoryUsage usage;
+  usage.words = num_haps * WordMatrix::padded_stride(num_words) * sizeof(word_type);
+  if (distinct_words == 0) {
+    distinct_words = word_size < 64 ? std::min<size_t>(num_haps, size_t{1} << word_size) : num_haps;
+  }
+  const HashIndex::MemoryUsage index =
+      HashIndex::predict_memory_usage(num_words, num_haps, distinct_words, compressed_hashes);
+  usage.hash_tables = index.tables;
+  usage.posting_lists = index.posting_lists;
+  usage.hashed_hap_ids = num_haps * (sizeof(size_t) + 2 * sizeof(void*));
+  usage.positions = num_sites * (sizeof(unsigned long) + sizeof(double));
+  usage.site_mafs = num_sites * sizeof(float);
+  usage.sample_names = num_haps * sizeof(std::string);
+  usage.loader_buffers = HapLoader::buffer_bytes(num_haps, word_size, num_threads);
+  return usage;
+}
+
 void HapData::print_hap(size_t hap_id) {
   if (hap_id >= num_haps) {
     throw std::logic_error(MAKE_ERROR("Haplotype ID out of bounds."));
   }
   std::cout << "Bits for hap_id = " << hap_id << std::endl;
   for (size_t site_id = 0; site_id < num_sites; ++site_id) {
-    std::cout << sites[hap_id][site_id];
+    std::cout << allele(hap_id, site_id);
     if (site_id % word_size == word_size - 1) {
       std::cout << " ";
     }
@@ -247,8 +1508,8 @@ void HapData::print_hap(size_t hap_id) {
 
   std::cout << "Words (hex) for hap_id = " << hap_id << std::endl;
   std::cout << std::hex << std::showbase;
-  for (auto const& word : words[hap_id]) {
-    std::cout << word << " ";
+  for (size_t i = 0; i < words.cols(); ++i) {
+    std::cout << words(hap_id, i) << " ";
   }
   std::cout << std::endl;
   std::cout << std::dec << std::noshowbase;
@@ -261,22 +1522,20 @@ void HapData::print_hap(size_t hap_id) {
 }
 
 void HapData::print_hashes() {
-  for (size_t i = 0; i < hashes.size(); ++i) {
-    std::cout << "Hash for word " << i << " of " << hashes.size() << std::endl;
-    for (auto const& map_entry : hashes[i]) {
+  for (size_t i = 0; i < hashes.num_columns(); ++i) {
+    std::cout << "Hash for word " << i << " of " << hashes.num_columns() << std::endl;
+    hashes.for_each_bucket(i, [&](const HashIndex::Bucket& bucket) {
       unsigned long num_bits = word_size;
-      if (i == hashes.size() - 1) {
+      if (i == hashes.num_columns() - 1) {
         num_bits = ((num_sites - 1ul) % word_size) + 1ul;
       }
       for (size_t j = 0; j < num_bits; ++j) {
-        std::cout << ((map_entry.first >> j) & 1);
+        std::cout << ((bucket.key >> j) & 1);
       }
       std::cout << ":";
-      for (const size_t id : map_entry.second) {
-        std::cout << " " << id;
-      }
+      hashes.for_each_id(i, bucket, [](HashIndex::id_type id) { std::cout << " " << id; });
       std::cout << std::endl;
-    }
+    });
     std::cout << std::endl;
   }
 }
@@ -285,7 +1544,7 @@ void HapData::print_word_match_diagram(size_t hap_id1, size_t hap_id2) {
   if (hap_id1 >= num_haps || hap_id2 >= num_haps) {
     throw std::logic_error(MAKE_ERROR("Haplotype ID out of bounds."));
   }
-  for (size_t i = 0; i < words[hap_id1].size(); ++i) {
+  for (size_t i = 0; i < words.cols(); ++i) {
     if (i != 0) {
       if (i % 100 == 0) {
         std::cout << std::endl;
@@ -297,7 +1556,7 @@ void HapData::print_word_match_diagram(size_t hap_id1, size_t hap_id2) {
         std::cout << " ";
       }
     }
-    if (words[hap_id1][i] == words[hap_id2][i]) {
+    if (words(hap_id1, i) == words(hap_id2, i)) {
       std::cout << "x";
     }
     else {
@@ -307,13 +1566,25 @@ void HapData::print_word_match_diagram(size_t hap_id1, size_t hap_id2) {
   std::cout << std::endl;
 }
 
-std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
-HapData::get_closest_cousins(size_t hap_id, unsigned int k, unsigned int tolerance,
-                             double window_size_genetic) {
+const HapData::QueryContext::WindowLayout& HapData::window_layout(QueryContext& context,
+                                                                  double window_size_genetic) const {
+  if (std::isnan(window_size_genetic)) {
+    throw std::logic_error(MAKE_ERROR("Window size must be a number."));
+  }
+  if (window_size_genetic < 0) {
+    window_size_genetic = 0;
+  }
+  auto cached = context.layouts.find(window_size_genetic);
+  if (cached != context.layouts.end()) {
+    return cached->second;
+  }
 
   // find the windows
   std::vector<Window> windows; // Window defined in HapData.hpp
-  size_t num_words = words[hap_id].size();
+  size_t num_words = hashed_words().cols();
+  // genetic position of bit i of the hashed words
+  const size_t num_word_sites = num_hashed_sites();
+  auto genetic_position = [&](size_t i) { return genetic_positions[hashed_site(i)]; };
   if (window_size_genetic <= 0) {
     // make a new window for each and every word
     for (size_t j = 0; j < num_words; ++j) {
@@ -326,14 +1597,14 @@ HapData::get_closest_cousins(size_t hap_id, unsigned int k, unsigned int toleran
   }
   else {
     size_t start_word = 0;
-    double start_genetic = genetic_positions[0];
+    double start_genetic = genetic_position(0);
     size_t window_index = 0;
     for (size_t j = 0; j < num_words; ++j) {
-      size_t last_word_site = std::min<size_t>((j + 1) * word_size - 1, num_sites - 1);
+      size_t last_word_site = std::min<size_t>((j + 1) * word_size - 1, num_word_sites - 1);
       // explanation: we need to leave enough room for the last window
       if (j == num_words - 1 ||
-          (genetic_positions[last_word_site] - start_genetic >= window_size_genetic &&
-           genetic_positions[num_sites - 1] - genetic_positions[last_word_site + 1] >=
+          (genetic_position(last_word_site) - start_genetic >= window_size_genetic &&
+           genetic_position(num_word_sites - 1) - genetic_position(last_word_site + 1) >=
                window_size_genetic)) {
         Window w{};
         w.start = start_word;
@@ -342,8 +1613,8 @@ HapData::get_closest_cousins(size_t hap_id, unsigned int k, unsigned int toleran
         windows.push_back(w);
         window_index += 1;
         start_word = j + 1;
-        if (last_word_site + 1 < num_sites) {
-          start_genetic = genetic_positions[last_word_site + 1];
+        if (last_word_site + 1 < num_word_sites) {
+          start_genetic = genetic_position(last_word_site + 1);
         }
       }
     }
@@ -356,148 +1627,553 @@ HapData::get_closest_cousins(size_t hap_id, unsigned int k, unsigned int toleran
       words_to_windows.push_back(i);
     }
   }
+  QueryContext::WindowLayout& layout = context.layouts[window_size_genetic];
+  layout.windows = std::move(windows);
+  layout.words_to_windows = std::move(words_to_windows);
+  return layout;
+}
 
-  // how high each sample scores in each window
-  // we only record samples that have matched
-  std::vector<std::unordered_map<size_t, size_t>> window_scores(
-      windows.size(), std::unordered_map<size_t, size_t>());
-  // stretches of matching material separated by 2*k + 1 fillers, where k is the number
-  // of mismatches, max size defined by 2*tolerance + 1
-  std::vector<std::deque<std::pair<size_t, size_t>>> stretches(hap_id, std::deque<std::pair<size_t, size_t>>());
+std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
+HapData::get_closest_cousins(size_t hap_id, unsigned int k, unsigned int tolerance,
+                             double window_size_genetic, unsigned int min_cousins, double min_score_per_word) {
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  std::lock_guard<std::mutex> context_lock(context_mutex);
+  return find_closest_cousins(query_context, hap_id, k, tolerance, window_size_genetic, min_cousins,
+                              min_score_per_word);
+}
 
-  // size_t num_overall_matches = 0;
-  for (size_t i = 0; i < num_words; ++i) {
+std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
+HapData::get_closest_cousins(QueryContext& context, size_t hap_id, unsigned int k, unsigned int tolerance,
+                             double window_size_genetic, unsigned int min_cousins,
+                             double min_score_per_word) const {
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  return find_closest_cousins(context, hap_id, k, tolerance, window_size_genetic, min_cousins, min_score_per_word);
+}
+
+std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
+HapData::find_closest_cousins(QueryContext& context, size_t hap_id, unsigned int k, unsigned int tolerance,
+                              double window_size_genetic, unsigned int min_cousins,
+                              double min_score_per_word) const {
+  if (hap_id >= num_haps) {
+    throw std::logic_error(MAKE_ERROR("Haplotype ID out of bounds."));
+  }
+  if (context.owner != this || context.layout_generation != layout_generation) {
+    context.layouts.clear();
+    context.owner = this;
+    context.layout_generation = layout_generation;
+  }
+  const QueryContext::WindowLayout& layout = window_layout(context, window_size_genetic);
+  const std::vector<Window>& windows = layout.windows;
+  if (context.window_candidates.size() < windows.size()) {
+    context.window_candidates.resize(windows.size());
+  }
+  for (size_t i = 0; i < windows.size(); ++i) {
+    context.window_candidates[i].clear();
+  }
+  if (engine == MatchEngine::pbwt) {
+    // enough matches for the re-ranking pool as well
+    score_pbwt_matches(context, layout.words_to_windows.data(), hap_id, std::max(k, rerank_pool_size));
+  }
+  else if (engine == MatchEngine::lsh) {
+    score_lsh_matches(context, windows, hap_id);
+  }
+  else {
+    const WordMatrix& hashed = hashed_words();
+    score_matches(context, hashes, hashed.row(hap_id), 0, hashed.cols(), layout.words_to_windows.data(), hap_id,
+                  tolerance);
+  }
+
+  std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>> results;
+  results.reserve(windows.size());
+  const size_t num_cols = hashed_words().cols();
+  for (const Window& w : windows) {
+    // sites that are not hashed belong to the window of the hashed site before them
+    size_t window_start_site = column_start_site(w.start);
+    size_t window_end_site = w.end < num_cols ? column_start_site(w.end) - 1 : num_sites - 1;
+    results.emplace_back(window_start_site, window_end_site, std::vector<std::pair<size_t, double>>());
+    select_top_k(context, w.index, k, std::get<2>(results.back()));
+  }
+  if (!refinements.empty() && (min_cousins > 0 || min_score_per_word > 0)) {
+    refine_failing_windows(context, hap_id, k, tolerance, layout, min_cousins, min_score_per_word, results);
+  }
+  if (rerank_pool_size > 0 && k > 0) {
+    for (const Window& w : windows) {
+      rerank(context, hap_id, k, w, windows.size(), std::get<2>(results[w.index]));
+    }
+  }
+  return results;
+}
+
+void HapData::refine_failing_windows(
+    QueryContext& context, size_t hap_id, unsigned int k, unsigned int tolerance,
+    const QueryContext::WindowLayout& layout, unsigned int min_cousins, double min_score_per_word,
+    std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>& results) const {
+  const std::vector<Window>& windows = layout.windows;
+  // Re-score the failing windows at each finer word size in turn. Neighbouring failing windows
+  // are scanned together, over the finer words that start in them.
+  std::vector<unsigned int>& scored_word_sizes = context.scored_word_sizes;
+  scored_word_sizes.assign(windows.size(), word_size);
+  const size_t num_word_sites = num_hashed_sites();
+  // the first word of a word size that starts at or after the start of word c
+  auto first_word = [&](size_t c, unsigned int size) {
+    return std::min<size_t>((c * word_size + size - 1) / size, (num_word_sites + size - 1) / size);
+  };
+  auto fails = [&](const Window& w) {
+    const std::vector<std::pair<size_t, double>>& cousins = std::get<2>(results[w.index]);
+    double score_sum = 0;
+    for (const auto& cousin : cousins) {
+      score_sum += cousin.second;
+    }
+    const unsigned int size = scored_word_sizes[w.index];
+    const size_t num_window_words = first_word(w.end, size) - first_word(w.start, size);
+    return cousins.size() < min_cousins || score_sum < min_score_per_word * static_cast<double>(num_window_words);
+  };
+  const word_type* hap_words = hashed_words().row(hap_id);
+  for (const Refinement& refinement : refinements) {
+    const unsigned int size = refinement.word_size;
+    const size_t num_refined_words = (num_word_sites + size - 1) / size;
+    if (context.refined_words.size() < num_refined_words) {
+      context.refined_words.resize(num_refined_words);
+      context.refined_words_to_windows.resize(num_refined_words);
+    }
+    for (size_t group_start = 0; group_start < windows.size();) {
+      if (!fails(windows[group_start])) {
+        ++group_start;
+        continue;
+      }
+      size_t group_end = group_start + 1;
+      while (group_end < windows.size() && fails(windows[group_end])) {
+        ++group_end;
+      }
+      const size_t first = first_word(windows[group_start].start, size);
+      const size_t last = first_word(windows[group_end - 1].end, size);
+      for (size_t j = first; j < last; ++j) {
+        context.refined_words[j] = refined_word(hap_words, size, j);
+        context.refined_words_to_windows[j] = layout.words_to_windows[j * size / word_size];
+      }
+      for (size_t i = group_start; i < group_end; ++i) {
+        context.window_candidates[i].clear();
+      }
+      score_matches(context, refinement.hashes, context.refined_words.data(), first, last,
+                    context.refined_words_to_windows.data(), hap_id, tolerance);
+      for (size_t i = group_start; i < group_end; ++i) {
+        // a window too narrow to hold a word of this size keeps its earlier cousins
+        if (first_word(windows[i].start, size) < first_word(windows[i].end, size)) {
+          select_top_k(context, i, k, std::get<2>(results[i]));
+          scored_word_sizes[i] = size;
+        }
+      }
+      group_start = group_end;
+    }
+  }
+}
+
+HapData::word_type HapData::refined_word(const word_type* hap_words, unsigned int refine_word_size,
+                                         size_t j) const {
+  const size_t first_site = j * refine_word_size;
+  const size_t num_bits = std::min<size_t>(refine_word_size, num_hashed_sites() - first_site);
+  const word_type word_mask = word_size < 64 ? (word_type{1} << word_size) - 1 : ~word_type{0};
+  size_t w = first_site / word_size;
+  const size_t offset = first_site % word_size;
+  word_type bits = (hap_words[w] & word_mask) >> offset;
+  for (size_t got = word_size - offset; got < num_bits; got += word_size) {
+    bits |= (hap_words[++w] & word_mask) << got;
+  }
+  return bits & ((word_type{1} << num_bits) - 1);
+}
+
+void HapData::score_matches(QueryContext& context, const HashIndex& index, const word_type* query_words,
+                            size_t first_word, size_t last_word, const size_t* words_to_windows, size_t hap_id,
+                            unsigned int tolerance) const {
+  // scratch space left over from the previous query is empty, apart from stale candidates.
+  // Queued runs are at most tolerance mismatches apart and gaps count at least one mismatch, so a
+  // queue holds at most tolerance + 1 runs plus the one just pushed
+  context.runs.prepare(hap_id, std::min<size_t>(static_cast<size_t>(tolerance) + 2, last_word - first_word + 1));
+  if (context.first_range.size() < hap_id) {
+    context.first_range.resize(hap_id);
+    context.last_range.resize(hap_id);
+  }
+  QueryContext::RunQueues& runs = context.runs;
+  std::vector<size_t>& touched_haps = context.touched_haps;
+  std::vector<QueryContext::ClosedRange>& ranges = context.ranges;
+  constexpr size_t no_range = std::numeric_limits<size_t>::max();
+
+  // Each run of matching words of haplotype v starts a range that extends over the following
+  // runs, as long as at most `tolerance` words in between mismatch. Once a later run is out of
+  // reach, the range of the front run is final and ends where the run before that one ends, since
+  // all queued runs are within reach of each other. Ranges still open at the end of the query run
+  // up to the last run. Either way, the ranges of a haplotype close in order of start and of end.
+  auto close_runs = [&](size_t v, size_t range_end, size_t reach_mismatches) {
+    while (!runs.empty(v) && reach_mismatches - runs.front(v).mismatches > tolerance) {
+      if (context.first_range[v] == no_range) {
+        context.first_range[v] = ranges.size();
+      }
+      else {
+        ranges[context.last_range[v]].next = ranges.size();
+      }
+      context.last_range[v] = ranges.size();
+      ranges.push_back({runs.front(v).start, range_end, no_range});
+      runs.pop_front(v);
+    }
+  };
+
+  for (size_t i = first_word; i < last_word; ++i) {
+    if (i + prefetch_distance < last_word) {
+      index.prefetch(i + prefetch_distance, query_words[i + prefetch_distance]);
+    }
     // in some cases, the word does not yet exist in the hashmap
-    if (hashes[i].find(words[hap_id][i]) != hashes[i].end()) {
-      const std::vector<size_t>& matches = hashes[i].find(words[hap_id][i])->second;
-      for (auto v : matches) {
-        // check the end of stretches to figure out what to do
-        if (stretches[v].empty()) {
-          stretches[v].emplace_back(i, i + 1); // end is exclusive
+    if (const HashIndex::Bucket* matches = index.find(i, query_words[i])) {
+      index.for_each_id(i, *matches, [&](size_t v) {
+        if (v >= hap_id) {
+          return;
+        }
+        if (runs.empty(v)) {
+          // queues never run empty again before the end of the query, so this is the first match
+          touched_haps.push_back(v);
+          context.first_range[v] = no_range;
+          runs.push_back(v, {i, i + 1, 0});
+          return;
+        }
+        QueryContext::MatchRun& last = runs.back(v);
+        if (last.end == i) {
+          last.end = i + 1; // end is exclusive
+          return;
+        }
+        // beyond tolerance + 1, the length of a gap makes no difference
+        const size_t mismatches = last.mismatches + std::min<size_t>(tolerance + 1, i - last.end);
+        const size_t range_end = last.end;
+        runs.push_back(v, {i, i + 1, mismatches});
+        close_runs(v, range_end, mismatches);
+      });
+    }
+  }
+
+  // Close the remaining runs, then score each haplotype's ranges in the windows they overlap.
+  // Haplotypes are scored one at a time, so a haplotype that already scored in a window is that
+  // window's last candidate.
+  std::sort(touched_haps.begin(), touched_haps.end());
+  for (size_t v : touched_haps) {
+    close_runs(v, runs.back(v).end, std::numeric_limits<size_t>::max());
+    for (size_t r = context.first_range[v]; r != no_range; r = ranges[r].next) {
+      const size_t range_start = ranges[r].start;
+      const size_t range_end = ranges[r].end;
+      const size_t range_size = range_end - range_start;
+
+      // we're given a half-open range [range_start, range_end)
+      // we want to get the windows that overlap with this range
+      // let's say windows are [0, 5), [5, 10), [10, 15), [15, 20)
+      // if our range is [4, 14), we want [0, 5) to [10, 15) inclusive
+      // if our range is [5, 15), we want [5, 10) to [10, 15) inclusive
+      // if our range is [6, 16), we want [5, 10) to [15, 20) inclusive
+      for (size_t window_index = words_to_windows[range_start];
+           window_index <= words_to_windows[range_end - 1]; ++window_index) {
+        std::vector<QueryContext::Candidate>& candidates = context.window_candidates[window_index];
+        if (!candidates.empty() && candidates.back().hap_id == v) {
+          candidates.back().score = std::max(candidates.back().score, range_size);
         }
         else {
-          std::pair<size_t, size_t>& back_pair = stretches[v].back();
-          if (back_pair.second == i) {
-            back_pair.second = i + 1; // end is exclusive
-          }
-          else {
-            // we transform the number of mismatches, k, to 2*k - 1
-            // then if the total number of mismatches is T, the total length L
-            // of the stretches vector satisfies L = 2*T + 1 (assuming we start
-            // and end with a match)
-            // k = tolerance + 1 is the maximum we go up to since 2*k - 1 = 2*tolerance + 1
-            // (actually all we need is 2*tolerance, but yeah better safe than sorry)
-            size_t num_mismatches = std::min<size_t>(tolerance + 1, i - back_pair.second);
-            size_t num_to_push = 2 * num_mismatches - 1;
-            for (size_t push_reps = 0; push_reps < num_to_push; ++push_reps) {
-              stretches[v].emplace_back(0, 0); // "NaN" value
-            }
-            stretches[v].emplace_back(i, i + 1); // end is exclusive
-            // note: an improved algorithm is to pop first and process, then push
-            // that way we only ever have to look at the front and the back
-          }
+          candidates.push_back({v, range_size});
         }
+      }
+    }
+  }
+  touched_haps.clear();
+  ranges.clear();
+}
 
-        // pop_front to get to size 2*tolerance + 1
-        while (stretches[v].size() > 2 * tolerance + 1) {
-          std::pair<size_t, size_t>& item = stretches[v].front();
-          if (item.second != 0) {
-            size_t range_start = item.first;
-            // old version was buggy
-            // size_t range_end = stretches[v].back().second;
-            // new version is not ideal for complexity if tolerance is large
-            size_t range_end = 0;
-            for (size_t j = 0; j < 2 * tolerance + 1; ++j) {
-              range_end = std::max(range_end, stretches[v][j].second);
-            }
-            size_t range_size = range_end - range_start;
-
-            // we're given a half-open range [range_start, range_end)
-            // we want to get the windows that overlap with this range
-            // let's say windows are [0, 5), [5, 10), [10, 15), [15, 20)
-            // if our range is [4, 14), we want [0, 5) to [10, 15) inclusive
-            // if our range is [5, 15), we want [5, 10) to [10, 15) inclusive
-            // if our range is [6, 16), we want [5, 10) to [15, 20) inclusive
-            for (size_t window_index = words_to_windows[range_start];
-                 window_index <= words_to_windows[range_end - 1]; ++window_index) {
-              size_t& best_len =
-                  window_scores[window_index][v]; // creates if not present, only hashes once
-              if (range_size > best_len) {
-                best_len = range_size;
-              }
+void HapData::score_lsh_matches(QueryContext& context, const std::vector<Window>& windows, size_t hap_id) const {
+  if (lsh_tables.empty()) {
+    return;
+  }
+  if (context.collisions.size() < hap_id) {
+    context.collisions.resize(hap_id);
+  }
+  std::vector<size_t>& touched_haps = context.touched_haps;
+  const word_type* query_words = hashed_words().row(hap_id);
+  for (const Window& w : windows) {
+    for (size_t i = w.start; i < w.end; ++i) {
+      for (const LshTable& table : lsh_tables) {
+        if (i + prefetch_distance < w.end) {
+          table.hashes.prefetch(i + prefetch_distance,
+                                query_words[i + prefetch_distance] & table.masks[i + prefetch_distance]);
+        }
+        if (const HashIndex::Bucket* matches = table.hashes.find(i, query_words[i] & table.masks[i])) {
+          table.hashes.for_each_id(i, *matches, [&](size_t v) {
+            if (v < hap_id && context.collisions[v]++ == 0) {
+              touched_haps.push_back(v);
             }
-          }
-          stretches[v].pop_front();
+          });
         }
       }
     }
+    for (size_t v : touched_haps) {
+      context.window_candidates[w.index].push_back({v, context.collisions[v]});
+      context.collisions[v] = 0;
+    }
+    touched_haps.clear();
+  }
+}
+
+void HapData::score_pbwt_matches(QueryContext& context, const size_t* words_to_windows, size_t hap_id,
+                                 unsigned int k) const {
+  std::vector<DynamicPbwt::Match>& matches = context.pbwt_matches;
+  matches.clear();
+  if (pbwt.empty()) {
+    return;
   }
+  pbwt.find_long_matches(hashed_words().row(hap_id), static_cast<DynamicPbwt::id_type>(hap_id), k, matches);
 
-  // go over all the stretches and pop_front
-  for (size_t v = 0; v < hap_id; ++v) {
-    while (!stretches[v].empty()) {
-      std::pair<size_t, size_t> item = stretches[v].front();
-      if (item.second != 0) {
-        size_t range_start = item.first;
-        // old version is buggy in general, but should work in this case
-        size_t range_end = stretches[v].back().second;
-        // new version is not ideal for complexity if tolerance is large
-        // size_t range_end = 0;
-        // for (size_t j = 0; j < stretches[v].size(); ++j) {
-        //   range_end = std::max(range_end, stretches[v][j].second);
-        // }
-        size_t range_size = range_end - range_start;
-
-        // we're given a half-open range [range_start, range_end)
-        // we want to get the windows that overlap with this range
-        // let's say windows are [0, 5), [5, 10), [10, 15), [15, 20)
-        // if our range is [4, 14), we want [0, 5) to [10, 15) inclusive
-        // if our range is [5, 15), we want [5, 10) to [10, 15) inclusive
-        // if our range is [6, 16), we want [5, 10) to [15, 20) inclusive
-        for (size_t window_index = words_to_windows[range_start];
-             window_index <= words_to_windows[range_end - 1]; ++window_index) {
-          size_t& hash_value =
-              window_scores[window_index][v]; // creates if not present, only hashes once
-          if (range_size > hash_value) {
-            hash_value = range_size;
-          }
+  // As in score_matches, haplotypes are scored one at a time and their matches in order, so a
+  // haplotype that already scored in a window is that window's last candidate
+  std::sort(matches.begin(), matches.end(), [](const DynamicPbwt::Match& a, const DynamicPbwt::Match& b) {
+    return a.id != b.id ? a.id < b.id : a.end < b.end;
+  });
+  for (const DynamicPbwt::Match& match : matches) {
+    const size_t match_size = match.end - match.start;
+    for (size_t window_index = words_to_windows[match.start / word_size];
+         window_index <= words_to_windows[(match.end - 1) / word_size]; ++window_index) {
+      std::vector<QueryContext::Candidate>& candidates = context.window_candidates[window_index];
+      if (!candidates.empty() && candidates.back().hap_id == match.id) {
+        candidates.back().score = std::max(candidates.back().score, match_size);
+      }
+      else {
+        candidates.push_back({match.id, match_size});
+      }
+    }
+  }
+}
+
+void HapData::select_top_k(QueryContext& context, size_t window_index, unsigned int k,
+                           std::vector<std::pair<size_t, double>>& cousins) const {
+  // higher scores first and ties broken by higher haplotype ID
+  auto better = [](const QueryContext::Candidate& a, const QueryContext::Candidate& b) {
+    return a.score != b.score ? a.score > b.score : a.hap_id > b.hap_id;
+  };
+  std::vector<QueryContext::Candidate>& top_k = context.top_k;
+  top_k.clear();
+  for (const QueryContext::Candidate& candidate : context.window_candidates[window_index]) {
+    if (top_k.size() < k) {
+      top_k.push_back(candidate);
+      std::push_heap(top_k.begin(), top_k.end(), better);
+    }
+    else if (k > 0 && better(candidate, top_k.front())) {
+      std::pop_heap(top_k.begin(), top_k.end(), better);
+      top_k.back() = candidate;
+      std::push_heap(top_k.begin(), top_k.end(), better);
+    }
+  }
+  std::sort_heap(top_k.begin(), top_k.end(), better);
+
+  cousins.clear();
+  cousins.reserve(top_k.size());
+  for (const QueryContext::Candidate& candidate : top_k) {
+    cousins.emplace_back(candidate.hap_id, static_cast<double>(candidate.score));
+  }
+}
+
+void HapData::rerank(QueryContext& context, size_t hap_id, unsigned int k, const Window& w, size_t num_windows,
+                     std::vector<std::pair<size_t, double>>& cousins) const {
+  const WordMatrix& hashed = hashed_words();
+  const word_type* query_words = hashed.row(hap_id) + w.start;
+  const size_t num_window_words = w.end - w.start;
+  std::vector<QueryContext::Neighbour>& pool = context.rerank_pool;
+  pool.clear();
+  auto add = [&](size_t other_id, size_t score) {
+    pool.push_back({other_id, score, Hamming::distance(query_words, hashed.row(other_id) + w.start, num_window_words)});
+  };
+
+  // the best-scoring candidates, and earlier cousins that are no longer candidates, e.g. in a
+  // window too narrow to be refined
+  const unsigned int pool_size = std::max(rerank_pool_size, k);
+  select_top_k(context, w.index, pool_size, context.rerank_cousins);
+  for (const auto& cousin : context.rerank_cousins) {
+    add(cousin.first, static_cast<size_t>(cousin.second));
+  }
+  std::vector<size_t>& ids = context.rerank_ids;
+  ids.clear();
+  for (const QueryContext::Neighbour& neighbour : pool) {
+    ids.push_back(neighbour.hap_id);
+  }
+  std::sort(ids.begin(), ids.end());
+  const size_t num_pool_candidates = ids.size();
+  for (const auto& cousin : cousins) {
+    if (!std::binary_search(ids.begin(), ids.begin() + static_cast<ptrdiff_t>(num_pool_candidates), cousin.first)) {
+      add(cousin.first, static_cast<size_t>(cousin.second));
+      ids.push_back(cousin.first);
+    }
+  }
+  if (pool.size() < k) {
+    // fill from the best-scoring candidates of the neighbouring windows, then from the hashed
+    // haplotypes just below hap_id, looking at no more than pool_size of those
+    std::sort(ids.begin(), ids.end());
+    auto fill = [&](size_t other_id) {
+      auto it = std::lower_bound(ids.begin(), ids.end(), other_id);
+      if (it == ids.end() || *it != other_id) {
+        ids.insert(it, other_id);
+        add(other_id, 0);
+      }
+    };
+    for (size_t neighbour : {w.index - 1, w.index + 1}) {
+      if (neighbour < num_windows) {
+        select_top_k(context, neighbour, pool_size, context.rerank_cousins);
+        for (const auto& cousin : context.rerank_cousins) {
+          fill(cousin.first);
         }
       }
-      stretches[v].pop_front();
+    }
+    for (size_t other_id = hap_id; other_id > 0 && hap_id - other_id < pool_size;) {
+      --other_id;
+      if (hashed_hap_ids.count(other_id) > 0) {
+        fill(other_id);
+      }
     }
   }
 
-  // take the values in window_scores and sort to find top k
-  std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>> results;
-  for (const Window& w : windows) {
-    size_t window_start_site = w.start * word_size;
-    size_t window_end_site = std::min<size_t>(w.end * word_size - 1, num_sites - 1);
-
-    std::vector<std::pair<double, size_t>> stats;
-    for (const auto& map_entry : window_scores[w.index]) {
-      size_t map_entry_hap_id = map_entry.first;
-      auto score = static_cast<double>(map_entry.second);
-      stats.emplace_back(score, map_entry_hap_id);
-    }
-    size_t actual_k = std::min<size_t>(k, stats.size());
-    // use this if we want sorted
-    std::partial_sort(
-        stats.begin(), stats.begin() + static_cast<ptrdiff_t>(actual_k), stats.end(), std::greater<std::pair<double, size_t>>());
-    // use this if we don't care about sorted
-    // std::nth_element(stats.begin(), stats.begin() + actual_k, stats.end(),
-    // std::greater<pair<double, size_t>>());
-
-    // append to results
-    results.emplace_back(window_start_site, window_end_site, std::vector<std::pair<size_t, double>>());
-    for (size_t stats_idx = 0; stats_idx < actual_k; ++stats_idx) {
-      std::get<2>(results[results.size() - 1])
-          .emplace_back(stats[stats_idx].second, stats[stats_idx].first);
+  // nearest first, then higher scores and higher haplotype IDs
+  auto nearer = [](const QueryContext::Neighbour& a, const QueryContext::Neighbour& b) {
+    if (a.distance != b.distance) {
+      return a.distance < b.distance;
     }
+    return a.score != b.score ? a.score > b.score : a.hap_id > b.hap_id;
+  };
+  const size_t num_kept = std::min<size_t>(k, pool.size());
+  std::partial_sort(pool.begin(), pool.begin() + static_cast<ptrdiff_t>(num_kept), pool.end(), nearer);
+  cousins.clear();
+  for (size_t i = 0; i < num_kept; ++i) {
+    cousins.emplace_back(pool[i].hap_id, static_cast<double>(pool[i].score));
   }
+}
 
+std::vector<std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>>
+HapData::get_closest_cousins_batch(const std::vector<size_t>& hap_ids, unsigned int k, unsigned int tolerance,
+                                   double window_size_genetic, unsigned int num_threads, unsigned int min_cousins,
+                                   double min_score_per_word) const {
+  for (size_t hap_id : hap_ids) {
+    if (hap_id >= num_haps) {
+      throw std::logic_error(MAKE_ERROR("Haplotype ID out of bounds."));
+    }
+  }
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  // start with the highest IDs, which have the most candidates, so that no thread is left with a
+  // long query at the end
+  std::vector<size_t> order(hap_ids.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return hap_ids[a] > hap_ids[b]; });
+
+  std::vector<std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>> results(
+      hap_ids.size());
+  std::atomic<size_t> next(0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto run_queries = [&]() {
+    QueryContext context;
+    try {
+      for (size_t i = next++; i < order.size(); i = next++) {
+        results[order[i]] = find_closest_cousins(context, hap_ids[order[i]], k, tolerance, window_size_genetic,
+                                                 min_cousins, min_score_per_word);
+      }
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      next = order.size();
+    }
+  };
+
+  const size_t num_workers = std::min<size_t>(num_threads, hap_ids.size());
+  if (num_workers <= 1) {
+    run_queries();
+  }
+  else {
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers.emplace_back(run_queries);
+    }
+    for (auto& t : workers) {
+      t.join();
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
   return results;
 }
 
+template <typename Function>
+auto HapData::run_async(Function function) -> std::shared_future<decltype(function())> {
+  // the worker holds each task only until it has run, so finished calls keep nothing but the
+  // results of the futures the caller still holds
+  auto task = std::make_shared<std::packaged_task<decltype(function())()>>(std::move(function));
+  auto result = task->get_future().share();
+  {
+    std::lock_guard<std::mutex> pending_lock(pending_mutex);
+    if (!async_worker.joinable()) {
+      async_worker = std::thread([this]() { run_async_tasks(); });
+    }
+    async_tasks.emplace_back([task]() { (*task)(); });
+    ++async_submitted;
+  }
+  pending_changed.notify_all();
+  return result;
+}
+
+void HapData::run_async_tasks() {
+  std::unique_lock<std::mutex> pending_lock(pending_mutex);
+  while (true) {
+    pending_changed.wait(pending_lock, [this]() { return async_stopping || !async_tasks.empty(); });
+    if (async_tasks.empty()) {
+      return;
+    }
+    std::function<void()> task = std::move(async_tasks.front());
+    async_tasks.pop_front();
+    pending_lock.unlock();
+    // errors are stored in the task's future
+    task();
+    task = nullptr;
+    pending_lock.lock();
+    ++async_finished;
+    pending_changed.notify_all();
+  }
+}
+
+std::shared_future<void> HapData::add_to_hash_async(size_t hap_id) {
+  return run_async([this, hap_id]() {
+    std::unique_lock<std::shared_mutex> state_lock(state_mutex);
+    hash_haplotype(hap_id);
+  });
+}
+
+std::shared_future<std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>>
+HapData::get_closest_cousins_async(size_t hap_id, unsigned int k, unsigned int tolerance,
+                                   double window_size_genetic, unsigned int min_cousins,
+                                   double min_score_per_word) {
+  return run_async([this, hap_id, k, tolerance, window_size_genetic, min_cousins, min_score_per_word]() {
+    std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+    std::lock_guard<std::mutex> context_lock(context_mutex);
+    return find_closest_cousins(query_context, hap_id, k, tolerance, window_size_genetic, min_cousins,
+                                min_score_per_word);
+  });
+}
+
+void HapData::wait_pending() const {
+  std::unique_lock<std::mutex> pending_lock(pending_mutex);
+  const size_t submitted = async_submitted;
+  pending_changed.wait(pending_lock, [this, submitted]() { return async_finished >= submitted; });
+}
+
+std::unordered_set<size_t> HapData::get_hashed_hap_ids() const {
+  wait_pending();
+  std::shared_lock<std::shared_mutex> state_lock(state_mutex);
+  return hashed_hap_ids;
+}
+
 std::ostream& operator<<(std::ostream& os, const HapData& data) {
   os << "HapData with " << data.num_haps << " haplotypes and " << data.num_sites;
   os << " sites, word size = " << data.word_size << " bits";
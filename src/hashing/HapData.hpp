@@ -20,14 +20,28 @@
 #ifndef ARG_NEELE_HAP_DATA_HPP
 #define ARG_NEELE_HAP_DATA_HPP
 
+#include <algorithm>
+#include <cstddef>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <tuple>
-#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "DynamicPbwt.hpp"
+#include "HashIndex.hpp"
+#include "WordMatrix.hpp"
+
 struct Window {
   size_t start, end, index; // end is inclusive
   friend bool operator<(const Window& a, const Window& b) {
@@ -42,10 +56,173 @@ struct Window {
 
 enum class HapDataMode { sequence, array };
 
+enum class MatchEngine { hash, pbwt, lsh };
+
+/**
+ * @brief Borrowed view of an in-memory sites x haplotypes genotype matrix, e.g. a NumPy array.
+ *
+ * Unpacked, each byte is one allele and only the value 1 counts as the alternate allele. Bit-packed,
+ * each byte holds eight consecutive haplotypes with the first in the most significant bit, as
+ * written by numpy.packbits(genotypes, axis=1).
+ */
+struct GenotypeView {
+  const uint8_t* data = nullptr;
+  size_t num_sites = 0;
+  size_t num_haps = 0;
+  ptrdiff_t site_stride = 0; // in bytes
+  ptrdiff_t hap_stride = 1;  // in bytes, between haplotypes or between packed bytes
+  bool bit_packed = false;
+};
+
 class HapData {
 
 public:
   typedef uint64_t word_type;
+
+  /**
+   * @brief Bytes held by each part of a HapData, excluding heap allocator overhead.
+   */
+  struct MemoryUsage {
+    size_t words = 0; // packed haplotype words, owned or memory-mapped
+    bool words_mapped = false;
+    size_t hash_tables = 0;
+    size_t posting_lists = 0;
+    size_t pbwt = 0; // columns of the PBWT engine
+    size_t hashed_hap_ids = 0; // from the node and bucket layout of the set
+    size_t positions = 0;      // physical and genetic
+    size_t site_mafs = 0;
+    size_t sample_names = 0;
+    size_t loader_buffers = 0; // predictions only: text and blocks in flight while loading
+
+    size_t total() const noexcept {
+      return words + hash_tables + posting_lists + pbwt + hashed_hap_ids + positions + site_mafs +
+             sample_names + loader_buffers;
+    }
+
+    /**
+     * Largest footprint at any one time: loader buffers are released before anything is hashed.
+     */
+    size_t peak() const noexcept {
+      const size_t hashing = hash_tables + posting_lists + pbwt + hashed_hap_ids;
+      return total() - loader_buffers - hashing + std::max(loader_buffers, hashing);
+    }
+  };
+
+  /**
+   * Window layouts and scratch buffers reused across get_closest_cousins calls, so that a warmed-up
+   * query allocates nothing and only resets the haplotypes it matched. Using a context with another
+   * HapData, or after the hashed sites have changed, discards its cached layouts. A context must not
+   * be used by two queries at once.
+   */
+  class QueryContext {
+  public:
+    QueryContext() = default;
+
+  private:
+    friend class HapData;
+
+    struct WindowLayout {
+      std::vector<Window> windows;
+      std::vector<size_t> words_to_windows;
+    };
+
+    // A maximal run [start, end) of words matching the query, with the number of mismatching words
+    // since the first run of the haplotype, counting at most tolerance + 1 per gap
+    struct MatchRun {
+      size_t start;
+      size_t end;
+      size_t mismatches;
+    };
+
+    // One bounded FIFO queue of runs per haplotype, each a ring of `capacity` entries in a shared
+    // buffer
+    class RunQueues {
+    public:
+      // make room for queues 0, ..., num_queues - 1; all queues must be empty
+      void prepare(size_t num_queues, size_t _capacity) {
+        if (_capacity != capacity) {
+          capacity = _capacity;
+          std::fill(heads.begin(), heads.end(), 0);
+        }
+        if (sizes.size() < num_queues) {
+          heads.resize(num_queues, 0);
+          sizes.resize(num_queues, 0);
+        }
+        if (entries.size() < sizes.size() * capacity) {
+          entries.resize(sizes.size() * capacity);
+        }
+      }
+
+      bool empty(size_t q) const noexcept {
+        return sizes[q] == 0;
+      }
+      MatchRun& front(size_t q) noexcept {
+        return entries[q * capacity + heads[q]];
+      }
+      MatchRun& back(size_t q) noexcept {
+        return entries[q * capacity + wrap(heads[q] + sizes[q] - 1)];
+      }
+      void push_back(size_t q, const MatchRun& run) noexcept {
+        entries[q * capacity + wrap(heads[q] + sizes[q])] = run;
+        ++sizes[q];
+      }
+      void pop_front(size_t q) noexcept {
+        heads[q] = wrap(heads[q] + 1);
+        --sizes[q];
+      }
+
+    private:
+      size_t wrap(size_t i) const noexcept {
+        return i < capacity ? i : i - capacity;
+      }
+
+      size_t capacity = 0;
+      std::vector<MatchRun> entries;
+      std::vector<size_t> heads;
+      std::vector<size_t> sizes;
+    };
+
+    const HapData* owner = nullptr;
+    uint64_t layout_generation = 0; // of owner when the layouts were made
+    std::map<double, WindowLayout> layouts; // by window size, 0 for one window per word
+    // runs that may still extend a range, per haplotype; empty for all but touched_haps
+    RunQueues runs;
+    std::vector<size_t> touched_haps;
+
+    // A final range [start, end) of a haplotype, linked to the haplotype's next range
+    struct ClosedRange {
+      size_t start;
+      size_t end;
+      size_t next;
+    };
+    // A haplotype and the length of its longest range overlapping a window
+    struct Candidate {
+      size_t hap_id;
+      size_t score;
+    };
+
+    std::vector<ClosedRange> ranges;
+    std::vector<size_t> first_range; // per haplotype, for touched_haps only
+    std::vector<size_t> last_range;
+    std::vector<std::vector<Candidate>> window_candidates;
+    std::vector<Candidate> top_k; // bounded heap, worst kept candidate on top
+    // the query's words at a refinement's word size, and their windows; filled for refined windows only
+    std::vector<word_type> refined_words;
+    std::vector<size_t> refined_words_to_windows;
+    std::vector<unsigned int> scored_word_sizes; // per window, the word size of its scores
+    // A candidate for re-ranking and its number of mismatching sites with the query in a window
+    struct Neighbour {
+      size_t hap_id;
+      size_t score;
+      size_t distance;
+    };
+    std::vector<std::pair<size_t, double>> rerank_cousins;
+    std::vector<Neighbour> rerank_pool;
+    std::vector<size_t> rerank_ids; // sorted IDs of rerank_pool before filling
+    std::vector<DynamicPbwt::Match> pbwt_matches;
+    std::vector<size_t> collisions; // per haplotype, for touched_haps only
+  };
+
   unsigned long num_haps = 0ul;
   unsigned long num_sites = 0ul;
   unsigned int word_size;
@@ -54,23 +231,335 @@ public:
   std::vector<double> genetic_positions;
   std::vector<float> site_mafs;
   std::vector<std::string> sample_names;
-  std::vector<std::vector<bool>> sites;
-  std::vector<std::vector<word_type>> words;
+  WordMatrix words; // num_haps x ceil(num_sites / word_size)
 
-  std::vector<std::unordered_map<word_type, std::vector<size_t>>> hashes;
+  HashIndex hashes; // one table per word column, filled by add_to_hash
   std::unordered_set<size_t> hashed_hap_ids;
 
+  /**
+   * file_root_path is one of: the root of .hap[s][.gz] / .sample[s] / .map[.gz] files; a binary
+   * cache written by save(); or a phased .vcf[.gz], in which case map_file_path is required and
+   * supplies the genetic positions of the biallelic records, matched by physical position.
+   *
+   * fill_sites is accepted for compatibility and ignored: single alleles are read from the packed
+   * words through allele() rather than from a second unpacked copy.
+   *
+   * engine_name is passed to set_match_engine().
+   */
   HapData(std::string mode, std::string file_root_path, unsigned int _word_size = 64,
-          std::string map_file_path = "", bool fill_sites = true);
-  ~HapData() = default;
+          std::string map_file_path = "", bool fill_sites = true, unsigned int num_threads = 1,
+          size_t site_begin = 0, size_t site_end = 0, const std::string& engine_name = "hash");
+  /**
+   * Build from an in-memory genotype matrix instead of files. Haplotypes 2 * i and 2 * i + 1 are
+   * named sample_i.
+   */
+  HapData(std::string mode, const GenotypeView& genotypes, std::vector<unsigned long> _physical_positions,
+          std::vector<double> _genetic_positions, unsigned int _word_size = 64, bool fill_sites = true,
+          const std::string& engine_name = "hash");
+  ~HapData();
+
+  /**
+   * Append the haplotypes of another .hap[s][.gz] / .sample[s] file set, e.g. a new batch of
+   * samples, as IDs num_haps onwards. Its map (file_root_path.map[.gz], or map_file_path) must have
+   * the same sites at the same physical positions; genetic positions are kept from this data. If
+   * this data holds a range of sites, the batch may have more sites and the same range is read.
+   *
+   * Only the new haplotypes are parsed, and hashes of the existing ones are kept, so appending a
+   * batch and hashing it costs in proportion to the batch, as long as reserve_haplotypes() made
+   * room for it; otherwise the packed words are copied once into storage of the new size. Site MAFs are updated, but the sites
+   * chosen by set_min_maf are kept; before the first add_to_hash, call set_min_maf again to
+   * choose them from the new MAFs.
+   */
+  void append_haplotypes(const std::string& file_root_path, const std::string& map_file_path = "",
+                         unsigned int num_threads = 1);
+  /**
+   * Make room for num_haps haplotypes in total, so that appending batches up to that many does not
+   * copy the haplotypes already loaded. The room is only committed to memory as batches fill it.
+   */
+  void reserve_haplotypes(size_t num_haps);
+
+  /**
+   * Write a binary cache of the loaded haplotypes, which can be passed as file_root_path to
+   * later constructions to memory-map it instead of parsing text files.
+   */
+  void save(const std::string& path) const;
+  static bool is_cache_file(const std::string& path);
+  /**
+   * The number of sites that loading file_root_path would give, without loading it: read from
+   * the header of a binary cache, or the records of the .hap[s][.gz] file, which takes constant
+   * time if it is BGZF-compressed with an up-to-date line index. VCF input is not supported.
+   */
+  static size_t count_sites(const std::string& file_root_path);
+  /**
+   * Whether cache_path is a binary cache of the current version written from the files that
+   * file_root_path and map_file_path name now, compared by absolute path, size and modification
+   * time. Caches of in-memory data, of a site range or of data with appended haplotypes never are.
+   */
+  static bool is_cache_current(const std::string& cache_path, const std::string& file_root_path,
+                               const std::string& map_file_path = "");
+  /**
+   * Write the populated hash index to a binary snapshot: the tables of the match engine,
+   * hashed_hap_ids, the hashed sites and the hashing configuration, with a checksum of the data
+   * the index was built from.
+   */
+  void save_hash_index(const std::string& path) const;
+  /**
+   * Restore a snapshot written by save_hash_index() instead of hashing its haplotypes again.
+   * Call before the first add_to_hash and after configuring hashing as when the snapshot was
+   * saved. The data may have gained haplotypes since, but the snapshot is rejected as stale if
+   * the hashed haplotypes, the sites or their physical positions have changed. The sites hashed
+   * at the time are kept even if new haplotypes moved their MAFs across the threshold.
+   *
+   * @param id_limit The snapshot is also rejected if it holds a haplotype with this ID or above,
+   *   e.g. one that has not been threaded yet.
+   */
+  void load_hash_index(const std::string& path, size_t id_limit = std::numeric_limits<size_t>::max());
+  /**
+   * Store compressed posting lists in the hash index, trading some query speed for memory. Must be
+   * called before the first add_to_hash, and haplotypes must then be hashed in increasing ID order.
+   */
+  void set_compressed_hashes(bool compressed);
+  /**
+   * Choose how add_to_hash indexes haplotypes and how get_closest_cousins finds their matches,
+   * at construction or before the first add_to_hash:
+   *
+   * "hash" (the default) looks up each word in a hash table per word column, and scores cousins
+   * by their longest runs of matching words, allowing `tolerance` mismatching words.
+   *
+   * "pbwt" inserts haplotypes into a dynamic positional Burrows-Wheeler transform, and scores
+   * cousins by their longest exact matches in sites, from any site to any site. Insertion takes
+   * O(1) steps per site on average, and queries a step per site plus one per cousin found, as
+   * long as haplotypes are hashed in ascending ID order; the engine takes 24 bytes per hashed
+   * haplotype and site. Windows are still made of whole words, tolerance is ignored, refinements are not available, and cousins with equally
+   * long matches are not necessarily those with the highest IDs.
+   *
+   * "lsh" hashes each word column into several tables, each keyed on a random subset of the
+   * column's sites, so that a haplotype that differs from the query at a few sites of a word
+   * still collides with it in the tables that leave those sites out. Cousins are scored by their
+   * number of collisions in the window, across columns and tables. Tolerance is ignored and
+   * refinements are not available.
+   */
+  void set_match_engine(const std::string& engine);
+  std::string match_engine() const;
+  /**
+   * Number of tables per word column and sites per key of the "lsh" engine, 0 for half the word
+   * size, and the seed of the site subsets. Set before the first add_to_hash.
+   */
+  void set_lsh_parameters(unsigned int num_tables, unsigned int bits_per_key = 0, uint64_t seed = 1);
+  unsigned int lsh_num_tables() const;
+  /**
+   * Hash only the sites with a minor allele frequency of at least min_maf, packed word_size at a
+   * time into words of their own, before the first add_to_hash. Rare variants carry little
+   * matching signal, so fewer words of common sites shrink the index and the query scan. Windows
+   * are made of these words; each window's first and last sites are still indices of all sites,
+   * and windows still cover every site, with the skipped sites in the window of the preceding
+   * hashed site. Scores and refinements count hashed sites only. 0 hashes all sites.
+   */
+  void set_min_maf(double min_maf);
+  double min_maf() const;
+  size_t num_hashed_sites() const noexcept;
+  /**
+   * Also index the haplotypes at a finer word size, so that queries can re-score the windows that
+   * found too few cousins. The finer words are cut from the same packed sites, so haplotypes are
+   * stored only once. Refinements are added from coarse to fine, before the first add_to_hash.
+   */
+  void add_refinement(unsigned int refine_word_size);
+  std::vector<unsigned int> refinement_word_sizes() const;
+  /**
+   * Re-rank the cousins of each window by their number of mismatching sites with the query in the
+   * window, among the pool_size best-scoring candidates of the window and its earlier cousins. If
+   * the pool has fewer than k haplotypes, it is filled with the pool_size best-scoring candidates
+   * of each neighbouring window, then with hashed haplotypes among the pool_size IDs just below the
+   * query's, which then have a score of 0. Pool sizes below k count as k. Cousins keep their match
+   * scores. 0 turns re-ranking off.
+   */
+  void set_rerank_pool(unsigned int pool_size);
+  unsigned int rerank_pool() const;
   void add_to_hash(size_t hap_id);
+  /**
+   * add_to_hash for haplotypes begin to end - 1, filling the tables of each word column in one
+   * pass with the columns split across num_threads threads. All IDs are checked before any is
+   * hashed.
+   */
+  void add_range_to_hash(size_t begin, size_t end, unsigned int num_threads = 1);
+  /**
+   * add_to_hash and get_closest_cousins on a background thread, e.g. to hash one haplotype and
+   * search for the cousins of the next while the caller decodes. Asynchronous calls are queued for
+   * a single worker thread, started by the first of them, and run one at a time in the order they
+   * were made, so a query made after add_to_hash_async(i) sees haplotype
+   * i. Errors are raised by the returned future. The other methods that use the hash index first
+   * wait for all pending asynchronous calls; hashed_hap_ids is only up to date after such a call.
+   *
+   * Methods may be called from several threads: those that change the data or the index run one
+   * at a time, and queries run alongside each other but not alongside changes. Reading the public
+   * members directly is not synchronized; use get_hashed_hap_ids() for a consistent copy.
+   */
+  std::shared_future<void> add_to_hash_async(size_t hap_id);
+  std::shared_future<std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>>
+  get_closest_cousins_async(size_t hap_id, unsigned int k, unsigned int tolerance = 0,
+                            double window_size_genetic = 0, unsigned int min_cousins = 0,
+                            double min_score_per_word = 0);
+  /**
+   * Block until all asynchronous calls made so far have finished.
+   */
+  void wait_pending() const;
+  /**
+   * A copy of hashed_hap_ids once all asynchronous calls made so far have finished.
+   */
+  std::unordered_set<size_t> get_hashed_hap_ids() const;
+  /**
+   * For each window, the k hashed haplotypes with the longest matches to hap_id, as (first site,
+   * last site, [(haplotype, score)]). Only haplotypes with lower IDs than hap_id are candidates,
+   * matching the order in which haplotypes are threaded and hashed.
+   *
+   * With refinements, a window fails if it has fewer than min_cousins cousins or if their scores
+   * sum to less than min_score_per_word times its number of words. Failing windows are re-scored
+   * at each finer word size in turn until they pass, and their scores are then in words of that
+   * size. Matches only extend across neighbouring windows that are refined together.
+   */
   std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
   get_closest_cousins(size_t hap_id, unsigned int k, unsigned int tolerance = 0,
-                      double window_size_genetic = 0);
+                      double window_size_genetic = 0, unsigned int min_cousins = 0,
+                      double min_score_per_word = 0);
+  /**
+   * get_closest_cousins with caller-owned scratch space, e.g. one context per thread.
+   */
+  std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
+  get_closest_cousins(QueryContext& context, size_t hap_id, unsigned int k, unsigned int tolerance = 0,
+                      double window_size_genetic = 0, unsigned int min_cousins = 0,
+                      double min_score_per_word = 0) const;
+  /**
+   * get_closest_cousins for many haplotypes, on num_threads threads that each take the next
+   * pending query from a shared atomic counter, i.e. dynamic scheduling rather than work stealing:
+   * queries are small and independent, so one counter balances the load. Each query sees the same candidates as on its own, so once all haplotypes are
+   * hashed, this gives the cousins of each haplotype as of the moment it would have been threaded.
+   */
+  std::vector<std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>>
+  get_closest_cousins_batch(const std::vector<size_t>& hap_ids, unsigned int k, unsigned int tolerance = 0,
+                            double window_size_genetic = 0, unsigned int num_threads = 1,
+                            unsigned int min_cousins = 0, double min_score_per_word = 0) const;
+  /**
+   * Bytes currently held, broken down by component.
+   */
+  MemoryUsage memory_usage() const;
+  /**
+   * Predict the memory of loading num_haps x num_sites from text with num_threads threads and then
+   * hashing every haplotype, without loading anything.
+   *
+   * The hash index is sized for distinct_words different words per column, each shared by an
+   * equal share of the haplotypes; 0 assumes the worst case for the tables, min(num_haps,
+   * 2^word_size).
+   */
+  static MemoryUsage predict_memory_usage(size_t num_haps, size_t num_sites, unsigned int word_size = 64,
+                                          unsigned int num_threads = 1, bool compressed_hashes = false,
+                                          size_t distinct_words = 0);
+  /**
+   * Allele (0 or 1) of a haplotype at a site, read from the packed words.
+   */
+  bool allele(size_t hap_id, size_t site_id) const;
   void print_hap(size_t hap_id);
   void print_hashes();
   void print_word_match_diagram(size_t hap_id1, size_t hap_id2);
   friend std::ostream& operator<<(std::ostream& os, const HapData& data);
+
+private:
+  void set_mode(const std::string& mode);
+  static std::vector<std::string> read_samples(const std::string& file_root_path);
+  void read_map(const std::string& file_root_path, const std::string& map_file_path);
+  void read_haps(const std::string& file_root_path, unsigned int num_threads, size_t site_begin,
+                 bool site_range);
+  void read_cache(const std::string& path, const std::string& map_file_path);
+  void read_vcf(const std::string& vcf_path, const std::string& map_file_path, unsigned int num_threads);
+  const QueryContext::WindowLayout& window_layout(QueryContext& context, double window_size_genetic) const;
+  void reset_hashes();
+  // add_to_hash and get_closest_cousins without waiting for asynchronous calls
+  void hash_haplotype(size_t hap_id);
+  std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>
+  find_closest_cousins(QueryContext& context, size_t hap_id, unsigned int k, unsigned int tolerance,
+                       double window_size_genetic, unsigned int min_cousins, double min_score_per_word) const;
+  // Re-score the windows of results that fail min_cousins or min_score_per_word with the refinements
+  void refine_failing_windows(
+      QueryContext& context, size_t hap_id, unsigned int k, unsigned int tolerance,
+      const QueryContext::WindowLayout& layout, unsigned int min_cousins, double min_score_per_word,
+      std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>& results) const;
+  // word j of a haplotype at a refinement's word size
+  word_type refined_word(const word_type* hap_words, unsigned int refine_word_size, size_t j) const;
+  // Add candidates to the windows of query words [first_word, last_word) of hap_id from their
+  // matches in index, with words_to_windows[i] the window of word i
+  void score_matches(QueryContext& context, const HashIndex& index, const word_type* query_words,
+                     size_t first_word, size_t last_word, const size_t* words_to_windows, size_t hap_id,
+                     unsigned int tolerance) const;
+  // score_matches with the collisions of the query's words in the LSH tables, for whole windows
+  void score_lsh_matches(QueryContext& context, const std::vector<Window>& windows, size_t hap_id) const;
+  // score_matches with the maximal matches found by the PBWT, keeping enough for the k best
+  void score_pbwt_matches(QueryContext& context, const size_t* words_to_windows, size_t hap_id,
+                          unsigned int k) const;
+  void select_top_k(QueryContext& context, size_t window_index, unsigned int k,
+                    std::vector<std::pair<size_t, double>>& cousins) const;
+  // Replace the cousins of window w with the k nearest haplotypes of its re-ranking pool
+  void rerank(QueryContext& context, size_t hap_id, unsigned int k, const Window& w, size_t num_windows,
+              std::vector<std::pair<size_t, double>>& cousins) const;
+  template <typename Function>
+  auto run_async(Function function) -> std::shared_future<decltype(function())>;
+  // the loop of async_worker, until async_stopping is set and the queue is empty
+  void run_async_tasks();
+  bool hashing_started() const noexcept;
+  // hash the given sites only, or all sites if empty
+  void select_sites(std::vector<size_t> sites);
+  // pack the hashed sites of haplotypes [begin, end) into selected_words
+  void gather_selected_words(size_t begin, size_t end);
+  // checksum of the sites and of the words of the given haplotypes, in increasing ID order
+  uint64_t source_checksum(const std::vector<uint32_t>& hap_ids) const;
+  // the words that add_to_hash indexes, and the site of each of their bits
+  const WordMatrix& hashed_words() const noexcept {
+    return hashed_sites.empty() ? words : selected_words;
+  }
+  size_t hashed_site(size_t i) const noexcept {
+    return hashed_sites.empty() ? i : hashed_sites[i];
+  }
+  // the first of all sites in the window starting at word column i
+  size_t column_start_site(size_t i) const noexcept {
+    return i == 0 ? 0 : hashed_site(i * word_size);
+  }
+
+  // an index of the same haplotypes at a finer word size
+  struct Refinement {
+    unsigned int word_size;
+    HashIndex hashes;
+  };
+
+  // bumped whenever the hashed sites change, invalidating the layouts of every query context
+  uint64_t layout_generation = 0;
+  // fingerprint of the input files, written to binary caches; 0 for in-memory data
+  uint64_t source_fingerprint = 0;
+  bool compressed_hashes = false;
+  MatchEngine engine = MatchEngine::hash;
+  // a hash index of the word columns keyed on the sites in each column's mask
+  struct LshTable {
+    std::vector<word_type> masks;
+    HashIndex hashes;
+  };
+  unsigned int lsh_tables_per_column = 4;
+  unsigned int lsh_bits_per_key = 0;
+  uint64_t lsh_seed = 1;
+  std::vector<LshTable> lsh_tables; // filled by add_to_hash with the LSH engine
+  DynamicPbwt pbwt; // filled by add_to_hash instead of hashes with the PBWT engine
+  std::vector<Refinement> refinements; // from coarse to fine
+  unsigned int rerank_pool_size = 0;
+  double min_hashed_maf = 0;
+  WordMatrix selected_words;        // the sites of hashed_sites only, packed as in words
+  std::vector<size_t> hashed_sites; // empty if all sites are hashed
+  std::vector<uint32_t> site_alt_counts; // per site, for updating site_mafs; empty until the first append
+  QueryContext query_context; // for get_closest_cousins without a context
+  std::deque<std::function<void()>> async_tasks; // queued asynchronous calls, oldest first
+  size_t async_submitted = 0;                    // asynchronous calls made
+  size_t async_finished = 0;                     // asynchronous calls that have finished
+  bool async_stopping = false;
+  std::thread async_worker;                          // runs async_tasks, started on first use
+  mutable std::mutex pending_mutex;                  // guards the asynchronous call members
+  mutable std::condition_variable pending_changed;   // signalled when calls are queued or finish
+  mutable std::shared_mutex state_mutex;   // held exclusively by changes, shared by queries
+  mutable std::mutex context_mutex;        // guards query_context
 };
 
 #endif // ARG_NEELE_HAP_DATA_HPP
@@ -0,0 +1,376 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+#include "HapLoader.hpp"
+#include "HapParser.hpp"
+
+namespace HapLoader {
+
+namespace {
+
+// Aim for blocks of roughly this many bytes of text, so that per-block overhead is negligible
+// while a few blocks per thread still fit comfortably in memory
+constexpr std::size_t target_block_bytes = 1ul << 22;
+
+// A run of complete lines, one per site
+struct RawBlock {
+  std::size_t index = 0;
+  std::size_t first_site = 0;
+  std::size_t num_sites = 0;
+  std::vector<char> text;
+};
+
+std::size_t sites_per_block(std::size_t num_haps, unsigned int word_size) {
+  std::size_t target_sites = std::max<std::size_t>(1, target_block_bytes / (2 * num_haps + 32));
+  return (target_sites + word_size - 1) / word_size * word_size;
+}
+
+// Reads lines from the stream into blocks of sites_per_block sites, up to max_sites in total
+class BlockReader {
+public:
+  BlockReader(FileUtils::AutoGzIfstream& in, InputFormat _format, std::size_t _sites_per_block,
+              std::size_t _max_sites)
+      : reader(in), format(_format), sites_per_block(_sites_per_block), max_sites(_max_sites) {
+  }
+
+  bool next_block(RawBlock& block) {
+    block.index = next_index;
+    block.first_site = next_site;
+    block.num_sites = 0;
+    block.text.clear();
+    std::size_t block_sites = sites_per_block;
+    if (max_sites > 0) {
+      block_sites = std::min(block_sites, max_sites - next_site);
+    }
+    std::string_view line;
+    while (block.num_sites < block_sites && reader.next_line(line)) {
+      if (!is_site(line)) {
+        continue;
+      }
+      block.text.insert(block.text.end(), line.begin(), line.end());
+      block.text.push_back('\n');
+      ++block.num_sites;
+    }
+    if (block.num_sites == 0) {
+      return false;
+    }
+    ++next_index;
+    next_site += block.num_sites;
+    return true;
+  }
+
+private:
+  bool is_site(std::string_view line) const {
+    if (format == InputFormat::vcf) {
+      return HapParser::is_biallelic_vcf_record(line);
+    }
+    return !HapParser::trim(line).empty();
+  }
+
+  HapParser::LineReader reader;
+  InputFormat format;
+  std::size_t sites_per_block;
+  std::size_t max_sites; // 0 for no limit
+  std::size_t next_index = 0;
+  std::size_t next_site = 0;
+};
+
+HapBlock parse_block(const RawBlock& raw, std::size_t num_haps, unsigned int word_size,
+                     InputFormat format) {
+  HapBlock block;
+  block.first_site = raw.first_site;
+  block.num_sites = raw.num_sites;
+  block.num_words = (raw.num_sites + word_size - 1) / word_size;
+  block.site_mafs.reserve(raw.num_sites);
+  if (format == InputFormat::vcf) {
+    block.physical_positions.reserve(raw.num_sites);
+  }
+
+  // Pack each site's alleles into a site-major row of bits, which is written sequentially, then
+  // transpose tiles of those rows into haplotype words
+  const std::size_t hap_words = (num_haps + 63) / 64;
+  std::vector<std::uint64_t> site_bits(raw.num_sites * hap_words, 0ull);
+
+  std::string_view text(raw.text.data(), raw.text.size());
+  std::string_view alleles;
+  std::size_t site_id = 0;
+  while (!text.empty()) {
+    std::size_t newline = text.find('\n');
+    std::string_view line = text.substr(0, newline);
+    text.remove_prefix(std::min(text.size(), newline + 1));
+
+    std::uint64_t* row = site_bits.data() + site_id * hap_words;
+    auto set_allele = [row](std::size_t hap_id, char inp) {
+      // important to use 1ull, not just 1!
+      row[hap_id / 64] |= static_cast<std::uint64_t>(inp == '1') << (hap_id % 64);
+    };
+    if (format == InputFormat::vcf) {
+      unsigned long position = 0ul;
+      std::size_t gt_index = 0;
+      HapParser::parse_vcf_record(line, position, gt_index, alleles);
+      HapParser::for_each_vcf_allele(alleles, num_haps / 2, gt_index, set_allele);
+      block.physical_positions.push_back(position);
+    }
+    else {
+      if (!HapParser::skip_hap_metadata(line, alleles)) {
+        continue;
+      }
+      HapParser::for_each_allele(alleles, num_haps, set_allele);
+    }
+    ++site_id;
+  }
+
+  block.words.assign(num_haps * block.num_words, 0ull);
+  pack_sites(site_bits.data(), raw.num_sites, num_haps, word_size, block.words.data(), block.num_words,
+             block.site_mafs);
+  return block;
+}
+
+// Shared state between the reader thread, parser threads and the committing thread
+class Pipeline {
+public:
+  Pipeline(FileUtils::AutoGzIfstream& in, InputFormat _format, std::size_t _num_haps,
+           unsigned int _word_size, unsigned int num_threads, std::size_t max_sites)
+      : blocks(in, _format, sites_per_block(_num_haps, _word_size), max_sites), format(_format),
+        num_haps(_num_haps), word_size(_word_size), max_in_flight(2 * static_cast<std::size_t>(num_threads) + 2) {
+  }
+
+  void read_all() {
+    try {
+      while (true) {
+        RawBlock raw;
+        if (!blocks.next_block(raw)) {
+          break;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cv.wait(lock, [&] { return aborted || in_flight < max_in_flight; });
+        if (aborted) {
+          return;
+        }
+        ++in_flight;
+        ++num_blocks;
+        work.push_back(std::move(raw));
+        work_cv.notify_one();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      reading_done = true;
+      work_cv.notify_all();
+      done_cv.notify_all();
+    }
+    catch (...) {
+      abort(std::current_exception());
+    }
+  }
+
+  void parse_all() {
+    try {
+      while (true) {
+        RawBlock raw;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          work_cv.wait(lock, [&] { return aborted || reading_done || !work.empty(); });
+          if (aborted || work.empty()) {
+            return;
+          }
+          raw = std::move(work.front());
+          work.pop_front();
+        }
+        HapBlock block = parse_block(raw, num_haps, word_size, format);
+        std::lock_guard<std::mutex> lock(mutex);
+        done.emplace(raw.index, std::move(block));
+        done_cv.notify_all();
+      }
+    }
+    catch (...) {
+      abort(std::current_exception());
+    }
+  }
+
+  void commit_all(const CommitFunction& commit) {
+    try {
+      for (std::size_t next = 0;; ++next) {
+        HapBlock block;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          done_cv.wait(lock, [&] {
+            return aborted || done.count(next) > 0 || (reading_done && next == num_blocks);
+          });
+          if (aborted || done.count(next) == 0) {
+            return;
+          }
+          auto it = done.find(next);
+          block = std::move(it->second);
+          done.erase(it);
+        }
+        commit(block);
+        std::lock_guard<std::mutex> lock(mutex);
+        --in_flight;
+        space_cv.notify_one();
+      }
+    }
+    catch (...) {
+      abort(std::current_exception());
+    }
+  }
+
+  void rethrow_if_failed() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  void abort(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+      error = std::move(e);
+    }
+    aborted = true;
+    work_cv.notify_all();
+    done_cv.notify_all();
+    space_cv.notify_all();
+  }
+
+  BlockReader blocks;
+  InputFormat format;
+  std::size_t num_haps;
+  unsigned int word_size;
+  std::size_t max_in_flight; // blocks read but not yet committed
+
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable done_cv;
+  std::condition_variable space_cv;
+  std::deque<RawBlock> work;
+  std::map<std::size_t, HapBlock> done;
+  std::size_t in_flight = 0;
+  std::size_t num_blocks = 0;
+  bool reading_done = false;
+  bool aborted = false;
+  std::exception_ptr error;
+};
+
+} // namespace
+
+void transpose_bits(std::uint64_t tile[64]) noexcept {
+  // Swap off-diagonal blocks of 32 x 32, then 16 x 16, ... down to single bits
+  std::uint64_t mask = 0x00000000ffffffffull;
+  for (std::size_t j = 32; j != 0; j >>= 1, mask ^= mask << j) {
+    for (std::size_t k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+      const std::uint64_t t = ((tile[k] >> j) ^ tile[k | j]) & mask;
+      tile[k] ^= t << j;
+      tile[k | j] ^= t;
+    }
+  }
+}
+
+void pack_sites(const std::uint64_t* site_bits, std::size_t num_sites, std::size_t num_haps,
+                unsigned int word_size, std::uint64_t* words, std::size_t words_stride,
+                std::vector<float>& site_mafs) {
+  const std::size_t hap_words = (num_haps + 63) / 64;
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    const std::uint64_t* row = site_bits + site_id * hap_words;
+    int maf_ctr = 0;
+    for (std::size_t i = 0; i < hap_words; ++i) {
+      maf_ctr += __builtin_popcountll(row[i]);
+    }
+    float maf = static_cast<float>(maf_ctr) / static_cast<float>(num_haps);
+    if (maf > 0.5f) {
+      maf = 1.f - maf;
+    }
+    site_mafs.push_back(maf);
+  }
+
+  // Turn word_size sites x 64 haplotypes tiles into 64 haplotype words at a time
+  const std::size_t num_words = (num_sites + word_size - 1) / word_size;
+  std::uint64_t tile[64];
+  for (std::size_t word_id = 0; word_id < num_words; ++word_id) {
+    const std::size_t first = word_id * word_size;
+    const std::size_t tile_sites = std::min<std::size_t>(word_size, num_sites - first);
+    for (std::size_t hap_word = 0; hap_word < hap_words; ++hap_word) {
+      for (std::size_t i = 0; i < tile_sites; ++i) {
+        tile[i] = site_bits[(first + i) * hap_words + hap_word];
+      }
+      std::fill(tile + tile_sites, tile + 64, 0ull);
+      transpose_bits(tile);
+      const std::size_t tile_haps = std::min<std::size_t>(64, num_haps - hap_word * 64);
+      std::uint64_t* out = words + hap_word * 64 * words_stride + word_id;
+      for (std::size_t i = 0; i < tile_haps; ++i) {
+        out[i * words_stride] = tile[i];
+      }
+    }
+  }
+}
+
+std::size_t buffer_bytes(std::size_t num_haps, unsigned int word_size, unsigned int num_threads) {
+  const std::size_t block_sites = sites_per_block(num_haps, word_size);
+  const std::size_t hap_words = (num_haps + 63) / 64;
+  const std::size_t text = block_sites * (2 * num_haps + 32);
+  const std::size_t site_bits = block_sites * hap_words * sizeof(std::uint64_t);
+  const std::size_t packed = num_haps * (block_sites / word_size) * sizeof(std::uint64_t) +
+                             block_sites * (sizeof(float) + sizeof(unsigned long));
+  // the line reader keeps up to two blocks of decompressed bytes plus a partial line
+  const std::size_t line_buffer = 2 * (1ul << 20) + 2 * num_haps + 32;
+  if (num_threads <= 1) {
+    return line_buffer + text + site_bits + packed;
+  }
+  // every block in flight is either raw text or packed words, and each parser also holds the
+  // site-major bits of the block it is working on
+  const std::size_t max_in_flight = 2 * static_cast<std::size_t>(num_threads) + 2;
+  return line_buffer + max_in_flight * (text + packed) + num_threads * site_bits;
+}
+
+void load(FileUtils::AutoGzIfstream& in, std::size_t num_haps, unsigned int word_size,
+          unsigned int num_threads, std::size_t max_sites, const CommitFunction& commit,
+          InputFormat format) {
+  if (num_threads <= 1) {
+    BlockReader blocks(in, format, sites_per_block(num_haps, word_size), max_sites);
+    RawBlock raw;
+    while (blocks.next_block(raw)) {
+      commit(parse_block(raw, num_haps, word_size, format));
+    }
+    return;
+  }
+
+  Pipeline pipeline(in, format, num_haps, word_size, num_threads, max_sites);
+  std::thread reader([&] { pipeline.read_all(); });
+  std::vector<std::thread> parsers;
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    parsers.emplace_back([&] { pipeline.parse_all(); });
+  }
+  pipeline.commit_all(commit);
+  reader.join();
+  for (auto& t : parsers) {
+    t.join();
+  }
+  pipeline.rethrow_if_failed();
+}
+
+} // namespace HapLoader
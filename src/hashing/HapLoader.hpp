@@ -0,0 +1,106 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_HAP_LOADER_HPP
+#define ARG_NEEDLE_HAP_LOADER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "FileUtils.hpp"
+
+/**
+ * Pipelined loading of .hap[s][.gz] and phased .vcf[.gz] files into bit-packed haplotype words.
+ *
+ * A reader thread decompresses the input and cuts it into blocks of whole words' worth of sites,
+ * a pool of workers parses and bit-packs blocks independently, and the calling thread commits
+ * finished blocks strictly in file order. Because every block starts on a word boundary, the
+ * packed output does not depend on the number of threads.
+ */
+namespace HapLoader {
+
+/**
+ * @brief Text format of the input.
+ *
+ * For VCF, header lines and records that are not biallelic are skipped, and the two alleles of
+ * sample i are haplotypes 2 * i and 2 * i + 1.
+ */
+enum class InputFormat { hap, vcf };
+
+/**
+ * @brief A run of consecutive sites, parsed and packed into words.
+ */
+struct HapBlock {
+  /** Index of the first site in the block; always a multiple of the word size. */
+  std::size_t first_site = 0;
+  std::size_t num_sites = 0;
+  /** Number of words per haplotype in this block. */
+  std::size_t num_words = 0;
+  /** Packed alleles, haplotype-major: words[hap_id * num_words + word_id]. */
+  std::vector<std::uint64_t> words;
+  std::vector<float> site_mafs;
+  /** Physical position of each site; only filled for VCF input, where it is not in the map file. */
+  std::vector<unsigned long> physical_positions;
+};
+
+using CommitFunction = std::function<void(const HapBlock&)>;
+
+/**
+ * @brief Transpose a 64 x 64 bit matrix in place, so that bit c of tile[r] moves to bit r of tile[c].
+ */
+void transpose_bits(std::uint64_t tile[64]) noexcept;
+
+/**
+ * @brief Pack site-major rows of allele bits into haplotype words and compute site MAFs.
+ *
+ * @param site_bits num_sites rows of ceil(num_haps / 64) words each, with the allele of
+ *   haplotype h in bit h % 64 of word h / 64.
+ * @param words Receives ceil(num_sites / word_size) words per haplotype, at
+ *   words[hap_id * words_stride + word_id].
+ * @param site_mafs One minor allele frequency per site is appended.
+ */
+void pack_sites(const std::uint64_t* site_bits, std::size_t num_sites, std::size_t num_haps,
+                unsigned int word_size, std::uint64_t* words, std::size_t words_stride,
+                std::vector<float>& site_mafs);
+
+/**
+ * @brief Upper bound on the bytes of text and packed blocks that load() holds at any one time.
+ */
+std::size_t buffer_bytes(std::size_t num_haps, unsigned int word_size, unsigned int num_threads);
+
+/**
+ * @brief Parse all sites of an open hap or VCF file, handing blocks to commit in file order.
+ *
+ * @param in Open file, positioned at the first line.
+ * @param num_haps Number of haplotypes per line, i.e. twice the number of samples for VCF.
+ * @param word_size Number of sites packed per word, at most 64.
+ * @param num_threads Number of parser threads; with 0 or 1, everything runs on the calling thread.
+ * @param max_sites Stop after this many sites; 0 reads to the end of the file.
+ * @param commit Called on the calling thread once per block, in increasing site order.
+ * @param format Text format of the input.
+ */
+void load(FileUtils::AutoGzIfstream& in, std::size_t num_haps, unsigned int word_size,
+          unsigned int num_threads, std::size_t max_sites, const CommitFunction& commit,
+          InputFormat format = InputFormat::hap);
+
+} // namespace HapLoader
+
+#endif // ARG_NEEDLE_HAP_LOADER_HPP
@@ -0,0 +1,181 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "HapParser.hpp"
+#include "utils.hpp"
+
+namespace HapParser {
+
+double parse_double(std::string_view token) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  double value = 0.;
+  const char* first = token.data();
+  // std::stod accepts a leading '+', std::from_chars does not
+  if (!token.empty() && token.front() == '+') {
+    ++first;
+  }
+  auto [ptr, ec] = std::from_chars(first, token.data() + token.size(), value);
+  if (ec != std::errc() || ptr == first) {
+    throw std::logic_error(MAKE_ERROR("Could not parse \"" + std::string(token) + "\" as a number."));
+  }
+  return value;
+#else
+  // floating point std::from_chars is not available in every standard library we support
+  try {
+    return std::stod(std::string(token));
+  }
+  catch (const std::exception&) {
+    throw std::logic_error(MAKE_ERROR("Could not parse \"" + std::string(token) + "\" as a number."));
+  }
+#endif
+}
+
+unsigned long parse_ulong(std::string_view token) {
+  unsigned long value = 0ul;
+  const char* first = token.data();
+  if (!token.empty() && token.front() == '+') {
+    ++first;
+  }
+  auto [ptr, ec] = std::from_chars(first, token.data() + token.size(), value);
+  if (ec != std::errc() || ptr == first) {
+    throw std::logic_error(
+        MAKE_ERROR("Could not parse \"" + std::string(token) + "\" as a non-negative integer."));
+  }
+  return value;
+}
+
+bool parse_map_line(std::string_view line, MapRecord& record) {
+  std::string_view field[4];
+  for (auto& f : field) {
+    f = next_token(line);
+  }
+  if (field[0].empty()) {
+    return false;
+  }
+  if (field[3].empty()) {
+    throw std::logic_error(MAKE_ERROR("Expected 4 fields in map file line."));
+  }
+  record.genetic_position = parse_double(field[2]);
+  record.physical_position = parse_ulong(field[3]);
+  return true;
+}
+
+bool skip_hap_metadata(std::string_view line, std::string_view& alleles) {
+  if (next_token(line).empty()) {
+    return false;
+  }
+  for (int i = 1; i < 5; ++i) {
+    if (next_token(line).empty()) {
+      throw std::logic_error(MAKE_ERROR("Expected 5 metadata fields in hap file line."));
+    }
+  }
+  alleles = trim(line);
+  return true;
+}
+
+bool is_biallelic_vcf_record(std::string_view line) {
+  if (line.empty() || line.front() == '#') {
+    return false;
+  }
+  std::string_view alt;
+  for (int i = 0; i < 5; ++i) {
+    alt = next_token(line);
+  }
+  return !alt.empty() && alt != "." && alt.find(',') == std::string_view::npos;
+}
+
+void parse_vcf_record(std::string_view line, unsigned long& position, std::size_t& gt_index,
+                      std::string_view& samples) {
+  // CHROM POS ID REF ALT QUAL FILTER INFO FORMAT
+  std::string_view field[9];
+  for (auto& f : field) {
+    f = next_token(line);
+  }
+  if (field[8].empty()) {
+    throw std::logic_error(MAKE_ERROR("Expected at least 9 fields in VCF record."));
+  }
+  position = parse_ulong(field[1]);
+
+  std::string_view format = field[8];
+  for (gt_index = 0;; ++gt_index) {
+    std::size_t colon = format.find(':');
+    if (format.substr(0, colon) == "GT") {
+      break;
+    }
+    if (colon == std::string_view::npos) {
+      throw std::logic_error(MAKE_ERROR("VCF record has no GT field."));
+    }
+    format.remove_prefix(colon + 1);
+  }
+  samples = line;
+}
+
+LineReader::LineReader(FileUtils::AutoGzIfstream& _in, std::size_t _block_size)
+    : in(_in), buffer(_block_size), block_size(_block_size) {
+}
+
+bool LineReader::next_line(std::string_view& line) {
+  std::size_t scanned = begin;
+  while (true) {
+    const char* data = buffer.data();
+    const void* newline = std::memchr(data + scanned, '\n', end - scanned);
+    if (newline != nullptr) {
+      auto pos = static_cast<std::size_t>(static_cast<const char*>(newline) - data);
+      line = std::string_view(data + begin, pos - begin);
+      begin = pos + 1;
+      return true;
+    }
+    if (eof) {
+      if (begin == end) {
+        return false;
+      }
+      // final line without a trailing newline
+      line = std::string_view(data + begin, end - begin);
+      begin = end;
+      return true;
+    }
+
+    // move the partial line to the front, then append another block
+    if (begin > 0) {
+      std::memmove(buffer.data(), data + begin, end - begin);
+      end -= begin;
+      begin = 0;
+    }
+    scanned = end;
+    if (buffer.size() - end < block_size) {
+      buffer.resize(end + block_size);
+    }
+    std::streamsize num_read = in.read(buffer.data() + end, static_cast<std::streamsize>(block_size));
+    if (num_read <= 0) {
+      eof = true;
+    }
+    else {
+      end += static_cast<std::size_t>(num_read);
+    }
+  }
+}
+
+} // namespace HapParser
@@ -0,0 +1,250 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_HAP_PARSER_HPP
+#define ARG_NEEDLE_HAP_PARSER_HPP
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "FileUtils.hpp"
+#include "utils.hpp"
+
+/**
+ * Allocation-free tokenizing of the Oxford .hap[s] / .sample[s] / .map text formats and of VCF.
+ *
+ * Everything here works on std::string_view slices of a decompressed byte buffer, so no
+ * std::string or std::stringstream is constructed per line or per field.
+ */
+namespace HapParser {
+
+/**
+ * @brief Whitespace as understood by operator>> in the default "C" locale.
+ */
+inline bool is_space(char c) noexcept {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/**
+ * @brief Pop the next whitespace-delimited token off the front of a line.
+ *
+ * @param rest Remaining unparsed part of the line, advanced past the returned token.
+ * @return The token, or an empty view if only whitespace remains.
+ */
+inline std::string_view next_token(std::string_view& rest) noexcept {
+  std::size_t i = 0;
+  while (i < rest.size() && is_space(rest[i])) {
+    ++i;
+  }
+  std::size_t j = i;
+  while (j < rest.size() && !is_space(rest[j])) {
+    ++j;
+  }
+  std::string_view token = rest.substr(i, j - i);
+  rest.remove_prefix(j);
+  return token;
+}
+
+/**
+ * @brief Strip leading and trailing whitespace.
+ */
+inline std::string_view trim(std::string_view s) noexcept {
+  while (!s.empty() && is_space(s.front())) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && is_space(s.back())) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+/**
+ * @brief Parse a floating point token; the equivalent of std::stod without a temporary string.
+ */
+double parse_double(std::string_view token);
+
+/**
+ * @brief Parse an unsigned integer token; the equivalent of std::stoul without a temporary string.
+ */
+unsigned long parse_ulong(std::string_view token);
+
+/**
+ * @brief One record of a .map file.
+ */
+struct MapRecord {
+  double genetic_position;
+  unsigned long physical_position;
+};
+
+/**
+ * @brief Parse a .map line of the form "chr snp_id cM bp".
+ *
+ * @return false for blank lines, which carry no record.
+ */
+bool parse_map_line(std::string_view line, MapRecord& record);
+
+/**
+ * @brief Skip the five metadata fields (chr, id, pos, allele 0, allele 1) of a .hap[s] line.
+ *
+ * @param line The full line.
+ * @param alleles Receives the trimmed remainder of the line holding the haplotype alleles.
+ * @return false for blank lines, which carry no site.
+ */
+bool skip_hap_metadata(std::string_view line, std::string_view& alleles);
+
+/**
+ * @brief Whether allele characters sit at even offsets, separated by single whitespace characters.
+ *
+ * This is the layout written by all the tools we know of, and lets alleles be read by stride.
+ */
+inline bool alleles_are_strided(std::string_view alleles, std::size_t num_haps) noexcept {
+  if (num_haps == 0 || alleles.size() != 2 * num_haps - 1) {
+    return false;
+  }
+  const char* p = alleles.data();
+  for (std::size_t i = 0; i + 1 < alleles.size(); i += 2) {
+    if (is_space(p[i]) || !is_space(p[i + 1])) {
+      return false;
+    }
+  }
+  return !is_space(p[alleles.size() - 1]);
+}
+
+/**
+ * @brief Call f(hap_id, allele_char) for each of the first num_haps allele characters.
+ *
+ * Alleles are read with the same semantics as repeated `stream >> c` for a char c, i.e. each
+ * allele is the next non-whitespace character. Well-formed lines are read by stride.
+ *
+ * @throws std::logic_error if the line holds fewer than num_haps alleles.
+ */
+template <typename F>
+void for_each_allele(std::string_view alleles, std::size_t num_haps, F&& f) {
+  const char* p = alleles.data();
+  if (alleles_are_strided(alleles, num_haps)) {
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      f(hap_id, p[2 * hap_id]);
+    }
+    return;
+  }
+  const char* end = p + alleles.size();
+  for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+    while (p < end && is_space(*p)) {
+      ++p;
+    }
+    if (p == end) {
+      throw std::logic_error(MAKE_ERROR("Expected " + std::to_string(num_haps) +
+                                        " alleles per line, found " + std::to_string(hap_id)));
+    }
+    f(hap_id, *p);
+    ++p;
+  }
+}
+
+/**
+ * @brief Whether a VCF line is a data record with exactly one ALT allele.
+ *
+ * Header lines, blank lines and multi-allelic or monomorphic (ALT ".") records all return false.
+ */
+bool is_biallelic_vcf_record(std::string_view line);
+
+/**
+ * @brief Split a VCF record into its position and its sample columns.
+ *
+ * @param line A data record.
+ * @param position Receives the POS field.
+ * @param gt_index Receives the index of the GT subfield within the FORMAT field.
+ * @param samples Receives the remainder of the line holding the per-sample columns.
+ * @throws std::logic_error if the record is truncated or has no GT subfield.
+ */
+void parse_vcf_record(std::string_view line, unsigned long& position, std::size_t& gt_index,
+                      std::string_view& samples);
+
+/**
+ * @brief Call f(hap_id, allele_char) for both alleles of the diploid GT of each sample.
+ *
+ * Haplotypes 2 * i and 2 * i + 1 are the first and second allele of sample i, matching the order
+ * used for the .hap format, so every allele is '0' or '1'.
+ *
+ * @throws std::logic_error if there are fewer than num_samples columns, or a GT is not diploid,
+ * phased ('|') and biallelic with no missing alleles.
+ */
+template <typename F>
+void for_each_vcf_allele(std::string_view samples, std::size_t num_samples, std::size_t gt_index,
+                         F&& f) {
+  for (std::size_t sample_id = 0; sample_id < num_samples; ++sample_id) {
+    std::string_view gt = next_token(samples);
+    if (gt.empty()) {
+      throw std::logic_error(MAKE_ERROR("Expected " + std::to_string(num_samples) +
+                                        " samples per VCF record, found " +
+                                        std::to_string(sample_id)));
+    }
+    for (std::size_t i = 0; i < gt_index; ++i) {
+      std::size_t colon = gt.find(':');
+      gt.remove_prefix(colon == std::string_view::npos ? gt.size() : colon + 1);
+    }
+    auto is_allele = [](char c) { return c == '0' || c == '1'; };
+    if (gt.size() < 3 || gt[1] != '|' || !is_allele(gt[0]) || !is_allele(gt[2]) ||
+        (gt.size() > 3 && gt[3] != ':')) {
+      throw std::logic_error(MAKE_ERROR("Expected a phased diploid biallelic genotype, found \"" +
+                                        std::string(gt.substr(0, gt.find(':'))) + "\""));
+    }
+    f(2 * sample_id, gt[0]);
+    f(2 * sample_id + 1, gt[2]);
+  }
+}
+
+/**
+ * @class LineReader
+ * @brief Splits a (possibly gzipped) stream into lines without copying them.
+ *
+ * Decompressed bytes are read in large blocks into an internal buffer and lines are handed out
+ * as views into it, with the same line semantics as std::getline.
+ */
+class LineReader {
+public:
+  /**
+   * @param in Open stream to read from; must outlive the reader.
+   * @param block_size Number of bytes requested from the stream per read.
+   */
+  explicit LineReader(FileUtils::AutoGzIfstream& in, std::size_t block_size = 1ul << 20);
+
+  /**
+   * @brief Fetch the next line, excluding the trailing newline.
+   *
+   * @param line Receives a view that stays valid until the next call.
+   * @return false once the stream is exhausted.
+   */
+  bool next_line(std::string_view& line);
+
+private:
+  FileUtils::AutoGzIfstream& in;
+  std::vector<char> buffer;
+  std::size_t block_size;
+  std::size_t begin = 0;
+  std::size_t end = 0;
+  bool eof = false;
+};
+
+} // namespace HapParser
+
+#endif // ARG_NEEDLE_HAP_PARSER_HPP
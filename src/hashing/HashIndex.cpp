@@ -0,0 +1,320 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "BinaryIO.hpp"
+#include "HashIndex.hpp"
+#include "utils.hpp"
+
+namespace {
+
+constexpr std::size_t initial_slots = 16;
+
+} // namespace
+
+// Chunk capacities run 2, 4, ..., max_chunk_capacity, then stay there, so the first
+// 2 * max_chunk_capacity - 2 IDs fill the doubling chunks
+uint32_t HashIndex::chunk_capacity(uint32_t n) noexcept {
+  constexpr uint32_t ramp_ids = 2 * max_chunk_capacity - 2;
+  return n < ramp_ids ? 1u << (31 - __builtin_clz(n + 2)) : max_chunk_capacity;
+}
+
+uint32_t HashIndex::index_in_chunk(uint32_t n) noexcept {
+  constexpr uint32_t ramp_ids = 2 * max_chunk_capacity - 2;
+  return n < ramp_ids ? n + 2 - chunk_capacity(n) : (n - ramp_ids) % max_chunk_capacity;
+}
+
+void HashIndex::reset(std::size_t num_columns, bool _compressed) {
+  compressed = _compressed;
+  columns.assign(num_columns, Column());
+  for (Column& c : columns) {
+    c.slots.resize(initial_slots);
+    c.shift = 64 - 4;
+  }
+}
+
+void HashIndex::write(std::ostream& out) const {
+  BinaryIO::write_value<uint8_t>(out, compressed ? 1 : 0);
+  BinaryIO::write_value<uint64_t>(out, columns.size());
+  for (const Column& c : columns) {
+    BinaryIO::write_value<uint64_t>(out, c.num_keys);
+    BinaryIO::write_value<uint32_t>(out, c.shift);
+    BinaryIO::write_vector(out, c.slots);
+    BinaryIO::write_vector(out, c.arena); // empty if compressed
+    BinaryIO::write_vector(out, c.bytes); // empty unless compressed
+  }
+}
+
+void HashIndex::read(BinaryIO::Reader& in) {
+  const bool read_compressed = in.read_value<uint8_t>() != 0;
+  const auto num_columns = in.read_value<uint64_t>();
+  in.check(num_columns <= in.bytes_left());
+  std::vector<Column> read_columns(num_columns);
+  for (Column& c : read_columns) {
+    c.num_keys = in.read_value<uint64_t>();
+    c.shift = in.read_value<uint32_t>();
+    in.read_vector(c.slots);
+    in.read_vector(c.arena);
+    in.read_vector(c.bytes);
+    // the table is a power of two that slot_of() indexes with the top bits of the hash
+    const std::size_t num_slots = c.slots.size();
+    in.check(num_slots >= initial_slots && (num_slots & (num_slots - 1)) == 0 &&
+             c.shift == 64u - static_cast<unsigned int>(__builtin_ctzll(num_slots)) && c.num_keys < num_slots);
+    const std::size_t list_bytes = read_compressed ? c.bytes.size() : c.arena.size();
+    const std::size_t chunk_size = read_compressed ? sizeof(PackedChunk) : 1;
+    for (const Bucket& bucket : c.slots) {
+      in.check(bucket.size <= 1 || bucket.tail + chunk_size <= list_bytes);
+    }
+  }
+  columns = std::move(read_columns);
+  compressed = read_compressed;
+}
+
+void HashIndex::grow(Column& c) {
+  std::vector<Bucket> old_slots(2 * c.slots.size());
+  std::swap(old_slots, c.slots);
+  c.shift -= 1;
+  const std::size_t mask = c.slots.size() - 1;
+  for (const Bucket& bucket : old_slots) {
+    if (bucket.size > 0) {
+      std::size_t slot = slot_of(c, bucket.key);
+      while (c.slots[slot].size > 0) {
+        slot = (slot + 1) & mask;
+      }
+      c.slots[slot] = bucket;
+    }
+  }
+}
+
+uint32_t HashIndex::new_chunk(Column& c, uint32_t capacity) {
+  if (c.arena.size() + capacity + 1 > std::numeric_limits<uint32_t>::max()) {
+    throw std::logic_error(MAKE_ERROR("Hash index column is too large for 32-bit offsets."));
+  }
+  const auto offset = static_cast<uint32_t>(c.arena.size());
+  if (c.arena.size() + capacity + 1 > c.arena.capacity()) {
+    // grow by half rather than doubling: every column grows at the same pace, so slack adds up
+    c.arena.reserve(c.arena.capacity() + c.arena.capacity() / 2 + capacity + 1);
+  }
+  c.arena.resize(c.arena.size() + capacity + 1, 0u);
+  return offset;
+}
+
+void HashIndex::insert(std::size_t column, word_type key, id_type id) {
+  Column& c = columns[column];
+  // keep the load factor at most 3/4
+  if (4 * (c.num_keys + 1) > 3 * c.slots.size()) {
+    grow(c);
+  }
+  const std::size_t mask = c.slots.size() - 1;
+  std::size_t slot = slot_of(c, key);
+  while (c.slots[slot].size > 0 && c.slots[slot].key != key) {
+    slot = (slot + 1) & mask;
+  }
+
+  Bucket& bucket = c.slots[slot];
+  if (bucket.size == 0) {
+    bucket.key = key;
+    bucket.tail = id;
+    bucket.size = 1;
+    ++c.num_keys;
+    return;
+  }
+  if (compressed) {
+    insert_packed(c, bucket, id);
+    return;
+  }
+  if (bucket.size == 1) {
+    // move the inline ID into a first chunk, linked to itself
+    const uint32_t chunk = new_chunk(c, 2);
+    c.arena[chunk] = chunk;
+    c.arena[chunk + 1] = bucket.tail;
+    bucket.tail = chunk;
+  }
+  else if (index_in_chunk(bucket.size) == 0) {
+    // the last chunk is full: splice a larger one in before the first chunk
+    const uint32_t chunk = new_chunk(c, chunk_capacity(bucket.size));
+    c.arena[chunk] = c.arena[bucket.tail];
+    c.arena[bucket.tail] = chunk;
+    bucket.tail = chunk;
+  }
+  c.arena[bucket.tail + 1 + index_in_chunk(bucket.size)] = id;
+  ++bucket.size;
+}
+
+uint32_t HashIndex::new_packed_chunk(Column& c, PackedKind kind, uint16_t capacity, id_type first_id) {
+  const std::size_t size = sizeof(PackedChunk) + capacity;
+  if (c.bytes.size() + size > std::numeric_limits<uint32_t>::max()) {
+    throw std::logic_error(MAKE_ERROR("Hash index column is too large for 32-bit offsets."));
+  }
+  const auto offset = static_cast<uint32_t>(c.bytes.size());
+  if (c.bytes.size() + size > c.bytes.capacity()) {
+    c.bytes.reserve(c.bytes.capacity() + c.bytes.capacity() / 2 + size);
+  }
+  c.bytes.resize(c.bytes.size() + size, 0u);
+
+  PackedChunk chunk{};
+  chunk.next = offset;
+  chunk.first_id = first_id;
+  chunk.last_id = first_id;
+  chunk.capacity = capacity;
+  chunk.count = 1;
+  chunk.kind = kind;
+  std::memcpy(c.bytes.data() + offset, &chunk, sizeof(chunk));
+  if (kind == bitmap_chunk) {
+    c.bytes[offset + sizeof(PackedChunk)] = 1u;
+  }
+  return offset;
+}
+
+bool HashIndex::append_to_packed_chunk(Column& c, uint32_t offset, id_type id) {
+  PackedChunk chunk = read_chunk(c.bytes, offset);
+  uint8_t* data = c.bytes.data() + offset + sizeof(PackedChunk);
+  if (chunk.kind == varint_chunk) {
+    uint8_t encoded[5];
+    std::size_t length = 0;
+    for (uint32_t gap = id - chunk.last_id;; gap >>= 7) {
+      encoded[length++] = static_cast<uint8_t>((gap & 0x7fu) | (gap >= 0x80u ? 0x80u : 0u));
+      if (gap < 0x80u) {
+        break;
+      }
+    }
+    if (chunk.used + length > chunk.capacity) {
+      return false;
+    }
+    std::memcpy(data + chunk.used, encoded, length);
+    chunk.used = static_cast<uint16_t>(chunk.used + length);
+  }
+  else {
+    const uint32_t bit = id - chunk.first_id;
+    if (bit >= 8u * chunk.capacity) {
+      return false;
+    }
+    data[bit / 8] = static_cast<uint8_t>(data[bit / 8] | (1u << (bit % 8)));
+  }
+  chunk.last_id = id;
+  chunk.count = static_cast<uint16_t>(chunk.count + 1);
+  std::memcpy(c.bytes.data() + offset, &chunk, sizeof(chunk));
+  return true;
+}
+
+void HashIndex::insert_packed(Column& c, Bucket& bucket, id_type id) {
+  if (bucket.size == 1) {
+    // move the inline ID into a first chunk, linked to itself
+    if (id <= bucket.tail) {
+      throw std::logic_error(MAKE_ERROR("Compressed posting lists require increasing haplotype IDs."));
+    }
+    bucket.tail = new_packed_chunk(c, varint_chunk, min_packed_capacity, bucket.tail);
+  }
+  const PackedChunk tail = read_chunk(c.bytes, bucket.tail);
+  if (id <= tail.last_id) {
+    throw std::logic_error(MAKE_ERROR("Compressed posting lists require increasing haplotype IDs."));
+  }
+  if (!append_to_packed_chunk(c, bucket.tail, id)) {
+    // pick the container that would have stored the full chunk's IDs in fewer bytes
+    PackedKind kind = varint_chunk;
+    if (tail.kind == varint_chunk) {
+      const uint64_t range = static_cast<uint64_t>(tail.last_id) - tail.first_id + 1;
+      if (range < 8ull * tail.used) {
+        kind = bitmap_chunk;
+      }
+    }
+    else if (tail.count > tail.capacity) {
+      kind = bitmap_chunk;
+    }
+    const auto capacity = static_cast<uint16_t>(std::min<uint32_t>(2u * tail.capacity, max_packed_capacity));
+    const uint32_t offset = new_packed_chunk(c, kind, capacity, id);
+    // splice the new chunk in after the tail, before the first chunk
+    PackedChunk chunk = read_chunk(c.bytes, offset);
+    chunk.next = tail.next;
+    std::memcpy(c.bytes.data() + offset, &chunk, sizeof(chunk));
+    PackedChunk old_tail = read_chunk(c.bytes, bucket.tail);
+    old_tail.next = offset;
+    std::memcpy(c.bytes.data() + bucket.tail, &old_tail, sizeof(old_tail));
+    bucket.tail = offset;
+  }
+  ++bucket.size;
+}
+
+HashIndex::MemoryUsage HashIndex::memory_usage() const noexcept {
+  MemoryUsage usage;
+  usage.tables = columns.capacity() * sizeof(Column);
+  for (const Column& c : columns) {
+    usage.tables += c.slots.capacity() * sizeof(Bucket);
+    usage.posting_lists += c.arena.capacity() * sizeof(id_type) + c.bytes.capacity();
+  }
+  return usage;
+}
+
+HashIndex::MemoryUsage HashIndex::predict_memory_usage(std::size_t num_columns, std::size_t num_ids,
+                                                       std::size_t keys_per_column, bool compressed) {
+  if (num_ids > std::numeric_limits<id_type>::max()) {
+    throw std::logic_error(MAKE_ERROR("The hash index stores haplotype IDs as 32-bit integers."));
+  }
+  MemoryUsage usage;
+  usage.tables = num_columns * sizeof(Column);
+  if (num_ids == 0) {
+    usage.tables += num_columns * initial_slots * sizeof(Bucket);
+    return usage;
+  }
+  const std::size_t num_keys = std::min(std::max<std::size_t>(keys_per_column, 1), num_ids);
+  std::size_t num_slots = initial_slots;
+  while (4 * num_keys > 3 * num_slots) {
+    num_slots *= 2;
+  }
+  usage.tables += num_columns * num_slots * sizeof(Bucket);
+
+  // Lay out one list for real, with IDs spaced as if the lists of all keys were interleaved
+  const std::size_t list_size = (num_ids + num_keys - 1) / num_keys;
+  if (list_size > 1) {
+    HashIndex probe;
+    probe.reset(1, compressed);
+    for (std::size_t i = 0; i < list_size; ++i) {
+      probe.insert(0, 0, static_cast<id_type>(i * num_keys));
+    }
+    const Column& c = probe.columns[0];
+    const std::size_t list_bytes = c.arena.size() * sizeof(id_type) + c.bytes.size();
+    // arenas grow by half plus the chunk being added, so capacity can reach one and a half times
+    // the bytes in use plus a largest chunk
+    const std::size_t largest_chunk = compressed ? sizeof(PackedChunk) + max_packed_capacity
+                                                 : (max_chunk_capacity + 1) * sizeof(id_type);
+    usage.posting_lists = num_columns * (num_keys * list_bytes * 3 / 2 + largest_chunk);
+  }
+  return usage;
+}
+
+const HashIndex::Bucket* HashIndex::find(std::size_t column, word_type key) const noexcept {
+  if (column >= columns.size()) {
+    return nullptr;
+  }
+  const Column& c = columns[column];
+  const std::size_t mask = c.slots.size() - 1;
+  std::size_t slot = slot_of(c, key);
+  while (c.slots[slot].size > 0) {
+    if (c.slots[slot].key == key) {
+      return &c.slots[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+  return nullptr;
+}
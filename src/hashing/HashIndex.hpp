@@ -0,0 +1,275 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_HASH_INDEX_HPP
+#define ARG_NEEDLE_HASH_INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <vector>
+
+namespace BinaryIO {
+class Reader;
+}
+
+/**
+ * @class HashIndex
+ * @brief For each word column, maps word values to the haplotypes that carry them.
+ *
+ * Each column is an open-addressing table with linear probing, keyed on the word value. The
+ * haplotype IDs of a bucket are stored as 32-bit integers: a single ID inline in the bucket, and
+ * longer lists in a circular chain of chunks carved out of a per-column arena, with chunk sizes
+ * doubling from 2 up to a cap. Adding a haplotype therefore never allocates per bucket, and IDs
+ * are read back in insertion order.
+ *
+ * Optionally, posting lists are compressed instead. Chunks then live in a per-column byte arena
+ * and each is either a run of delta-varint gaps, or a bitmap over a range of IDs when the list is
+ * dense enough for that to be smaller, similar to the containers of a roaring bitmap. Compressed
+ * lists require every list to receive its IDs in increasing order, as add_to_hash does when
+ * haplotypes are hashed in ID order, and are decoded on the fly by for_each_id.
+ */
+class HashIndex {
+public:
+  typedef uint64_t word_type;
+  typedef uint32_t id_type;
+
+  /**
+   * @brief One table slot: a word value and its posting list. Unused slots have size 0.
+   */
+  struct Bucket {
+    word_type key = 0;
+    // the only ID if size is 1, otherwise the arena offset of the last chunk, whose link points
+    // back to the first chunk
+    uint32_t tail = 0;
+    uint32_t size = 0;
+  };
+
+  /**
+   * @brief Bytes allocated by the index, excluding heap allocator overhead.
+   */
+  struct MemoryUsage {
+    std::size_t tables = 0;        // open-addressing slots and per-column bookkeeping
+    std::size_t posting_lists = 0; // chunk arenas, plain or compressed
+  };
+
+  HashIndex() = default;
+
+  /**
+   * @brief Drop all entries and set up num_columns empty columns.
+   *
+   * @param compressed Whether to store compressed posting lists.
+   */
+  void reset(std::size_t num_columns, bool compressed = false);
+
+  bool is_compressed() const noexcept {
+    return compressed;
+  }
+
+  std::size_t num_columns() const noexcept {
+    return columns.size();
+  }
+
+  bool empty() const noexcept {
+    return columns.empty();
+  }
+
+  MemoryUsage memory_usage() const noexcept;
+
+  /**
+   * @brief Append the index to a binary snapshot, column by column as it is laid out in memory.
+   */
+  void write(std::ostream& out) const;
+  /**
+   * @brief Replace the index with one written by write(), copying each column's arrays as a
+   * whole rather than inserting entries again.
+   *
+   * @throws std::logic_error if the snapshot is truncated or its sizes are inconsistent. The chunk links and offsets
+   * are not checked, so the snapshot must come from a checksummed file.
+   */
+  void read(BinaryIO::Reader& in);
+
+  /**
+   * @brief Predict the memory of an index over num_columns columns into which num_ids IDs are
+   * inserted, assuming keys_per_column distinct words per column carrying equally long, evenly
+   * interleaved posting lists.
+   *
+   * Arenas are counted at the largest capacity their growth policy can reach for that size.
+   */
+  static MemoryUsage predict_memory_usage(std::size_t num_columns, std::size_t num_ids,
+                                          std::size_t keys_per_column, bool compressed);
+
+  /**
+   * @brief Append id to the posting list of key in a column.
+   *
+   * @throws std::logic_error if the index is compressed and id is not larger than the last ID
+   *   appended to the same list.
+   */
+  void insert(std::size_t column, word_type key, id_type id);
+
+  /**
+   * @brief The bucket of key in a column, or nullptr if no haplotype has that word.
+   */
+  const Bucket* find(std::size_t column, word_type key) const noexcept;
+
+  /**
+   * @brief Hint the cache to fetch the slot that a later find(column, key) or insert(column, key,
+   * ...) will probe first.
+   */
+  void prefetch(std::size_t column, word_type key) const noexcept {
+    if (column < columns.size()) {
+      const Column& c = columns[column];
+      __builtin_prefetch(c.slots.data() + slot_of(c, key));
+    }
+  }
+
+  /**
+   * @brief Call f(id) for each ID of a bucket found in the given column, in insertion order.
+   */
+  template <typename F>
+  void for_each_id(std::size_t column, const Bucket& bucket, F&& f) const {
+    if (bucket.size == 1) {
+      f(bucket.tail);
+      return;
+    }
+    if (compressed) {
+      for_each_packed_id(columns[column].bytes, bucket, f);
+      return;
+    }
+    const id_type* arena = columns[column].arena.data();
+    uint32_t remaining = bucket.size;
+    uint32_t capacity = 2;
+    for (uint32_t chunk = arena[bucket.tail]; remaining > 0; chunk = arena[chunk]) {
+      const uint32_t n = remaining < capacity ? remaining : capacity;
+      const id_type* ids = arena + chunk + 1;
+      for (uint32_t i = 0; i < n; ++i) {
+        f(ids[i]);
+      }
+      remaining -= n;
+      capacity = capacity < max_chunk_capacity ? 2 * capacity : capacity;
+    }
+  }
+
+  /**
+   * @brief Call f(bucket) for each used bucket of a column, in table order.
+   */
+  template <typename F>
+  void for_each_bucket(std::size_t column, F&& f) const {
+    for (const Bucket& bucket : columns[column].slots) {
+      if (bucket.size > 0) {
+        f(bucket);
+      }
+    }
+  }
+
+private:
+  static constexpr uint32_t max_chunk_capacity = 1024;
+  static constexpr uint16_t min_packed_capacity = 8;    // bytes
+  static constexpr uint16_t max_packed_capacity = 4096; // bytes
+
+  struct Column {
+    std::vector<Bucket> slots;  // power-of-two size
+    std::vector<id_type> arena; // chunks of [link to the next chunk, ids...]
+    std::vector<uint8_t> bytes; // compressed chunks of [PackedChunk, data...]
+    std::size_t num_keys = 0;
+    unsigned int shift = 64;
+  };
+
+  enum PackedKind : uint8_t { varint_chunk, bitmap_chunk };
+
+  // Header of a compressed chunk. A varint chunk holds the gaps after first_id; a bitmap chunk
+  // has bit i set if first_id + i is in the list.
+  struct PackedChunk {
+    uint32_t next;
+    id_type first_id;
+    id_type last_id;
+    uint16_t capacity; // data bytes
+    uint16_t used;     // data bytes, for varint chunks
+    uint16_t count;    // IDs
+    uint8_t kind;
+    uint8_t padding;
+  };
+
+  static PackedChunk read_chunk(const std::vector<uint8_t>& bytes, uint32_t offset) noexcept {
+    PackedChunk chunk;
+    std::memcpy(&chunk, bytes.data() + offset, sizeof(chunk));
+    return chunk;
+  }
+
+  template <typename F>
+  static void for_each_packed_id(const std::vector<uint8_t>& bytes, const Bucket& bucket, F&& f) {
+    for (uint32_t offset = read_chunk(bytes, bucket.tail).next;;) {
+      const PackedChunk chunk = read_chunk(bytes, offset);
+      const uint8_t* data = bytes.data() + offset + sizeof(PackedChunk);
+      if (chunk.kind == varint_chunk) {
+        id_type id = chunk.first_id;
+        f(id);
+        for (const uint8_t *p = data, *end = data + chunk.used; p < end;) {
+          uint32_t gap = 0;
+          for (unsigned int shift = 0;; shift += 7) {
+            const uint8_t b = *p++;
+            gap |= (b & 0x7fu) << shift;
+            if ((b & 0x80u) == 0) {
+              break;
+            }
+          }
+          id += gap;
+          f(id);
+        }
+      }
+      else {
+        for (uint32_t w = 0; w < chunk.capacity / 8u; ++w) {
+          uint64_t bits;
+          std::memcpy(&bits, data + 8 * w, sizeof(bits));
+          while (bits != 0) {
+            f(chunk.first_id + 64 * w + static_cast<uint32_t>(__builtin_ctzll(bits)));
+            bits &= bits - 1;
+          }
+        }
+      }
+      if (offset == bucket.tail) {
+        break;
+      }
+      offset = chunk.next;
+    }
+  }
+
+  static std::size_t slot_of(const Column& c, word_type key) noexcept {
+    // Fibonacci hashing on a murmur-mixed key: word values are highly structured
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return static_cast<std::size_t>((key * 0x9e3779b97f4a7c15ull) >> c.shift);
+  }
+
+  // capacity of the chunk holding the n-th ID (from 0) of a list, and the ID's index within it
+  static uint32_t chunk_capacity(uint32_t n) noexcept;
+  static uint32_t index_in_chunk(uint32_t n) noexcept;
+  static void grow(Column& c);
+  static uint32_t new_chunk(Column& c, uint32_t capacity);
+  static uint32_t new_packed_chunk(Column& c, PackedKind kind, uint16_t capacity, id_type first_id);
+  static bool append_to_packed_chunk(Column& c, uint32_t offset, id_type id);
+  static void insert_packed(Column& c, Bucket& bucket, id_type id);
+
+  std::vector<Column> columns;
+  bool compressed = false;
+};
+
+#endif // ARG_NEEDLE_HASH_INDEX_HPP
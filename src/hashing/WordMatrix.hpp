@@ -0,0 +1,239 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARG_NEEDLE_WORD_MATRIX_HPP
+#define ARG_NEEDLE_WORD_MATRIX_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+/**
+ * @class WordMatrix
+ * @brief Row-major matrix of packed words, one row per haplotype, in a single allocation.
+ *
+ * Rows are padded to a stride of whole cache lines and the storage is cache-line aligned, so every
+ * row starts on its own cache line. Padding words are always zero.
+ *
+ * The matrix either owns its storage or is a read-only view of memory owned by someone else,
+ * such as a memory-mapped file, which is kept alive for as long as the view exists.
+ */
+class WordMatrix {
+public:
+  typedef uint64_t word_type;
+  static constexpr std::size_t alignment = 64; // bytes
+  static constexpr std::size_t words_per_line = alignment / sizeof(word_type);
+
+  /**
+   * @brief Number of words between the starts of consecutive rows of num_cols words.
+   */
+  static constexpr std::size_t padded_stride(std::size_t num_cols) noexcept {
+    return (num_cols + words_per_line - 1) / words_per_line * words_per_line;
+  }
+
+  WordMatrix() = default;
+
+  /**
+   * @brief Owning, zero-initialised matrix.
+   */
+  WordMatrix(std::size_t num_rows, std::size_t num_cols)
+      : n_rows(num_rows), n_cols(num_cols), n_stride(padded_stride(num_cols)), n_capacity(num_rows),
+        storage(allocate(num_rows * n_stride)) {
+  }
+
+  /**
+   * @brief Read-only view of external memory holding num_rows rows of num_cols words, num_stride
+   * words apart.
+   *
+   * @param owner Keeps the viewed memory alive, e.g. a handle to a memory-mapped file.
+   */
+  WordMatrix(const word_type* data, std::size_t num_rows, std::size_t num_cols, std::size_t num_stride,
+             std::shared_ptr<const void> owner)
+      : n_rows(num_rows), n_cols(num_cols), n_stride(num_stride), n_capacity(num_rows), view_data(data),
+        view_owner(std::move(owner)) {
+  }
+
+  WordMatrix(const WordMatrix& other)
+      : n_rows(other.n_rows), n_cols(other.n_cols), n_stride(other.n_stride), n_capacity(other.n_rows),
+        view_data(other.view_data), view_owner(other.view_owner) {
+    if (!other.is_view()) {
+      storage = allocate(n_rows * n_stride);
+      std::copy(other.data(), other.data() + n_rows * n_stride, storage.get());
+    }
+  }
+
+  WordMatrix& operator=(const WordMatrix& other) {
+    if (this != &other) {
+      *this = WordMatrix(other);
+    }
+    return *this;
+  }
+
+  WordMatrix(WordMatrix&&) noexcept = default;
+  WordMatrix& operator=(WordMatrix&&) noexcept = default;
+
+  std::size_t rows() const noexcept {
+    return n_rows;
+  }
+
+  std::size_t cols() const noexcept {
+    return n_cols;
+  }
+
+  std::size_t stride() const noexcept {
+    return n_stride;
+  }
+
+  /**
+   * @brief Number of rows that fit in the storage without reallocating.
+   */
+  std::size_t row_capacity() const noexcept {
+    return n_capacity;
+  }
+
+  bool is_view() const noexcept {
+    return view_owner != nullptr;
+  }
+
+  const word_type* data() const noexcept {
+    return is_view() ? view_data : storage.get();
+  }
+
+  const word_type* row(std::size_t r) const noexcept {
+    return data() + r * n_stride;
+  }
+
+  word_type* mutable_row(std::size_t r) {
+    if (is_view()) {
+      throw std::logic_error(MAKE_ERROR("Cannot modify a read-only view of haplotype words."));
+    }
+    return storage.get() + r * n_stride;
+  }
+
+  word_type operator()(std::size_t r, std::size_t c) const noexcept {
+    return data()[r * n_stride + c];
+  }
+
+  /**
+   * @brief Drop trailing columns of an owning matrix, keeping padding words zero.
+   */
+  void shrink_cols(std::size_t num_cols) {
+    if (is_view()) {
+      throw std::logic_error(MAKE_ERROR("Cannot modify a read-only view of haplotype words."));
+    }
+    if (num_cols > n_cols) {
+      throw std::logic_error(MAKE_ERROR("Cannot grow a matrix with shrink_cols."));
+    }
+    const std::size_t num_stride = padded_stride(num_cols);
+    if (num_stride == n_stride) {
+      for (std::size_t r = 0; r < n_rows; ++r) {
+        std::fill(mutable_row(r) + num_cols, mutable_row(r) + n_cols, 0ull);
+      }
+    }
+    else {
+      auto shrunk = allocate(n_rows * num_stride);
+      for (std::size_t r = 0; r < n_rows; ++r) {
+        std::copy(row(r), row(r) + num_cols, shrunk.get() + r * num_stride);
+      }
+      storage = std::move(shrunk);
+      n_stride = num_stride;
+      n_capacity = n_rows;
+    }
+    n_cols = num_cols;
+  }
+
+  /**
+   * @brief Add zero rows at the end or drop trailing rows, keeping the others.
+   *
+   * Rows beyond the capacity reallocate the storage to exactly num_rows rows, copying the kept
+   * ones, so adding rows in batches costs in proportion to the rows added only within capacity
+   * reserved by reserve_rows(). A view becomes an owning copy.
+   */
+  void resize_rows(std::size_t num_rows) {
+    if (is_view() || num_rows > n_capacity) {
+      reallocate(std::min(n_rows, num_rows), num_rows);
+    }
+    if (num_rows > n_rows) {
+      std::fill(storage.get() + n_rows * n_stride, storage.get() + num_rows * n_stride, 0ull);
+    }
+    n_rows = num_rows;
+  }
+
+  /**
+   * @brief Make room for num_rows rows without changing the rows, so that later resize_rows calls
+   * up to num_rows do not copy the matrix. The room is allocated but not written, so the system
+   * only commits its pages as rows are added. A view becomes an owning copy.
+   */
+  void reserve_rows(std::size_t num_rows) {
+    if (is_view() || num_rows > n_capacity) {
+      reallocate(n_rows, std::max(num_rows, n_rows));
+    }
+  }
+
+private:
+  struct AlignedDelete {
+    void operator()(word_type* p) const noexcept {
+      ::operator delete[](p, std::align_val_t(alignment));
+    }
+  };
+  using Storage = std::unique_ptr<word_type[], AlignedDelete>;
+
+  // storage for num_words words, of which the first num_zero_words are zeroed and the rest left
+  // unwritten
+  static Storage allocate(std::size_t num_words, std::size_t num_zero_words) {
+    if (num_words == 0) {
+      return nullptr;
+    }
+    auto* p = static_cast<word_type*>(::operator new[](num_words * sizeof(word_type), std::align_val_t(alignment)));
+    std::fill(p, p + std::min(num_zero_words, num_words), 0ull);
+    return Storage(p);
+  }
+
+  static Storage allocate(std::size_t num_words) {
+    return allocate(num_words, num_words);
+  }
+
+  // move the first num_kept rows to unwritten storage for capacity rows; rows past n_rows are
+  // zeroed by resize_rows as they are added
+  void reallocate(std::size_t num_kept, std::size_t capacity) {
+    auto grown = allocate(capacity * n_stride, 0);
+    std::copy(data(), data() + num_kept * n_stride, grown.get());
+    storage = std::move(grown);
+    view_data = nullptr;
+    view_owner.reset();
+    n_capacity = capacity;
+  }
+
+  std::size_t n_rows = 0;
+  std::size_t n_cols = 0;
+  std::size_t n_stride = 0;
+  std::size_t n_capacity = 0; // rows
+  Storage storage;
+  const word_type* view_data = nullptr;
+  std::shared_ptr<const void> view_owner;
+};
+
+#endif // ARG_NEEDLE_WORD_MATRIX_HPP
@@ -17,37 +17,298 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "FileUtils.hpp"
 #include "HapData.hpp"
 #include "utils.hpp"
 
 namespace py = pybind11;
 using std::string;
 
+namespace {
+
+using Cousins = std::vector<std::tuple<size_t, size_t, std::vector<std::pair<size_t, double>>>>;
+using CousinArrays = std::tuple<py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<int64_t>, py::array_t<double>>;
+
+// Window first and last sites, and windows x k matrices of cousin IDs padded with -1 and of scores
+// padded with 0, without creating a Python object per cousin
+CousinArrays cousins_to_arrays(const Cousins& cousins, unsigned int k) {
+  const auto num_windows = static_cast<std::ptrdiff_t>(cousins.size());
+  py::array_t<int64_t> starts(num_windows);
+  py::array_t<int64_t> ends(num_windows);
+  py::array_t<int64_t> ids({num_windows, static_cast<std::ptrdiff_t>(k)});
+  py::array_t<double> scores({num_windows, static_cast<std::ptrdiff_t>(k)});
+  int64_t* start_data = starts.mutable_data();
+  int64_t* end_data = ends.mutable_data();
+  int64_t* id_data = ids.mutable_data();
+  double* score_data = scores.mutable_data();
+  for (size_t w = 0; w < cousins.size(); ++w) {
+    const auto& found = std::get<2>(cousins[w]);
+    start_data[w] = static_cast<int64_t>(std::get<0>(cousins[w]));
+    end_data[w] = static_cast<int64_t>(std::get<1>(cousins[w]));
+    for (size_t j = 0; j < k; ++j) {
+      id_data[w * k + j] = j < found.size() ? static_cast<int64_t>(found[j].first) : -1;
+      score_data[w * k + j] = j < found.size() ? found[j].second : 0.;
+    }
+  }
+  return CousinArrays(starts, ends, ids, scores);
+}
+
+// Minimal concurrent.futures-style wrapper around the futures returned by HapData's asynchronous calls
+template <typename T>
+py::class_<std::shared_future<T>> bind_future(py::module& m, const char* name) {
+  return py::class_<std::shared_future<T>>(m, name)
+      .def(
+          "result", [](const std::shared_future<T>& future) { return future.get(); },
+          py::call_guard<py::gil_scoped_release>(), "Wait for the call to finish and return its result.")
+      .def("done", [](const std::shared_future<T>& future) {
+        return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+      });
+}
+
+} // namespace
+
 PYBIND11_MODULE(arg_needle_hashing_pybind, m) {
+  bind_future<void>(m, "HashFuture");
+  bind_future<Cousins>(m, "CousinsFuture")
+      .def(
+          "result_arrays",
+          [](const std::shared_future<Cousins>& future, unsigned int k) {
+            Cousins cousins;
+            {
+              py::gil_scoped_release release;
+              cousins = future.get();
+            }
+            return cousins_to_arrays(cousins, k);
+          },
+          py::arg("k"), "result() in the form of HapData.get_closest_cousins_arrays, for the k of the query.");
+
+  py::class_<HapData::MemoryUsage>(m, "HapDataMemoryUsage")
+      .def_readonly("words", &HapData::MemoryUsage::words)
+      .def_readonly("words_mapped", &HapData::MemoryUsage::words_mapped)
+      .def_readonly("hash_tables", &HapData::MemoryUsage::hash_tables)
+      .def_readonly("posting_lists", &HapData::MemoryUsage::posting_lists)
+      .def_readonly("pbwt", &HapData::MemoryUsage::pbwt)
+      .def_readonly("hashed_hap_ids", &HapData::MemoryUsage::hashed_hap_ids)
+      .def_readonly("positions", &HapData::MemoryUsage::positions)
+      .def_readonly("site_mafs", &HapData::MemoryUsage::site_mafs)
+      .def_readonly("sample_names", &HapData::MemoryUsage::sample_names)
+      .def_readonly("loader_buffers", &HapData::MemoryUsage::loader_buffers)
+      .def_property_readonly("total", &HapData::MemoryUsage::total)
+      .def_property_readonly("peak", &HapData::MemoryUsage::peak,
+                             "Largest footprint at any one time, as loader buffers are released "
+                             "before hashing.")
+      .def("as_dict",
+           [](const HapData::MemoryUsage& usage) {
+             py::dict d;
+             d["words"] = usage.words;
+             d["hash_tables"] = usage.hash_tables;
+             d["posting_lists"] = usage.posting_lists;
+             d["pbwt"] = usage.pbwt;
+             d["hashed_hap_ids"] = usage.hashed_hap_ids;
+             d["positions"] = usage.positions;
+             d["site_mafs"] = usage.site_mafs;
+             d["sample_names"] = usage.sample_names;
+             d["loader_buffers"] = usage.loader_buffers;
+             return d;
+           })
+      .def("__repr__", [](const HapData::MemoryUsage& usage) {
+        std::ostringstream oss;
+        oss << "HapDataMemoryUsage(words=" << usage.words << (usage.words_mapped ? " (mapped)" : "")
+            << ", hash_tables=" << usage.hash_tables << ", posting_lists=" << usage.posting_lists
+            << ", pbwt=" << usage.pbwt << ", hashed_hap_ids=" << usage.hashed_hap_ids
+            << ", positions=" << usage.positions
+            << ", site_mafs=" << usage.site_mafs << ", sample_names=" << usage.sample_names
+            << ", loader_buffers=" << usage.loader_buffers << ", total=" << usage.total() << ")";
+        return oss.str();
+      });
+
   py::class_<HapData>(m, "HapData")
-      .def(py::init<string, string, unsigned int, string, bool>(), "Initialize HapData",
-           py::arg("mode"), py::arg("file_root_path"), py::arg("word_size") = 64,
-           py::arg("map_file_path") = "", py::arg("fill_sites") = true)
+      .def(py::init<string, string, unsigned int, string, bool, unsigned int, size_t, size_t, const string&>(),
+           py::call_guard<py::gil_scoped_release>(), "Initialize HapData", py::arg("mode"), py::arg("file_root_path"),
+           py::arg("word_size") = 64, py::arg("map_file_path") = "", py::arg("fill_sites") = true,
+           py::arg("num_threads") = 1, py::arg("site_begin") = 0, py::arg("site_end") = 0,
+           py::arg("match_engine") = "hash")
+      .def(py::init([](const string& mode, py::array_t<uint8_t, py::array::forcecast> genotypes,
+                       py::array_t<unsigned long, py::array::c_style | py::array::forcecast> physical_positions,
+                       py::array_t<double, py::array::c_style | py::array::forcecast> genetic_positions,
+                       unsigned int word_size, bool fill_sites, bool bit_packed, size_t num_haps,
+                       const string& match_engine) {
+             if (genotypes.ndim() != 2) {
+               throw std::logic_error(MAKE_ERROR("Expected a 2D sites x haplotypes genotype matrix."));
+             }
+             if (physical_positions.ndim() != 1 || genetic_positions.ndim() != 1) {
+               throw std::logic_error(MAKE_ERROR("Expected 1D arrays of positions."));
+             }
+             const auto num_cols = static_cast<size_t>(genotypes.shape(1));
+             GenotypeView view;
+             view.data = genotypes.data();
+             view.num_sites = static_cast<size_t>(genotypes.shape(0));
+             view.site_stride = genotypes.strides(0);
+             view.hap_stride = genotypes.strides(1);
+             view.bit_packed = bit_packed;
+             view.num_haps = num_haps > 0 ? num_haps : (bit_packed ? 8 * num_cols : num_cols);
+             if (bit_packed ? (view.num_haps + 7) / 8 != num_cols : view.num_haps != num_cols) {
+               throw std::logic_error(MAKE_ERROR("num_haps does not match the genotype matrix columns."));
+             }
+             const unsigned long* physical = physical_positions.data();
+             const double* genetic = genetic_positions.data();
+             std::vector<unsigned long> physical_copy(physical, physical + physical_positions.size());
+             std::vector<double> genetic_copy(genetic, genetic + genetic_positions.size());
+             // the arrays stay referenced by the arguments, so only the packing runs without the GIL
+             py::gil_scoped_release release;
+             return new HapData(mode, view, std::move(physical_copy), std::move(genetic_copy), word_size, fill_sites,
+                                match_engine);
+           }),
+           "Initialize HapData from a sites x haplotypes NumPy genotype matrix, either one uint8 "
+           "allele per entry or bit-packed along haplotypes by numpy.packbits(genotypes, axis=1).",
+           py::arg("mode"), py::arg("genotypes"), py::arg("physical_positions"),
+           py::arg("genetic_positions"), py::arg("word_size") = 64, py::arg("fill_sites") = true,
+           py::arg("bit_packed") = false, py::arg("num_haps") = 0, py::arg("match_engine") = "hash")
       .def_readonly("num_haps", &HapData::num_haps)
       .def_readonly("num_sites", &HapData::num_sites)
       .def_readonly("word_size", &HapData::word_size)
-      .def_readonly(
-          "hashed_hap_ids", &HapData::hashed_hap_ids) // conversion from unordered_set to set
+      .def_property_readonly(
+          "hashed_hap_ids",
+          [](const HapData& data) {
+            // waits for asynchronous hashing, which changes the set on another thread
+            std::unordered_set<size_t> ids;
+            {
+              py::gil_scoped_release release;
+              ids = data.get_hashed_hap_ids();
+            }
+            return ids; // conversion from unordered_set to set
+          })
       .def_readonly(
           "physical_positions", &HapData::physical_positions) // conversion from vector to list
       .def_readonly(
           "genetic_positions", &HapData::genetic_positions) // conversion from vector to list
       .def_readonly("site_mafs", &HapData::site_mafs)       // conversion from vector to list
-      .def("add_to_hash", &HapData::add_to_hash, py::arg("hap_id"))
-      .def("get_closest_cousins", &HapData::get_closest_cousins, py::arg("hap_id"), py::arg("k"),
-           py::arg("tolerance") = 0, py::arg("window_size_genetic") = 0,
-           "Get K closest cousins to this one using hashing.")
+      // keeps the GIL, as it changes members that Python reads directly, such as sample_names
+      .def("append_haplotypes", &HapData::append_haplotypes, py::arg("file_root_path"), py::arg("map_file_path") = "", py::arg("num_threads") = 1,
+           "Append the haplotypes of another .hap[s] / .sample[s] file set with the same sites, keeping "
+           "existing hashes, so that a new batch costs in proportion to its size within the room made by "
+           "reserve_haplotypes.")
+      .def("reserve_haplotypes", &HapData::reserve_haplotypes, py::arg("num_haps"),
+           "Make room for num_haps haplotypes in total, so that appending batches up to that many "
+           "does not copy the haplotypes already loaded.")
+      .def("save", &HapData::save, py::arg("path"),
+           "Write a binary cache that can be passed as file_root_path to later constructions.")
+      .def_static("count_sites", &HapData::count_sites, py::arg("file_root_path"),
+                  "The number of sites that loading file_root_path would give, without loading it. "
+                  "Takes constant time for binary caches and for BGZF .hap[s].gz files with a line index.")
+      .def_static("is_cache_current", &HapData::is_cache_current, py::arg("cache_path"),
+                  py::arg("file_root_path"), py::arg("map_file_path") = "",
+                  "Whether cache_path is a binary cache written from the files that file_root_path and "
+                  "map_file_path name now, compared by absolute path, size and modification time.")
+      .def("save_hash_index", &HapData::save_hash_index, py::call_guard<py::gil_scoped_release>(),
+           py::arg("path"),
+           "Write the populated hash index, hashed_hap_ids and hashing configuration to a binary "
+           "snapshot, with a checksum of the data it was built from.")
+      .def("load_hash_index", &HapData::load_hash_index, py::call_guard<py::gil_scoped_release>(),
+           py::arg("path"), py::arg("id_limit") = std::numeric_limits<size_t>::max(),
+           "Restore a snapshot written by save_hash_index instead of hashing its haplotypes again. "
+           "Call before the first add_to_hash, after configuring hashing as when it was saved. "
+           "Stale snapshots, whose hashed haplotypes or sites have changed, and snapshots holding "
+           "a haplotype ID of id_limit or above are rejected.")
+      .def("set_compressed_hashes", &HapData::set_compressed_hashes, py::arg("compressed") = true,
+           "Store compressed posting lists in the hash index. Call before the first add_to_hash; "
+           "haplotypes must then be hashed in increasing ID order.")
+      .def("set_match_engine", &HapData::set_match_engine, py::arg("engine"),
+           "Find cousins with \"hash\" (word hash tables, the default), \"pbwt\" (exact matches in "
+           "sites from a dynamic PBWT, scored in sites, ignoring tolerance) or \"lsh\" (hash tables "
+           "keyed on random subsets of each word's sites, scored in collisions, ignoring tolerance). "
+           "Call before the first add_to_hash, or pass match_engine at construction.")
+      .def_property_readonly("match_engine", &HapData::match_engine)
+      .def("set_lsh_parameters", &HapData::set_lsh_parameters, py::arg("num_tables"), py::arg("bits_per_key") = 0,
+           py::arg("seed") = 1,
+           "Key each word column of the lsh engine in num_tables tables, each on bits_per_key sites "
+           "(0 means half the word size) drawn from seed. Call before the first add_to_hash.")
+      .def_property_readonly("lsh_num_tables", &HapData::lsh_num_tables)
+      .def("set_min_maf", &HapData::set_min_maf, py::arg("min_maf"),
+           "Hash only the sites with a minor allele frequency of at least min_maf, packed into words "
+           "of their own. Window sites still index all sites and cover every site. 0 hashes all "
+           "sites. Call before the first add_to_hash.")
+      .def_property_readonly("min_maf", &HapData::min_maf)
+      .def_property_readonly("num_hashed_sites", &HapData::num_hashed_sites)
+      .def("add_refinement", &HapData::add_refinement, py::arg("refine_word_size"),
+           "Also index the haplotypes at a finer word size, for queries with min_cousins or "
+           "min_score_per_word to re-score failing windows. Call from coarse to fine, before the "
+           "first add_to_hash.")
+      .def_property_readonly("refinement_word_sizes", &HapData::refinement_word_sizes)
+      .def("set_rerank_pool", &HapData::set_rerank_pool, py::arg("pool_size"),
+           "Re-rank the cousins of each window by their mismatches with the query among the pool_size "
+           "best-scoring candidates, filling windows with fewer than k candidates from the candidates "
+           "of neighbouring windows and the pool_size IDs below the query (score 0). 0 turns re-ranking off.")
+      .def_property_readonly("rerank_pool", &HapData::rerank_pool)
+      .def("add_to_hash", &HapData::add_to_hash, py::call_guard<py::gil_scoped_release>(), py::arg("hap_id"))
+      .def("add_range_to_hash", &HapData::add_range_to_hash, py::call_guard<py::gil_scoped_release>(),
+           py::arg("begin"), py::arg("end"), py::arg("num_threads") = 1,
+           "add_to_hash for haplotypes begin to end - 1, with the word columns split across "
+           "num_threads threads.")
+      .def("add_to_hash_async", &HapData::add_to_hash_async, py::keep_alive<0, 1>(), py::arg("hap_id"),
+           "add_to_hash on a background thread, returning a future. Asynchronous calls run in the "
+           "order they were made.")
+      .def("memory_usage", &HapData::memory_usage, "Bytes currently held, broken down by component.")
+      .def_static("predict_memory_usage", &HapData::predict_memory_usage, py::arg("num_haps"),
+                  py::arg("num_sites"), py::arg("word_size") = 64, py::arg("num_threads") = 1,
+                  py::arg("compressed_hashes") = false, py::arg("distinct_words") = 0,
+                  "Predict the memory of loading num_haps x num_sites from text and hashing every "
+                  "haplotype, without loading anything. Use .peak for the allocation to request.")
+      .def("get_closest_cousins",
+           py::overload_cast<size_t, unsigned int, unsigned int, double, unsigned int, double>(
+               &HapData::get_closest_cousins),
+           py::call_guard<py::gil_scoped_release>(), py::arg("hap_id"), py::arg("k"), py::arg("tolerance") = 0,
+           py::arg("window_size_genetic") = 0, py::arg("min_cousins") = 0, py::arg("min_score_per_word") = 0,
+           "Get K closest cousins to this one using hashing. With refinements, windows with fewer "
+           "than min_cousins cousins or a score sum below min_score_per_word per word are "
+           "re-scored at finer word sizes.")
+      .def(
+          "get_closest_cousins_arrays",
+          [](HapData& data, size_t hap_id, unsigned int k, unsigned int tolerance, double window_size_genetic,
+             unsigned int min_cousins, double min_score_per_word) {
+            Cousins cousins;
+            {
+              py::gil_scoped_release release;
+              cousins =
+                  data.get_closest_cousins(hap_id, k, tolerance, window_size_genetic, min_cousins, min_score_per_word);
+            }
+            return cousins_to_arrays(cousins, k);
+          },
+          py::arg("hap_id"), py::arg("k"), py::arg("tolerance") = 0, py::arg("window_size_genetic") = 0,
+          py::arg("min_cousins") = 0, py::arg("min_score_per_word") = 0,
+          "get_closest_cousins as NumPy arrays (starts, ends, ids, scores): the first and last site "
+          "of each window, and windows x k matrices of cousin IDs, best first and padded with -1, "
+          "and of their scores, padded with 0.")
+      .def("get_closest_cousins_async", &HapData::get_closest_cousins_async, py::keep_alive<0, 1>(),
+           py::arg("hap_id"), py::arg("k"), py::arg("tolerance") = 0, py::arg("window_size_genetic") = 0,
+           py::arg("min_cousins") = 0, py::arg("min_score_per_word") = 0,
+           "get_closest_cousins on a background thread, returning a future. It sees every "
+           "add_to_hash_async made before it.")
+      .def("wait_pending", &HapData::wait_pending, py::call_guard<py::gil_scoped_release>(),
+           "Wait for all asynchronous calls made so far to finish.")
+      .def("get_closest_cousins_batch", &HapData::get_closest_cousins_batch,
+           py::call_guard<py::gil_scoped_release>(), py::arg("hap_ids"), py::arg("k"),
+           py::arg("tolerance") = 0, py::arg("window_size_genetic") = 0, py::arg("num_threads") = 1,
+           py::arg("min_cousins") = 0, py::arg("min_score_per_word") = 0,
+           "get_closest_cousins for each of hap_ids, run on num_threads threads that each take the "
+           "next pending query. Each query only "
+           "considers hashed haplotypes with lower IDs, so the results match querying one at a "
+           "time while hashing in ID order.")
       .def("print_hap", &HapData::print_hap, py::arg("hap_id"))
       .def("print_hashes", &HapData::print_hashes)
       .def("print_word_match_diagram", &HapData::print_word_match_diagram, py::arg("hap_id1"),
@@ -93,4 +354,15 @@ PYBIND11_MODULE(arg_needle_hashing_pybind, m) {
         oss << data;
         return oss.str();
       });
+  m.def(
+      "build_line_index",
+      [](const string& path, unsigned int num_threads) {
+        return FileUtils::buildLineIndex(path, num_threads).numLines;
+      },
+      py::arg("path"), py::arg("num_threads") = 1,
+      "Write a sidecar line index for a BGZF-compressed file, enabling fast site counts and "
+      "site-range loading. Returns the number of lines.");
+  m.def("count_records", &FileUtils::AutoGzIfstream::recordCount, py::arg("path"),
+        "The number of non-blank lines of a file, e.g. the sites of a .hap file; constant time with "
+        "an up-to-date line index.");
 }
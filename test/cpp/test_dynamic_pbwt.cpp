@@ -0,0 +1,158 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BinaryIO.hpp"
+#include "DynamicPbwt.hpp"
+
+TEST_CASE("DynamicPbwt finds the longest matches at each site", "[test_dynamic_pbwt]") {
+  // haplotypes are noisy mosaics of three founders, packed into words of word_size sites
+  const std::size_t num_haps = 60;
+  const std::size_t num_sites = 150;
+  const unsigned int word_size = 16;
+  const std::size_t num_words = (num_sites + word_size - 1) / word_size;
+  std::mt19937_64 rng(7);
+  std::vector<std::vector<unsigned int>> founders(3, std::vector<unsigned int>(num_sites));
+  for (auto& founder : founders) {
+    for (auto& allele : founder) {
+      allele = rng() % 2;
+    }
+  }
+  std::vector<std::vector<unsigned int>> alleles(num_haps, std::vector<unsigned int>(num_sites));
+  std::vector<std::vector<std::uint64_t>> words(num_haps, std::vector<std::uint64_t>(num_words));
+  for (std::size_t h = 0; h < num_haps; ++h) {
+    std::size_t founder = rng() % 3;
+    for (std::size_t site = 0; site < num_sites; ++site) {
+      if (rng() % 20 == 0) {
+        founder = rng() % 3;
+      }
+      alleles[h][site] = founders[founder][site] ^ (rng() % 50 == 0);
+      words[h][site / word_size] |= static_cast<std::uint64_t>(alleles[h][site]) << (site % word_size);
+    }
+  }
+
+  DynamicPbwt pbwt;
+  REQUIRE(pbwt.empty());
+  REQUIRE_THROWS_AS(pbwt.insert(0, words[0].data()), std::logic_error);
+  pbwt.reset(num_sites, word_size);
+  // nodes are only allocated for inserted haplotypes, on top of a few words per column
+  REQUIRE(pbwt.memory_usage() < 64 * num_sites);
+  // insert all but the last few haplotypes, out of order, or in order, where queries jump over
+  // the haplotypes above their ID limit
+  std::vector<std::size_t> order(num_haps - 5);
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  DynamicPbwt ascending;
+  ascending.reset(num_sites, word_size);
+  for (std::size_t h : order) {
+    ascending.insert(static_cast<DynamicPbwt::id_type>(h), words[h].data());
+  }
+  std::shuffle(order.begin(), order.end(), rng);
+  for (std::size_t h : order) {
+    pbwt.insert(static_cast<DynamicPbwt::id_type>(h), words[h].data());
+  }
+  REQUIRE(pbwt.num_inserted() == order.size());
+  REQUIRE(pbwt.inserted_ids().back() == order.back());
+  REQUIRE(pbwt.memory_usage() >= 24 * order.size() * num_sites);
+
+  // the same after a snapshot
+  std::ostringstream out;
+  ascending.write(out);
+  const std::string bytes = out.str();
+  BinaryIO::Reader in(bytes.data(), bytes.size(), "PBWT");
+  DynamicPbwt reloaded;
+  reloaded.read(in);
+  REQUIRE(in.bytes_left() == 0);
+  REQUIRE(reloaded.inserted_ids() == ascending.inserted_ids());
+
+  std::vector<DynamicPbwt::Match> matches;
+  for (const DynamicPbwt* structure : {&pbwt, &ascending, &reloaded}) {
+    for (std::size_t query : {0ul, 17ul, 44ul, num_haps - 3}) {
+      for (std::size_t id_limit : {query, num_haps}) {
+        for (unsigned int k : {1u, 4u}) {
+          matches.clear();
+          structure->find_long_matches(words[query].data(), static_cast<DynamicPbwt::id_type>(id_limit), k,
+                                       matches);
+
+          // matches are maximal, exact and in order of end
+          for (std::size_t i = 0; i < matches.size(); ++i) {
+            const DynamicPbwt::Match& m = matches[i];
+            REQUIRE(m.id < id_limit);
+            REQUIRE(m.start < m.end);
+            REQUIRE((i == 0 || matches[i - 1].end <= m.end));
+            for (std::size_t site = m.start; site < m.end; ++site) {
+              REQUIRE(alleles[m.id][site] == alleles[query][site]);
+            }
+            REQUIRE((m.start == 0 || alleles[m.id][m.start - 1] != alleles[query][m.start - 1]));
+            REQUIRE((m.end == num_sites || alleles[m.id][m.end] != alleles[query][m.end]));
+          }
+
+          // at each site, the k longest reported matches covering it are as long as those of any
+          // k inserted haplotypes
+          for (std::size_t site = 0; site < num_sites; ++site) {
+            std::vector<std::size_t> expected;
+            for (std::size_t h : order) {
+              if (h >= id_limit || alleles[h][site] != alleles[query][site]) {
+                continue;
+              }
+              std::size_t start = site;
+              std::size_t end = site + 1;
+              while (start > 0 && alleles[h][start - 1] == alleles[query][start - 1]) {
+                --start;
+              }
+              while (end < num_sites && alleles[h][end] == alleles[query][end]) {
+                ++end;
+              }
+              expected.push_back(end - start);
+            }
+            std::vector<std::size_t> found;
+            for (const DynamicPbwt::Match& m : matches) {
+              if (m.start <= site && site < m.end) {
+                found.push_back(m.end - m.start);
+              }
+            }
+            for (auto* list : {&expected, &found}) {
+              std::sort(list->rbegin(), list->rend());
+              list->resize(std::min<std::size_t>(k, list->size()));
+            }
+            REQUIRE(found == expected);
+          }
+        }
+      }
+    }
+  }
+
+  pbwt.reset(num_sites, word_size);
+  REQUIRE(pbwt.num_inserted() == 0);
+  matches.clear();
+  pbwt.find_long_matches(words[0].data(), num_haps, 3, matches);
+  REQUIRE(matches.empty());
+}
@@ -19,8 +19,60 @@
 
 #include <catch2/catch_test_macros.hpp>
 
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
 #include "FileUtils.hpp"
 
+namespace {
+
+// Write data as BGZF with small blocks, so that lines straddle block boundaries
+void write_bgzf(const std::filesystem::path& path, const std::string& data, std::size_t block_size) {
+  std::ofstream out(path, std::ios::binary);
+  auto put16 = [&out](unsigned v) {
+    out.put(static_cast<char>(v & 0xff));
+    out.put(static_cast<char>((v >> 8) & 0xff));
+  };
+  auto put32 = [&](unsigned long v) {
+    put16(static_cast<unsigned>(v & 0xffff));
+    put16(static_cast<unsigned>(v >> 16));
+  };
+  for (std::size_t start = 0; start <= data.size(); start += block_size) {
+    // the final iteration writes the empty end-of-file block
+    std::string chunk = data.substr(start, block_size);
+    std::vector<unsigned char> compressed(compressBound(static_cast<uLong>(chunk.size())) + 16);
+    z_stream zs{};
+    deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    zs.next_in = reinterpret_cast<Bytef*>(chunk.data());
+    zs.avail_in = static_cast<uInt>(chunk.size());
+    zs.next_out = compressed.data();
+    zs.avail_out = static_cast<uInt>(compressed.size());
+    deflate(&zs, Z_FINISH);
+    compressed.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    const unsigned char header[12] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0};
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out.put('B');
+    out.put('C');
+    put16(2);
+    put16(static_cast<unsigned>(compressed.size() + 25));
+    out.write(reinterpret_cast<const char*>(compressed.data()), static_cast<std::streamsize>(compressed.size()));
+    put32(crc32(0L, reinterpret_cast<const Bytef*>(chunk.data()), static_cast<uInt>(chunk.size())));
+    put32(chunk.size());
+  }
+}
+
+} // namespace
+
 
 TEST_CASE( "FileUtils::fileExists", "[test_file_utils]" ) {
   REQUIRE(FileUtils::fileExists(ARG_NEEDLE_TEST_DIR "/CMakeLists.txt") == true);
@@ -56,4 +108,105 @@ TEST_CASE( "FileUtils::AutoGzIfstream", "[test_file_utils]")
 
     REQUIRE(first_line == "TransitionType");
   }
-}
\ No newline at end of file
+}
+
+TEST_CASE("FileUtils BGZF support", "[test_file_utils]") {
+  const auto path = std::filesystem::temp_directory_path() / "arg_needle_test_file_utils.txt.gz";
+  std::string data;
+  for (int i = 0; i < 500; ++i) {
+    data += "line " + std::to_string(i) + "\n";
+  }
+  write_bgzf(path, data, 100);
+  std::filesystem::remove(FileUtils::lineIndexPath(path));
+
+  REQUIRE(FileUtils::isBgzf(path));
+  REQUIRE(FileUtils::AutoGzIfstream::lineCount(path) == 500);
+
+  SECTION("read with several threads") {
+    FileUtils::AutoGzIfstream in;
+    in.openOrExit(path, std::ios::in, 3);
+    std::string line;
+    int ctr = 0;
+    while (FileUtils::getline(in, line)) {
+      REQUIRE(line == "line " + std::to_string(ctr));
+      ++ctr;
+    }
+    REQUIRE(ctr == 500);
+  }
+
+  SECTION("line index") {
+    FileUtils::LineIndex index = FileUtils::buildLineIndex(path, 2);
+    REQUIRE(index.numLines == 500);
+    REQUIRE(index.blockOffsets.size() == (data.size() + 99) / 100);
+    REQUIRE(FileUtils::AutoGzIfstream::lineCount(path) == 500);
+
+    for (std::size_t target : {0, 1, 12, 13, 250, 499}) {
+      FileUtils::AutoGzIfstream in;
+      in.openOrExit(path);
+      in.seekToLine(target);
+      std::string line;
+      FileUtils::getline(in, line);
+      REQUIRE(line == "line " + std::to_string(target));
+    }
+    std::filesystem::remove(FileUtils::lineIndexPath(path));
+  }
+
+  SECTION("stale line index") {
+    FileUtils::LineIndex index = FileUtils::buildLineIndex(path);
+    REQUIRE(FileUtils::readLineIndex(path, index));
+    // same size, later modification time
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::hours(1));
+    REQUIRE_FALSE(FileUtils::readLineIndex(path, index));
+    std::filesystem::remove(FileUtils::lineIndexPath(path));
+  }
+
+  SECTION("corrupt block") {
+    std::string bytes;
+    {
+      std::ifstream in(path, std::ios::binary);
+      bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    bytes[bytes.size() / 2] = static_cast<char>(bytes[bytes.size() / 2] ^ 0x55);
+    std::ofstream(path, std::ios::binary).write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    FileUtils::AutoGzIfstream in;
+    in.openOrExit(path);
+    std::string line;
+    REQUIRE_THROWS_AS([&] { while (FileUtils::getline(in, line)) {} }(), std::runtime_error);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("FileUtils seeking skips blank lines", "[test_file_utils]") {
+  const auto path = std::filesystem::temp_directory_path() / "arg_needle_test_file_utils_blank.txt.gz";
+  // blank lines, some of whitespace only, also where blocks begin and end
+  std::string data;
+  for (int i = 0; i < 300; ++i) {
+    data += "line " + std::to_string(i) + (i % 7 == 0 ? " \r\n\n" : "\n");
+    if (i % 5 == 0) {
+      data += " \t\n";
+    }
+  }
+  write_bgzf(path, data, 37);
+  std::filesystem::remove(FileUtils::lineIndexPath(path));
+
+  auto line_after_seek = [&path](std::size_t target) {
+    FileUtils::AutoGzIfstream in;
+    in.openOrExit(path);
+    in.seekToLine(target);
+    std::string line;
+    while (FileUtils::getline(in, line) && line.find_first_not_of(" \t\r") == std::string::npos) {
+    }
+    return line.substr(0, line.find_last_not_of(" \r") + 1);
+  };
+  for (bool indexed : {false, true}) {
+    if (indexed) {
+      FileUtils::buildLineIndex(path);
+    }
+    REQUIRE(FileUtils::AutoGzIfstream::recordCount(path) == 300);
+    for (std::size_t target = 0; target < 300; ++target) {
+      REQUIRE(line_after_seek(target) == "line " + std::to_string(target));
+    }
+  }
+  std::filesystem::remove(FileUtils::lineIndexPath(path));
+  std::filesystem::remove(path);
+}
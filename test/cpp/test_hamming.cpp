@@ -0,0 +1,59 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "Hamming.hpp"
+
+TEST_CASE("Hamming distance matches a bit-by-bit count", "[test_hamming]") {
+  std::mt19937_64 rng(42);
+  std::vector<std::uint64_t> a(67);
+  std::vector<std::uint64_t> b(67);
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    a[i] = rng();
+    b[i] = i % 3 == 0 ? a[i] : rng();
+  }
+
+  CHECK(Hamming::is_supported(Hamming::Implementation::portable));
+  CHECK(Hamming::is_supported(Hamming::best_implementation()));
+
+  for (auto implementation :
+       {Hamming::Implementation::portable, Hamming::Implementation::avx2, Hamming::Implementation::avx512}) {
+    if (!Hamming::is_supported(implementation)) {
+      continue;
+    }
+    // Lengths that exercise empty input, vector bodies and scalar or masked tails
+    for (std::size_t n : {0ul, 1ul, 3ul, 4ul, 7ul, 8ul, 9ul, 15ul, 16ul, 33ul, 67ul}) {
+      std::size_t expected = 0;
+      for (std::size_t i = 0; i < n; ++i) {
+        for (unsigned bit = 0; bit < 64; ++bit) {
+          expected += ((a[i] >> bit) & 1ul) != ((b[i] >> bit) & 1ul);
+        }
+      }
+      CHECK(Hamming::distance_with(implementation, a.data(), b.data(), n) == expected);
+      CHECK(Hamming::distance(a.data(), b.data(), n) == expected);
+    }
+    CHECK(Hamming::distance_with(implementation, a.data(), a.data(), a.size()) == 0);
+  }
+}
@@ -0,0 +1,1311 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "HapData.hpp"
+
+namespace {
+
+// Write a small .hap/.samples/.map set of related haplotypes and return its root path
+std::string write_hap_data(std::size_t num_samples, std::size_t num_sites) {
+  const std::string root = (std::filesystem::temp_directory_path() / "arg_needle_test_hap_data").string();
+  std::ofstream samples(root + ".samples");
+  samples << "ID_1 ID_2 missing\n0 0 0\n";
+  for (std::size_t i = 0; i < num_samples; ++i) {
+    samples << "sample_" << i << " sample_" << i << " 0\n";
+  }
+  std::ofstream map(root + ".map");
+  std::ofstream hap(root + ".hap");
+  std::uint64_t state = 42u;
+  auto next_random = [&state]() {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return state >> 33;
+  };
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    map << "1\tSNP_" << site_id << "\t" << 0.001 * static_cast<double>(site_id) << "\t" << 1000 + 10 * site_id << "\n";
+    hap << "1 SNP_" << site_id << " " << 1000 + 10 * site_id << " A G";
+    // haplotypes are noisy copies of four founders
+    const std::uint64_t founders = next_random();
+    for (std::size_t hap_id = 0; hap_id < 2 * num_samples; ++hap_id) {
+      bool allele = (founders >> (hap_id % 4)) & 1u;
+      if (next_random() % 100 == 0) {
+        allele = !allele;
+      }
+      hap << (allele ? " 1" : " 0");
+    }
+    hap << "\n";
+  }
+  return root;
+}
+
+void remove_hap_data(const std::string& root) {
+  for (const char* ext : {".samples", ".map", ".hap"}) {
+    std::filesystem::remove(root + ext);
+  }
+}
+
+// Write haplotypes [begin, end) of data, a whole number of samples, as a .hap/.samples/.map set
+void write_hap_batch(const HapData& data, std::size_t begin, std::size_t end, const std::string& root,
+                     const std::vector<unsigned long>& physical_positions) {
+  std::ofstream samples(root + ".samples");
+  samples << "ID_1 ID_2 missing\n0 0 0\n";
+  for (std::size_t hap_id = begin; hap_id < end; hap_id += 2) {
+    samples << data.sample_names[hap_id] << " " << data.sample_names[hap_id + 1] << " 0\n";
+  }
+  std::ofstream map(root + ".map");
+  std::ofstream hap(root + ".hap");
+  for (std::size_t site_id = 0; site_id < physical_positions.size(); ++site_id) {
+    map << "1\tSNP_" << site_id << "\t" << data.genetic_positions[site_id] << "\t" << physical_positions[site_id]
+        << "\n";
+    hap << "1 SNP_" << site_id << " " << physical_positions[site_id] << " A G";
+    for (std::size_t hap_id = begin; hap_id < end; ++hap_id) {
+      hap << (data.allele(hap_id, site_id) ? " 1" : " 0");
+    }
+    hap << "\n";
+  }
+}
+
+// Rewrite the .hap file of write_hap_data as a VCF, with a few records that are not biallelic
+std::string write_vcf_from_hap(const std::string& root, std::size_t num_samples) {
+  const std::string vcf_path = root + ".vcf";
+  std::ifstream hap(root + ".hap");
+  std::ofstream vcf(vcf_path);
+  vcf << "##fileformat=VCFv4.2\n##contig=<ID=1>\n#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+  for (std::size_t i = 0; i < num_samples; ++i) {
+    vcf << "\tsample_" << i;
+  }
+  vcf << "\n";
+  std::string chr, id, pos, ref, alt;
+  for (std::size_t site_id = 0; hap >> chr >> id >> pos >> ref >> alt; ++site_id) {
+    if (site_id % 50 == 7) {
+      vcf << "1\t" << pos << "\tmulti\tA\tC,T\t.\tPASS\t.\tGT";
+      for (std::size_t i = 0; i < num_samples; ++i) {
+        vcf << "\t2|1";
+      }
+      vcf << "\n";
+    }
+    // exercise a GT field that is not the first FORMAT subfield
+    const bool gt_last = site_id % 3 == 0;
+    vcf << chr << "\t" << pos << "\t" << id << "\t" << ref << "\t" << alt << "\t.\tPASS\t.\t"
+        << (gt_last ? "DP:GT" : "GT");
+    for (std::size_t i = 0; i < num_samples; ++i) {
+      char a, b;
+      hap >> a >> b;
+      vcf << "\t" << (gt_last ? "10:" : "") << a << "|" << b;
+    }
+    vcf << "\n";
+    if (site_id % 50 == 21) {
+      vcf << "1\t" << pos << "\tmono\tA\t.\t.\tPASS\t.\tGT";
+      for (std::size_t i = 0; i < num_samples; ++i) {
+        vcf << "\t0|0";
+      }
+      vcf << "\n";
+    }
+  }
+  return vcf_path;
+}
+
+// get_closest_cousins with refinement at refine_word_size and tolerance 0, by brute force from the
+// unrefined results: failing windows are rescored from the maximal runs of equal finer words over
+// each group of neighbouring failing windows
+std::vector<std::tuple<std::size_t, std::size_t, std::vector<std::pair<std::size_t, double>>>>
+brute_force_refined_cousins(
+    const HapData& data, std::size_t hap_id, unsigned int k, unsigned int refine_word_size, unsigned int min_cousins,
+    double min_score_per_word,
+    std::vector<std::tuple<std::size_t, std::size_t, std::vector<std::pair<std::size_t, double>>>> results) {
+  const std::size_t num_fine = (data.num_sites + refine_word_size - 1) / refine_word_size;
+  // finer words starting in [first_site, last_site]
+  auto first_fine = [&](std::size_t site) {
+    return std::min(num_fine, (site + refine_word_size - 1) / refine_word_size);
+  };
+  auto fails = [&](const auto& window) {
+    double score_sum = 0;
+    for (const auto& cousin : std::get<2>(window)) {
+      score_sum += cousin.second;
+    }
+    const std::size_t num_words = (std::get<1>(window) - std::get<0>(window)) / data.word_size + 1;
+    return std::get<2>(window).size() < min_cousins || score_sum < min_score_per_word * static_cast<double>(num_words);
+  };
+  auto fine_words_equal = [&](std::size_t a, std::size_t b, std::size_t j) {
+    for (std::size_t site = j * refine_word_size; site < std::min<std::size_t>((j + 1) * refine_word_size, data.num_sites);
+         ++site) {
+      if (data.allele(a, site) != data.allele(b, site)) {
+        return false;
+      }
+    }
+    return true;
+  };
+  std::vector<bool> failing;
+  for (const auto& window : results) {
+    failing.push_back(fails(window));
+  }
+  for (std::size_t group_start = 0; group_start < results.size();) {
+    if (!failing[group_start]) {
+      ++group_start;
+      continue;
+    }
+    std::size_t group_end = group_start + 1;
+    while (group_end < results.size() && failing[group_end]) {
+      ++group_end;
+    }
+    // window of each finer word in the group, from the site it starts at
+    const std::size_t first = first_fine(std::get<0>(results[group_start]));
+    const std::size_t last = first_fine(std::get<1>(results[group_end - 1]) + 1);
+    std::vector<std::size_t> window_of(last);
+    for (std::size_t j = first, w = group_start; j < last; ++j) {
+      while (j * refine_word_size > std::get<1>(results[w])) {
+        ++w;
+      }
+      window_of[j] = w;
+    }
+    std::vector<std::vector<std::pair<std::size_t, std::size_t>>> scores(group_end); // (score, haplotype)
+    for (std::size_t v = 0; v < hap_id; ++v) {
+      std::vector<std::size_t> best(group_end, 0);
+      for (std::size_t a = first; a < last;) {
+        if (!fine_words_equal(hap_id, v, a)) {
+          ++a;
+          continue;
+        }
+        std::size_t b = a + 1;
+        while (b < last && fine_words_equal(hap_id, v, b)) {
+          ++b;
+        }
+        for (std::size_t w = window_of[a]; w <= window_of[b - 1]; ++w) {
+          best[w] = std::max(best[w], b - a);
+        }
+        a = b;
+      }
+      for (std::size_t w = group_start; w < group_end; ++w) {
+        if (best[w] > 0) {
+          scores[w].emplace_back(best[w], v);
+        }
+      }
+    }
+    for (std::size_t w = group_start; w < group_end; ++w) {
+      if (first_fine(std::get<0>(results[w])) == first_fine(std::get<1>(results[w]) + 1)) {
+        continue;
+      }
+      std::sort(scores[w].rbegin(), scores[w].rend());
+      scores[w].resize(std::min<std::size_t>(k, scores[w].size()));
+      std::get<2>(results[w]).clear();
+      for (const auto& score : scores[w]) {
+        std::get<2>(results[w]).emplace_back(score.second, static_cast<double>(score.first));
+      }
+    }
+    group_start = group_end;
+  }
+  return results;
+}
+
+} // namespace
+
+TEST_CASE("HapData word matrix layout", "[test_hap_data]") {
+  const std::size_t num_samples = 5;
+  const std::string root = write_hap_data(num_samples, 300);
+  HapData data("array", root, 7);
+  REQUIRE(data.words.cols() == 43);
+  REQUIRE(data.words.stride() == 48);
+
+  std::ifstream hap(root + ".hap");
+  std::string field;
+  for (std::size_t site_id = 0; site_id < data.num_sites; ++site_id) {
+    for (int i = 0; i < 5; ++i) {
+      hap >> field;
+    }
+    for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+      char c;
+      hap >> c;
+      REQUIRE(data.allele(hap_id, site_id) == (c == '1'));
+    }
+  }
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+    const auto* row = data.words.row(hap_id);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(row) % WordMatrix::alignment == 0);
+    for (std::size_t i = data.words.cols(); i < data.words.stride(); ++i) {
+      REQUIRE(row[i] == 0ull);
+    }
+  }
+  remove_hap_data(root);
+}
+
+TEST_CASE("HapData memory usage", "[test_hap_data]") {
+  const std::size_t num_samples = 40;
+  const std::size_t num_sites = 700;
+  const std::string root = write_hap_data(num_samples, num_sites);
+  HapData data("array", root, 16);
+  remove_hap_data(root);
+
+  HapData::MemoryUsage usage = data.memory_usage();
+  REQUIRE(usage.words == data.num_haps * WordMatrix::padded_stride(44) * sizeof(std::uint64_t));
+  REQUIRE(!usage.words_mapped);
+  REQUIRE(usage.posting_lists == 0);
+  REQUIRE(usage.hashed_hap_ids == data.hashed_hap_ids.bucket_count() * sizeof(void*));
+  REQUIRE(usage.positions >= num_sites * (sizeof(unsigned long) + sizeof(double)));
+  REQUIRE(usage.site_mafs >= num_sites * sizeof(float));
+  REQUIRE(usage.sample_names >= data.num_haps * sizeof(std::string));
+  REQUIRE(usage.loader_buffers == 0);
+  REQUIRE(usage.peak() == usage.total());
+
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+    data.add_to_hash(hap_id);
+  }
+  usage = data.memory_usage();
+  REQUIRE(usage.hash_tables > 0);
+  REQUIRE(usage.posting_lists > 0);
+  REQUIRE(usage.hashed_hap_ids >= data.num_haps * sizeof(std::size_t));
+
+  // haplotypes copy four founders, so there are only a few distinct words per column
+  const HapData::MemoryUsage predicted = HapData::predict_memory_usage(data.num_haps, num_sites, 16);
+  REQUIRE(predicted.words == usage.words);
+  REQUIRE(predicted.positions == num_sites * (sizeof(unsigned long) + sizeof(double)));
+  REQUIRE(predicted.hash_tables >= usage.hash_tables);
+  REQUIRE(predicted.loader_buffers > 0);
+  REQUIRE(predicted.peak() < predicted.total());
+  REQUIRE(HapData::predict_memory_usage(data.num_haps, num_sites, 16, 4).loader_buffers >
+          predicted.loader_buffers);
+  REQUIRE_THROWS_AS(HapData::predict_memory_usage(10, 10, 65), std::logic_error);
+}
+
+TEST_CASE("HapData query contexts", "[test_hap_data]") {
+  const std::string root = write_hap_data(20, 500);
+  HapData data("array", root, 8);
+  HapData other("array", root, 16);
+  remove_hap_data(root);
+
+  // one context reused across haplotypes, window sizes and HapData objects gives the same results
+  // as a fresh context per query
+  HapData::QueryContext shared;
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+    for (unsigned int tolerance : {0u, 2u}) {
+      for (double window_size : {0., 0.05, 0.2}) {
+        HapData::QueryContext fresh;
+        REQUIRE(data.get_closest_cousins(shared, hap_id, 3, tolerance, window_size) ==
+                data.get_closest_cousins(fresh, hap_id, 3, tolerance, window_size));
+        REQUIRE(data.get_closest_cousins(hap_id, 3, tolerance, window_size) ==
+                data.get_closest_cousins(fresh, hap_id, 3, tolerance, window_size));
+      }
+    }
+    HapData::QueryContext fresh;
+    REQUIRE(other.get_closest_cousins(shared, hap_id, 3, 1, 0.05) ==
+            other.get_closest_cousins(fresh, hap_id, 3, 1, 0.05));
+    data.add_to_hash(hap_id);
+    other.add_to_hash(hap_id);
+  }
+
+  REQUIRE_THROWS_AS(data.get_closest_cousins(shared, data.num_haps, 3), std::logic_error);
+  REQUIRE_THROWS_AS(data.get_closest_cousins(shared, 1, 3, 0, std::nan("")), std::logic_error);
+}
+
+TEST_CASE("HapData batched queries", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 500);
+  HapData data("array", root, 8);
+  remove_hap_data(root);
+
+  // querying each haplotype just before hashing it, in ID order
+  std::vector<std::vector<std::tuple<std::size_t, std::size_t, std::vector<std::pair<std::size_t, double>>>>>
+      expected;
+  std::vector<std::size_t> hap_ids;
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+    expected.push_back(data.get_closest_cousins(hap_id, 3, 1, 0.05));
+    hap_ids.push_back(hap_id);
+    data.add_to_hash(hap_id);
+  }
+
+  // once everything is hashed, each query still only sees lower IDs, whatever the thread count
+  for (unsigned int num_threads : {0u, 1u, 3u, 64u}) {
+    REQUIRE(data.get_closest_cousins_batch(hap_ids, 3, 1, 0.05, num_threads) == expected);
+  }
+  const std::vector<std::size_t> some_ids = {17, 2, 17, 29};
+  const auto some = data.get_closest_cousins_batch(some_ids, 3, 1, 0.05, 2);
+  REQUIRE(some.size() == some_ids.size());
+  for (std::size_t i = 0; i < some_ids.size(); ++i) {
+    REQUIRE(some[i] == expected[some_ids[i]]);
+  }
+  REQUIRE(data.get_closest_cousins_batch({}, 3, 1, 0.05, 4).empty());
+
+  REQUIRE_THROWS_AS(data.get_closest_cousins_batch({1, data.num_haps}, 3, 0, 0, 2), std::logic_error);
+  REQUIRE_THROWS_AS(data.get_closest_cousins_batch({1, 2}, 3, 0, std::nan(""), 2), std::logic_error);
+}
+
+TEST_CASE("HapData asynchronous calls", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 500);
+  HapData sync("array", root, 8);
+  HapData async("array", root, 8);
+  HapData shared("array", root, 8);
+
+  // hashing i and querying i + 1 in the background gives the same cousins as doing both in turn
+  async.add_to_hash(0);
+  sync.add_to_hash(0);
+  auto next = async.get_closest_cousins_async(1, 3, 1, 0.05);
+  for (std::size_t hap_id = 1; hap_id + 1 < sync.num_haps; ++hap_id) {
+    REQUIRE(next.get() == sync.get_closest_cousins(hap_id, 3, 1, 0.05));
+    sync.add_to_hash(hap_id);
+    async.add_to_hash_async(hap_id);
+    next = async.get_closest_cousins_async(hap_id + 1, 3, 1, 0.05);
+  }
+  REQUIRE(next.get() == sync.get_closest_cousins(sync.num_haps - 1, 3, 1, 0.05));
+
+  // synchronous calls wait for pending ones
+  async.add_to_hash_async(sync.num_haps - 1);
+  async.wait_pending();
+  REQUIRE(async.hashed_hap_ids.size() == async.num_haps);
+
+  // errors are raised by the future, and later calls still run
+  auto failed = async.add_to_hash_async(0);
+  auto after = async.get_closest_cousins_async(2, 3);
+  REQUIRE_THROWS_AS(failed.get(), std::logic_error);
+  REQUIRE(after.get() == async.get_closest_cousins(2, 3));
+
+  // a thread hashing in the background while others query and copy hashed_hap_ids; Catch2
+  // assertions are not thread-safe, so the threads only count failures
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  threads.emplace_back([&]() {
+    for (std::size_t hap_id = 0; hap_id < shared.num_haps; ++hap_id) {
+      shared.add_to_hash_async(hap_id);
+    }
+  });
+  for (int t = 0; t < 3; ++t) {
+    threads.emplace_back([&]() {
+      for (std::size_t i = 0; i < 50; ++i) {
+        const std::size_t hap_id = i % shared.num_haps;
+        if (shared.get_closest_cousins(hap_id, 3, 1, 0.05).empty() ||
+            shared.get_hashed_hap_ids().size() > shared.num_haps) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(failures == 0);
+  REQUIRE(shared.get_hashed_hap_ids().size() == shared.num_haps);
+
+  // many calls whose futures are dropped, then destroying the object with calls still queued
+  {
+    HapData many("array", root, 8);
+    for (std::size_t i = 0; i < 50000; ++i) {
+      many.get_closest_cousins_async(i % many.num_haps, 3, 1, 0.05);
+      if (i < many.num_haps) {
+        many.add_to_hash_async(i);
+      }
+    }
+    REQUIRE(many.get_closest_cousins_async(5, 3, 1, 0.05).get() == async.get_closest_cousins(5, 3, 1, 0.05));
+    for (std::size_t i = 0; i < 20000; ++i) {
+      many.get_closest_cousins_async(i % many.num_haps, 3, 1, 0.05);
+    }
+  }
+  remove_hap_data(root);
+}
+
+TEST_CASE("HapData bulk hashing", "[test_hap_data]") {
+  const std::string root = write_hap_data(40, 1500);
+  for (bool compressed : {false, true}) {
+    for (unsigned int num_threads : {1u, 3u}) {
+      HapData one_by_one("array", root, 8);
+      HapData bulk("array", root, 8);
+      one_by_one.set_compressed_hashes(compressed);
+      bulk.set_compressed_hashes(compressed);
+      for (std::size_t hap_id = 0; hap_id < one_by_one.num_haps; ++hap_id) {
+        one_by_one.add_to_hash(hap_id);
+      }
+      bulk.add_to_hash(0);
+      bulk.add_range_to_hash(1, 1, num_threads);
+      bulk.add_range_to_hash(1, 25, num_threads);
+      bulk.add_range_to_hash(25, bulk.num_haps, num_threads);
+      REQUIRE(bulk.hashed_hap_ids == one_by_one.hashed_hap_ids);
+      for (std::size_t hap_id = 0; hap_id < bulk.num_haps; ++hap_id) {
+        REQUIRE(bulk.get_closest_cousins(hap_id, 4, 2, 0.05) == one_by_one.get_closest_cousins(hap_id, 4, 2, 0.05));
+      }
+    }
+  }
+
+  // bad ranges are rejected before anything is hashed
+  HapData data("array", root, 8);
+  HapData compressed("array", root, 8);
+  remove_hap_data(root);
+  data.add_to_hash(5);
+  REQUIRE_THROWS_AS(data.add_range_to_hash(0, data.num_haps + 1), std::logic_error);
+  REQUIRE_THROWS_AS(data.add_range_to_hash(3, 2), std::logic_error);
+  REQUIRE_THROWS_AS(data.add_range_to_hash(0, 10, 2), std::logic_error);
+  REQUIRE(data.hashed_hap_ids.size() == 1);
+  compressed.set_compressed_hashes(true);
+  compressed.add_to_hash(30);
+  REQUIRE_THROWS_AS(compressed.add_range_to_hash(0, 10), std::logic_error);
+  REQUIRE(compressed.hashed_hap_ids.size() == 1);
+}
+
+TEST_CASE("HapData refinement", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  HapData coarse("array", root, 32);
+  for (unsigned int refine_word_size : {8u, 12u}) {
+    HapData refined("array", root, 32);
+    HapData bulk("array", root, 32);
+    refined.add_refinement(refine_word_size);
+    bulk.add_refinement(refine_word_size);
+    bulk.add_range_to_hash(0, bulk.num_haps, 3);
+    REQUIRE(refined.refinement_word_sizes() == std::vector<unsigned int>{refine_word_size});
+    for (std::size_t hap_id = 0; hap_id < refined.num_haps; ++hap_id) {
+      refined.add_to_hash(hap_id);
+      if (refine_word_size == 8) {
+        coarse.add_to_hash(hap_id);
+      }
+    }
+    const auto unrefined_memory = coarse.memory_usage();
+    const auto refined_memory = refined.memory_usage();
+    REQUIRE(refined_memory.words == unrefined_memory.words);
+    REQUIRE(refined_memory.hash_tables > unrefined_memory.hash_tables);
+
+    std::size_t num_refined = 0;
+    std::size_t num_kept = 0;
+    for (std::size_t hap_id = 1; hap_id < refined.num_haps; hap_id += 7) {
+      for (double window_size : {0., 0.2}) {
+        const auto unrefined = coarse.get_closest_cousins(hap_id, 3, 0, window_size);
+        // without thresholds, nothing is refined
+        REQUIRE(refined.get_closest_cousins(hap_id, 3, 0, window_size) == unrefined);
+        for (auto thresholds : {std::make_pair(4u, 0.), std::make_pair(0u, 2.5)}) {
+          const auto expected = brute_force_refined_cousins(coarse, hap_id, 3, refine_word_size, thresholds.first,
+                                                            thresholds.second, unrefined);
+          REQUIRE(refined.get_closest_cousins(hap_id, 3, 0, window_size, thresholds.first, thresholds.second) ==
+                  expected);
+          REQUIRE(bulk.get_closest_cousins(hap_id, 3, 0, window_size, thresholds.first, thresholds.second) ==
+                  expected);
+          for (std::size_t w = 0; w < expected.size(); ++w) {
+            (expected[w] == unrefined[w] ? num_kept : num_refined) += 1;
+          }
+        }
+      }
+    }
+    REQUIRE(num_refined > 0);
+    REQUIRE(num_kept > 0);
+  }
+
+  // refinements go from coarse to fine, before anything is hashed
+  HapData data("array", root, 32);
+  remove_hap_data(root);
+  REQUIRE_THROWS_AS(data.add_refinement(32), std::logic_error);
+  REQUIRE_THROWS_AS(data.add_refinement(0), std::logic_error);
+  data.add_refinement(16);
+  data.add_refinement(4);
+  REQUIRE_THROWS_AS(data.add_refinement(8), std::logic_error);
+  data.add_range_to_hash(0, data.num_haps, 2);
+  REQUIRE_THROWS_AS(data.add_refinement(2), std::logic_error);
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+    for (const auto& window : data.get_closest_cousins(hap_id, 3, 1, 0.2, 4)) {
+      REQUIRE(std::get<2>(window).size() <= 3);
+    }
+  }
+}
+
+TEST_CASE("HapData re-ranking", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  HapData data("array", root, 16);
+  remove_hap_data(root);
+  data.add_range_to_hash(0, data.num_haps);
+  REQUIRE(data.rerank_pool() == 0);
+
+  for (unsigned int k : {3u, 20u}) {
+    for (unsigned int pool_size : {0u, 8u, 1000u}) {
+      for (std::size_t hap_id = 1; hap_id < data.num_haps; hap_id += 5) {
+        for (double window_size : {0., 0.2}) {
+          data.set_rerank_pool(0);
+          const auto cousins = data.get_closest_cousins(hap_id, k, 0, window_size);
+          const auto pool = data.get_closest_cousins(hap_id, std::max(k, pool_size), 0, window_size);
+          data.set_rerank_pool(pool_size);
+          const auto reranked = data.get_closest_cousins(hap_id, k, 0, window_size);
+          if (pool_size == 0) {
+            REQUIRE(reranked == cousins);
+            continue;
+          }
+          REQUIRE(reranked.size() == cousins.size());
+          for (std::size_t w = 0; w < cousins.size(); ++w) {
+            const std::size_t start = std::get<0>(cousins[w]);
+            const std::size_t end = std::get<1>(cousins[w]);
+            // (distance, -score, -haplotype) of every candidate, from the best-scoring ones or,
+            // if there are fewer than k of those, also from the best-scoring ones of the
+            // neighbouring windows and the haplotypes just below the query
+            std::vector<std::tuple<std::size_t, double, long>> expected;
+            std::vector<std::size_t> seen;
+            auto add = [&](std::size_t other_id, double score) {
+              if (std::find(seen.begin(), seen.end(), other_id) != seen.end()) {
+                return;
+              }
+              seen.push_back(other_id);
+              std::size_t distance = 0;
+              for (std::size_t site = start; site <= end; ++site) {
+                distance += data.allele(hap_id, site) != data.allele(other_id, site);
+              }
+              expected.emplace_back(distance, -score, -static_cast<long>(other_id));
+            };
+            for (const auto& cousin : std::get<2>(pool[w])) {
+              add(cousin.first, cousin.second);
+            }
+            if (expected.size() < k) {
+              for (std::size_t neighbour : {w - 1, w + 1}) {
+                if (neighbour < pool.size()) {
+                  for (const auto& cousin : std::get<2>(pool[neighbour])) {
+                    add(cousin.first, 0);
+                  }
+                }
+              }
+              const std::size_t fill_size = std::max(k, pool_size);
+              for (std::size_t other_id = hap_id > fill_size ? hap_id - fill_size : 0; other_id < hap_id; ++other_id) {
+                add(other_id, 0);
+              }
+            }
+            std::sort(expected.begin(), expected.end());
+            expected.resize(std::min<std::size_t>(k, expected.size()));
+
+            REQUIRE(std::get<0>(reranked[w]) == start);
+            REQUIRE(std::get<1>(reranked[w]) == end);
+            const auto& nearest = std::get<2>(reranked[w]);
+            REQUIRE(nearest.size() == std::min<std::size_t>(k, hap_id));
+            REQUIRE(nearest.size() == expected.size());
+            for (std::size_t i = 0; i < nearest.size(); ++i) {
+              REQUIRE(nearest[i].first == static_cast<std::size_t>(-std::get<2>(expected[i])));
+              REQUIRE(nearest[i].second == -std::get<1>(expected[i]));
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // batched and asynchronous queries re-rank too
+  data.set_rerank_pool(8);
+  const auto batch = data.get_closest_cousins_batch({29, 59}, 3, 0, 0.2, 2);
+  REQUIRE(batch[0] == data.get_closest_cousins(29, 3, 0, 0.2));
+  REQUIRE(batch[1] == data.get_closest_cousins_async(59, 3, 0, 0.2).get());
+}
+
+TEST_CASE("HapData PBWT engine", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  HapData data("array", root, 16);
+  HapData bulk("array", root, 16, "", true, 1, 0, 0, "pbwt");
+  REQUIRE_THROWS_AS(HapData("array", root, 16, "", true, 1, 0, 0, "suffix_tree"), std::logic_error);
+  remove_hap_data(root);
+  REQUIRE(data.match_engine() == "hash");
+  REQUIRE(bulk.match_engine() == "pbwt");
+  REQUIRE_THROWS_AS(data.set_match_engine("suffix_tree"), std::logic_error);
+  data.set_match_engine("pbwt");
+  REQUIRE(data.match_engine() == "pbwt");
+  REQUIRE_THROWS_AS(data.add_refinement(8), std::logic_error);
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; hap_id += 2) {
+    data.add_to_hash(hap_id);
+  }
+  for (std::size_t hap_id = 1; hap_id < data.num_haps; hap_id += 2) {
+    data.add_to_hash(hap_id);
+  }
+  bulk.add_range_to_hash(0, bulk.num_haps, 2);
+  REQUIRE_THROWS_AS(data.set_match_engine("hash"), std::logic_error);
+  REQUIRE_THROWS_AS(data.add_to_hash(3), std::logic_error);
+  REQUIRE(data.hashed_hap_ids.size() == data.num_haps);
+  REQUIRE(data.memory_usage().pbwt >= 24 * data.num_haps * data.num_sites);
+  REQUIRE(data.memory_usage().hash_tables == 0);
+
+  for (std::size_t hap_id = 1; hap_id < data.num_haps; hap_id += 4) {
+    for (double window_size : {0., 0.2}) {
+      const auto results = data.get_closest_cousins(hap_id, 3, 1, window_size);
+      REQUIRE(bulk.get_closest_cousins(hap_id, 3, 1, window_size) == results);
+      for (const auto& window : results) {
+        // the longest exact match of each earlier haplotype that overlaps the window, in sites
+        std::vector<double> longest_matches(hap_id, 0);
+        for (std::size_t other_id = 0; other_id < hap_id; ++other_id) {
+          std::size_t longest = 0;
+          for (std::size_t start = 0; start < data.num_sites;) {
+            std::size_t end = start;
+            while (end < data.num_sites && data.allele(hap_id, end) == data.allele(other_id, end)) {
+              ++end;
+            }
+            if (end > start && start <= std::get<1>(window) && end > std::get<0>(window)) {
+              longest = std::max(longest, end - start);
+            }
+            start = end + 1;
+          }
+          longest_matches[other_id] = static_cast<double>(longest);
+        }
+        // the cousins are scored exactly and are as close as any others, though ties between
+        // equally long matches may be broken differently than by ID
+        std::vector<double> expected;
+        for (double longest : longest_matches) {
+          if (longest > 0) {
+            expected.push_back(longest);
+          }
+        }
+        std::sort(expected.rbegin(), expected.rend());
+        expected.resize(std::min<std::size_t>(3, expected.size()));
+        const auto& cousins = std::get<2>(window);
+        REQUIRE(cousins.size() == expected.size());
+        for (std::size_t i = 0; i < cousins.size(); ++i) {
+          REQUIRE(cousins[i].second == longest_matches[cousins[i].first]);
+          REQUIRE(cousins[i].second == expected[i]);
+        }
+      }
+    }
+  }
+
+  // batches and re-ranking work the same way
+  const auto batch = data.get_closest_cousins_batch({29, 59}, 3, 0, 0.2, 2);
+  REQUIRE(batch[0] == data.get_closest_cousins(29, 3, 0, 0.2));
+  REQUIRE(batch[1] == data.get_closest_cousins(59, 3, 0, 0.2));
+  data.set_rerank_pool(8);
+  for (const auto& window : data.get_closest_cousins(59, 3, 0, 0.2)) {
+    REQUIRE(std::get<2>(window).size() == 3);
+  }
+}
+
+TEST_CASE("HapData LSH engine", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  HapData data("array", root, 16);
+  HapData bulk("array", root, 16);
+  remove_hap_data(root);
+  REQUIRE_THROWS_AS(data.set_lsh_parameters(0), std::logic_error);
+  REQUIRE_THROWS_AS(data.set_lsh_parameters(2, 17), std::logic_error);
+
+  // a single table keyed on whole words counts the matching words of each window
+  for (HapData* d : {&data, &bulk}) {
+    d->set_lsh_parameters(1, 16);
+    d->set_match_engine("lsh");
+  }
+  REQUIRE(data.match_engine() == "lsh");
+  REQUIRE(data.lsh_num_tables() == 1);
+  REQUIRE_THROWS_AS(data.add_refinement(8), std::logic_error);
+  for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+    data.add_to_hash(hap_id);
+  }
+  bulk.add_range_to_hash(0, bulk.num_haps, 2);
+  REQUIRE_THROWS_AS(data.set_lsh_parameters(2), std::logic_error);
+  REQUIRE(data.memory_usage().hash_tables > 0);
+
+  for (std::size_t hap_id = 1; hap_id < data.num_haps; hap_id += 4) {
+    const auto results = data.get_closest_cousins(hap_id, 3, 1, 0.1);
+    REQUIRE(bulk.get_closest_cousins(hap_id, 3, 1, 0.1) == results);
+    for (const auto& window : results) {
+      std::vector<std::pair<std::size_t, double>> expected;
+      for (std::size_t other_id = hap_id; other_id-- > 0;) {
+        double matching_words = 0;
+        for (std::size_t i = std::get<0>(window) / 16; i <= std::get<1>(window) / 16; ++i) {
+          matching_words += data.words(hap_id, i) == data.words(other_id, i);
+        }
+        if (matching_words > 0) {
+          expected.push_back({other_id, matching_words});
+        }
+      }
+      std::stable_sort(expected.begin(), expected.end(),
+                       [](const auto& a, const auto& b) { return a.second > b.second; });
+      expected.resize(std::min<std::size_t>(3, expected.size()));
+      REQUIRE(std::get<2>(window) == expected);
+    }
+  }
+
+  // haplotype 1 copies haplotype 0 except at one site of every word, which the hash engine
+  // cannot see through but keys on half of each word's sites often avoid
+  const std::size_t num_sites = 256;
+  std::vector<std::uint8_t> genotypes(2 * num_sites);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    genotypes[2 * site_id] = (site_id * 7 + site_id / 5) % 3 == 0;
+    genotypes[2 * site_id + 1] = genotypes[2 * site_id] ^ (site_id % 16 == (site_id / 16) % 16);
+  }
+  GenotypeView view;
+  view.data = genotypes.data();
+  view.num_sites = num_sites;
+  view.num_haps = 2;
+  view.site_stride = 2;
+  std::vector<double> genetic_positions(num_sites);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    genetic_positions[site_id] = 0.01 * static_cast<double>(site_id);
+  }
+  HapData hashed("array", view, std::vector<unsigned long>(num_sites, 1ul), genetic_positions, 16);
+  hashed.add_to_hash(0);
+  for (const auto& window : hashed.get_closest_cousins(1, 1, 0, 0.5)) {
+    REQUIRE(std::get<2>(window).empty());
+  }
+  std::vector<std::vector<std::tuple<std::size_t, std::size_t, std::vector<std::pair<std::size_t, double>>>>> runs;
+  for (uint64_t seed : {7u, 7u, 8u}) {
+    HapData lsh("array", view, std::vector<unsigned long>(num_sites, 1ul), genetic_positions, 16);
+    lsh.set_lsh_parameters(8, 8, seed);
+    lsh.set_match_engine("lsh");
+    lsh.add_to_hash(0);
+    runs.push_back(lsh.get_closest_cousins(1, 1, 0, 0.5));
+    for (const auto& window : runs.back()) {
+      REQUIRE(std::get<2>(window).size() == 1);
+      REQUIRE(std::get<2>(window)[0].first == 0);
+    }
+  }
+  REQUIRE(runs[0] == runs[1]);
+  REQUIRE(runs[0] != runs[2]);
+}
+
+TEST_CASE("HapData MAF site selection", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  HapData data("array", root, 16);
+  HapData all_sites("array", root, 16);
+  remove_hap_data(root);
+  REQUIRE_THROWS_AS(data.set_min_maf(0.6), std::logic_error);
+  REQUIRE_THROWS_AS(data.set_min_maf(-0.1), std::logic_error);
+  // a context with layouts made from all sites
+  HapData::QueryContext warmed;
+  for (double window_size : {0., 0.1}) {
+    data.get_closest_cousins(warmed, 0, 4, 1, window_size);
+  }
+  data.set_min_maf(0.3);
+  REQUIRE(data.min_maf() == 0.3);
+
+  // the same haplotypes restricted to the common sites
+  std::vector<std::size_t> kept;
+  for (std::size_t site_id = 0; site_id < data.num_sites; ++site_id) {
+    if (data.site_mafs[site_id] >= 0.3f) {
+      kept.push_back(site_id);
+    }
+  }
+  REQUIRE(data.num_hashed_sites() == kept.size());
+  REQUIRE(kept.size() > 100);
+  REQUIRE(kept.size() < data.num_sites / 2);
+  std::vector<std::uint8_t> genotypes(kept.size() * data.num_haps);
+  std::vector<unsigned long> physical_positions;
+  std::vector<double> genetic_positions;
+  for (std::size_t i = 0; i < kept.size(); ++i) {
+    for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+      genotypes[i * data.num_haps + hap_id] = data.allele(hap_id, kept[i]);
+    }
+    physical_positions.push_back(data.physical_positions[kept[i]]);
+    genetic_positions.push_back(data.genetic_positions[kept[i]]);
+  }
+  GenotypeView view;
+  view.data = genotypes.data();
+  view.num_sites = kept.size();
+  view.num_haps = data.num_haps;
+  view.site_stride = static_cast<std::ptrdiff_t>(data.num_haps);
+  HapData common("array", view, physical_positions, genetic_positions, 16);
+
+  data.add_range_to_hash(0, data.num_haps);
+  common.add_range_to_hash(0, common.num_haps);
+  all_sites.add_range_to_hash(0, all_sites.num_haps);
+  REQUIRE_THROWS_AS(data.set_min_maf(0.1), std::logic_error);
+  REQUIRE(data.memory_usage().hash_tables < all_sites.memory_usage().hash_tables);
+
+  for (std::size_t hap_id = 1; hap_id < data.num_haps; hap_id += 6) {
+    for (double window_size : {0., 0.1}) {
+      const auto results = data.get_closest_cousins(hap_id, 4, 1, window_size);
+      const auto expected = common.get_closest_cousins(hap_id, 4, 1, window_size);
+      REQUIRE(results.size() == expected.size());
+      REQUIRE(data.get_closest_cousins(warmed, hap_id, 4, 1, window_size) == results);
+      // windows cover all sites, each starting at its first hashed site or where the last ended
+      for (std::size_t i = 0; i < results.size(); ++i) {
+        REQUIRE(std::get<2>(results[i]) == std::get<2>(expected[i]));
+        REQUIRE(std::get<0>(results[i]) == (i == 0 ? 0 : kept[std::get<0>(expected[i])]));
+        REQUIRE(std::get<1>(results[i]) ==
+                (i + 1 < results.size() ? std::get<0>(results[i + 1]) - 1 : data.num_sites - 1));
+        REQUIRE(kept[std::get<1>(expected[i])] <= std::get<1>(results[i]));
+      }
+    }
+  }
+
+  // refinements and other engines work on the hashed sites alone
+  std::vector<std::uint8_t> all_genotypes(data.num_sites * data.num_haps);
+  for (std::size_t site_id = 0; site_id < data.num_sites; ++site_id) {
+    for (std::size_t hap_id = 0; hap_id < data.num_haps; ++hap_id) {
+      all_genotypes[site_id * data.num_haps + hap_id] = data.allele(hap_id, site_id);
+    }
+  }
+  GenotypeView all_view = view;
+  all_view.data = all_genotypes.data();
+  all_view.num_sites = data.num_sites;
+  for (const std::string engine : {"hash", "pbwt", "lsh"}) {
+    HapData selected("array", all_view, data.physical_positions, data.genetic_positions, 16);
+    HapData reference("array", view, physical_positions, genetic_positions, 16);
+    for (HapData* d : {&selected, &reference}) {
+      d->set_match_engine(engine);
+      if (engine == "hash") {
+        d->add_refinement(8);
+      }
+    }
+    selected.set_min_maf(0.3);
+    selected.add_range_to_hash(0, selected.num_haps);
+    reference.add_range_to_hash(0, reference.num_haps);
+    for (std::size_t hap_id = 2; hap_id < data.num_haps; hap_id += 9) {
+      const auto results = selected.get_closest_cousins(hap_id, 3, 0, 0.1, 3, 4.);
+      const auto expected = reference.get_closest_cousins(hap_id, 3, 0, 0.1, 3, 4.);
+      REQUIRE(results.size() == expected.size());
+      for (std::size_t i = 0; i < results.size(); ++i) {
+        REQUIRE(std::get<2>(results[i]) == std::get<2>(expected[i]));
+      }
+    }
+  }
+
+  // a threshold every site passes hashes all of them
+  HapData lowest("array", view, physical_positions, genetic_positions, 16);
+  lowest.set_min_maf(0.25);
+  REQUIRE(lowest.num_hashed_sites() == lowest.num_sites);
+  REQUIRE(lowest.memory_usage().words == common.memory_usage().words);
+  lowest.set_min_maf(0.45);
+  REQUIRE(lowest.num_hashed_sites() < lowest.num_sites);
+  lowest.set_min_maf(0);
+  REQUIRE(lowest.num_hashed_sites() == lowest.num_sites);
+}
+
+TEST_CASE("HapData hash index snapshots", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  const std::string snapshot = root + ".index";
+  HapData source("array", root, 16);
+  remove_hap_data(root);
+  const std::size_t num_sites = source.num_sites;
+  const std::size_t num_haps = source.num_haps;
+  std::vector<std::uint8_t> genotypes(num_sites * num_haps);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      genotypes[site_id * num_haps + hap_id] = source.allele(hap_id, site_id);
+    }
+  }
+  GenotypeView view;
+  view.data = genotypes.data();
+  view.num_sites = num_sites;
+  view.num_haps = num_haps;
+  view.site_stride = static_cast<std::ptrdiff_t>(num_haps);
+  auto make = [&]() { return HapData("array", view, source.physical_positions, source.genetic_positions, 16); };
+
+  // each engine and configuration, saved after hashing the first half of the haplotypes
+  const std::vector<std::string> engines = {"hash", "compressed", "refined", "maf", "lsh", "pbwt"};
+  for (const std::string& name : engines) {
+    auto configure = [&](HapData& d) {
+      if (name == "compressed") {
+        d.set_compressed_hashes(true);
+      }
+      if (name == "refined") {
+        d.add_refinement(8);
+      }
+      if (name == "maf") {
+        d.set_min_maf(0.3);
+      }
+      if (name == "lsh" || name == "pbwt") {
+        d.set_match_engine(name);
+      }
+    };
+    HapData saved = make();
+    configure(saved);
+    REQUIRE_THROWS_AS(saved.save_hash_index(snapshot), std::logic_error);
+    saved.add_range_to_hash(0, num_haps / 2);
+    saved.save_hash_index(snapshot);
+
+    HapData loaded = make();
+    configure(loaded);
+    loaded.load_hash_index(snapshot);
+    REQUIRE(loaded.hashed_hap_ids == saved.hashed_hap_ids);
+    REQUIRE(loaded.num_hashed_sites() == saved.num_hashed_sites());
+    REQUIRE_THROWS_AS(loaded.load_hash_index(snapshot), std::logic_error);
+    for (std::size_t hap_id = num_haps / 2; hap_id < num_haps; ++hap_id) {
+      REQUIRE(loaded.get_closest_cousins(hap_id, 3, 1, 0.1, 2, 2.) ==
+              saved.get_closest_cousins(hap_id, 3, 1, 0.1, 2, 2.));
+      saved.add_to_hash(hap_id);
+      loaded.add_to_hash(hap_id);
+    }
+  }
+
+  // configurations and data that do not match the snapshot
+  HapData other_engine = make();
+  other_engine.set_match_engine("lsh");
+  REQUIRE_THROWS_AS(other_engine.load_hash_index(snapshot), std::logic_error);
+  HapData other_word_size("array", view, source.physical_positions, source.genetic_positions, 8);
+  other_word_size.set_match_engine("pbwt");
+  REQUIRE_THROWS_AS(other_word_size.load_hash_index(snapshot), std::logic_error);
+
+  HapData saved = make();
+  saved.add_range_to_hash(0, 10);
+  saved.save_hash_index(snapshot);
+  genotypes[5 * num_haps + 20] ^= 1; // not hashed
+  make().load_hash_index(snapshot);
+  genotypes[5 * num_haps + 3] ^= 1;
+  REQUIRE_THROWS_AS(make().load_hash_index(snapshot), std::logic_error);
+  genotypes[5 * num_haps + 3] ^= 1;
+  std::vector<unsigned long> moved_positions = source.physical_positions;
+  moved_positions[7] += 1;
+  REQUIRE_THROWS_AS(
+      HapData("array", view, moved_positions, source.genetic_positions, 16).load_hash_index(snapshot),
+      std::logic_error);
+
+  // haplotypes added to the data since the snapshot
+  GenotypeView fewer = view;
+  fewer.num_haps = 20;
+  HapData smaller("array", fewer, source.physical_positions, source.genetic_positions, 16);
+  smaller.add_range_to_hash(0, 10);
+  smaller.save_hash_index(snapshot);
+  HapData larger = make();
+  // haplotypes 0 to 9 were hashed, so only a limit above 9 lets them in
+  REQUIRE_THROWS_AS(larger.load_hash_index(snapshot, 9), std::logic_error);
+  REQUIRE(larger.hashed_hap_ids.empty());
+  larger.load_hash_index(snapshot, 10);
+  REQUIRE(larger.hashed_hap_ids.size() == 10);
+  larger.add_range_to_hash(10, num_haps);
+
+  // corrupt and truncated snapshots are caught by the payload checksum
+  const auto snapshot_size = std::filesystem::file_size(snapshot);
+  {
+    std::fstream file(snapshot, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(static_cast<std::streamoff>(snapshot_size / 2));
+    const auto byte = static_cast<char>(file.get() ^ 0xff);
+    file.seekp(static_cast<std::streamoff>(snapshot_size / 2));
+    file.put(byte);
+  }
+  REQUIRE_THROWS_AS(make().load_hash_index(snapshot), std::logic_error);
+  std::filesystem::resize_file(snapshot, snapshot_size - 8);
+  REQUIRE_THROWS_AS(make().load_hash_index(snapshot), std::logic_error);
+  std::filesystem::remove(snapshot);
+  REQUIRE_THROWS(make().load_hash_index(snapshot));
+}
+
+TEST_CASE("HapData mismatch tolerance", "[test_hap_data]") {
+  // with one site per word, haplotype 1 matches haplotype 0 except at sites 3 and 7
+  const std::size_t num_sites = 12;
+  std::vector<std::uint8_t> genotypes(2 * num_sites);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    genotypes[2 * site_id] = site_id % 2;
+    genotypes[2 * site_id + 1] = (site_id % 2) ^ (site_id == 3 || site_id == 7);
+  }
+  GenotypeView view;
+  view.data = genotypes.data();
+  view.num_sites = num_sites;
+  view.num_haps = 2;
+  view.site_stride = 2;
+  std::vector<double> genetic_positions(num_sites);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    genetic_positions[site_id] = 0.1 * static_cast<double>(site_id);
+  }
+  HapData data("array", view, std::vector<unsigned long>(num_sites, 1ul), genetic_positions, 1);
+  data.add_to_hash(0);
+
+  // the best range through each word, allowing up to `tolerance` mismatching words
+  const std::vector<std::vector<double>> expected = {
+      {3, 3, 3, 0, 3, 3, 3, 0, 4, 4, 4, 4},
+      {7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8},
+      {12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12},
+  };
+  for (unsigned int tolerance = 0; tolerance < 3; ++tolerance) {
+    const auto results = data.get_closest_cousins(1, 1, tolerance);
+    REQUIRE(results.size() == num_sites);
+    for (std::size_t word_id = 0; word_id < num_sites; ++word_id) {
+      const auto& cousins = std::get<2>(results[word_id]);
+      if (expected[tolerance][word_id] == 0) {
+        REQUIRE(cousins.empty());
+      }
+      else {
+        REQUIRE(cousins.size() == 1);
+        REQUIRE(cousins[0].first == 0);
+        REQUIRE(cousins[0].second == expected[tolerance][word_id]);
+      }
+    }
+  }
+}
+
+TEST_CASE("HapData top k order", "[test_hap_data]") {
+  // haplotypes 0-5 are identical, except that haplotype 1 differs at the last site
+  const std::size_t num_sites = 40;
+  const std::size_t num_haps = 6;
+  std::vector<std::uint8_t> genotypes(num_haps * num_sites);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      genotypes[site_id * num_haps + hap_id] = (site_id % 3 == 0) ^ (hap_id == 1 && site_id == num_sites - 1);
+    }
+  }
+  GenotypeView view;
+  view.data = genotypes.data();
+  view.num_sites = num_sites;
+  view.num_haps = num_haps;
+  view.site_stride = num_haps;
+  HapData data("array", view, std::vector<unsigned long>(num_sites, 1ul), std::vector<double>(num_sites, 0.), 8);
+  for (std::size_t hap_id = 0; hap_id < 5; ++hap_id) {
+    data.add_to_hash(hap_id);
+  }
+
+  // each haplotype scores its whole matching range in every window: 5 words, or 4 for haplotype
+  // 1, which does not match the last word at all. Ties are broken by higher haplotype ID.
+  for (unsigned int k : {0u, 3u, 10u}) {
+    const auto results = data.get_closest_cousins(5, k);
+    REQUIRE(results.size() == 5);
+    for (std::size_t word_id = 0; word_id < 5; ++word_id) {
+      std::vector<std::pair<std::size_t, double>> expected = {{4, 5.}, {3, 5.}, {2, 5.}, {0, 5.}, {1, 4.}};
+      if (word_id == 4) {
+        expected.pop_back();
+      }
+      expected.resize(std::min<std::size_t>(k, expected.size()));
+      REQUIRE(std::get<2>(results[word_id]) == expected);
+    }
+  }
+}
+
+TEST_CASE("HapData VCF input", "[test_hap_data]") {
+  const std::string root = write_hap_data(20, 300);
+  const std::string vcf_path = write_vcf_from_hap(root, 20);
+
+  HapData from_hap("array", root, 16);
+  HapData from_vcf("array", vcf_path, 16, root + ".map", true, 3);
+  REQUIRE(from_vcf.num_haps == from_hap.num_haps);
+  REQUIRE(from_vcf.num_sites == from_hap.num_sites);
+  REQUIRE(from_vcf.sample_names == from_hap.sample_names);
+  REQUIRE(from_vcf.physical_positions == from_hap.physical_positions);
+  REQUIRE(from_vcf.genetic_positions == from_hap.genetic_positions);
+  REQUIRE(from_vcf.site_mafs == from_hap.site_mafs);
+  REQUIRE(from_vcf.words.cols() == from_hap.words.cols());
+  for (std::size_t hap_id = 0; hap_id < from_hap.num_haps; ++hap_id) {
+    for (std::size_t i = 0; i < from_hap.words.cols(); ++i) {
+      REQUIRE(from_vcf.words(hap_id, i) == from_hap.words(hap_id, i));
+    }
+  }
+
+  REQUIRE_THROWS(HapData("array", vcf_path, 16));
+  std::filesystem::remove(vcf_path);
+  remove_hap_data(root);
+}
+
+TEST_CASE("HapData from an in-memory genotype matrix", "[test_hap_data]") {
+  const std::size_t num_samples = 37;
+  const std::size_t num_haps = 2 * num_samples;
+  const std::string root = write_hap_data(num_samples, 300);
+  HapData from_file("array", root, 16);
+
+  // sites x haplotypes bytes, a haplotypes x sites transposed copy, and a bit-packed copy
+  const std::size_t num_sites = from_file.num_sites;
+  const std::size_t packed_cols = (num_haps + 7) / 8;
+  std::vector<std::uint8_t> genotypes(num_sites * num_haps);
+  std::vector<std::uint8_t> transposed(num_sites * num_haps);
+  std::vector<std::uint8_t> packed(num_sites * packed_cols, 0);
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      const std::uint8_t allele = (from_file.words(hap_id, site_id / 16) >> (site_id % 16)) & 1u;
+      genotypes[site_id * num_haps + hap_id] = allele;
+      transposed[hap_id * num_sites + site_id] = allele;
+      packed[site_id * packed_cols + hap_id / 8] |= static_cast<std::uint8_t>(allele << (7 - hap_id % 8));
+    }
+  }
+
+  GenotypeView views[3];
+  views[0] = {genotypes.data(), num_sites, num_haps, static_cast<std::ptrdiff_t>(num_haps), 1, false};
+  views[1] = {transposed.data(), num_sites, num_haps, 1, static_cast<std::ptrdiff_t>(num_sites), false};
+  views[2] = {packed.data(), num_sites, num_haps, static_cast<std::ptrdiff_t>(packed_cols), 1, true};
+  for (const GenotypeView& view : views) {
+    HapData data("array", view, from_file.physical_positions, from_file.genetic_positions, 16);
+    REQUIRE(data.num_haps == from_file.num_haps);
+    REQUIRE(data.num_sites == from_file.num_sites);
+    REQUIRE(data.sample_names == from_file.sample_names);
+    REQUIRE(data.site_mafs == from_file.site_mafs);
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      for (std::size_t i = 0; i < from_file.words.cols(); ++i) {
+        REQUIRE(data.words(hap_id, i) == from_file.words(hap_id, i));
+      }
+    }
+  }
+
+  REQUIRE_THROWS(HapData("array", views[0], from_file.physical_positions, {}, 16));
+  remove_hap_data(root);
+}
+
+TEST_CASE("HapData binary cache", "[test_hap_data]") {
+  const std::string root = write_hap_data(20, 300);
+  const std::string cache = root + ".bin";
+
+  HapData text("array", root, 16);
+  text.save(cache);
+  REQUIRE(HapData::is_cache_file(cache));
+  REQUIRE_FALSE(HapData::is_cache_file(root + ".hap"));
+  // site counts without loading, from the cache header or the .hap file
+  REQUIRE(HapData::count_sites(cache) == text.num_sites);
+  REQUIRE(HapData::count_sites(root) == text.num_sites);
+  REQUIRE_THROWS(HapData::count_sites(root + "_missing"));
+
+  HapData cached("array", cache, 16);
+  REQUIRE(cached.words.is_view());
+  REQUIRE(cached.num_haps == text.num_haps);
+  REQUIRE(cached.num_sites == text.num_sites);
+  REQUIRE(cached.sample_names == text.sample_names);
+  REQUIRE(cached.physical_positions == text.physical_positions);
+  REQUIRE(cached.genetic_positions == text.genetic_positions);
+  REQUIRE(cached.site_mafs == text.site_mafs);
+  REQUIRE(cached.words.stride() == text.words.stride());
+  for (std::size_t hap_id = 0; hap_id < text.num_haps; ++hap_id) {
+    for (std::size_t i = 0; i < text.words.cols(); ++i) {
+      REQUIRE(cached.words(hap_id, i) == text.words(hap_id, i));
+    }
+  }
+
+  for (std::size_t hap_id = 0; hap_id < 10; ++hap_id) {
+    text.add_to_hash(hap_id);
+    cached.add_to_hash(hap_id);
+  }
+  REQUIRE(cached.get_closest_cousins(10, 4, 1, 0.05) == text.get_closest_cousins(10, 4, 1, 0.05));
+
+  REQUIRE_THROWS(HapData("array", cache, 64));
+
+  // a cache is current only for the files it was written from, as they were
+  REQUIRE(HapData::is_cache_current(cache, root));
+  REQUIRE_FALSE(HapData::is_cache_current(cache, root + "_other"));
+  REQUIRE_FALSE(HapData::is_cache_current(root + ".hap", root));
+  HapData("array", root, 16, "", true, 1, 10, 200).save(cache);
+  REQUIRE_FALSE(HapData::is_cache_current(cache, root));
+  text.save(cache);
+  REQUIRE(HapData::is_cache_current(cache, root));
+  const auto hap_path = std::filesystem::path(root + ".hap");
+  std::filesystem::last_write_time(hap_path, std::filesystem::last_write_time(hap_path) + std::chrono::hours(1));
+  REQUIRE_FALSE(HapData::is_cache_current(cache, root));
+  std::filesystem::remove(cache);
+  remove_hap_data(root);
+}
+
+TEST_CASE("HapData appended haplotypes", "[test_hap_data]") {
+  const std::string root = write_hap_data(30, 1500);
+  const std::string first = root + "_first";
+  const std::string second = root + "_second";
+  const std::string snapshot = root + ".index";
+  HapData full("array", root, 16);
+  remove_hap_data(root);
+  const std::size_t num_haps = full.num_haps;
+  write_hap_batch(full, 0, 40, first, full.physical_positions);
+  write_hap_batch(full, 40, num_haps, second, full.physical_positions);
+
+  // the same words, names and MAFs as if loaded at once, also when appending to a binary cache
+  HapData("array", first, 16).save(root + ".bin");
+  for (const std::string& path : {first, root + ".bin"}) {
+    HapData data("array", path, 16);
+    data.append_haplotypes(second);
+    REQUIRE_FALSE(data.words.is_view());
+    REQUIRE(data.num_haps == num_haps);
+    REQUIRE(data.sample_names == full.sample_names);
+    REQUIRE(data.site_mafs == full.site_mafs);
+    REQUIRE(data.physical_positions == full.physical_positions);
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      for (std::size_t i = 0; i < full.words.cols(); ++i) {
+        REQUIRE(data.words(hap_id, i) == full.words(hap_id, i));
+      }
+    }
+  }
+
+  // storage grows to exactly the rows needed, and reserved room is filled without moving the rows
+  {
+    HapData data("array", first, 16);
+    data.set_min_maf(0.1);
+    HapData grown("array", first, 16);
+    grown.append_haplotypes(second);
+    REQUIRE(grown.words.row_capacity() == num_haps);
+    data.reserve_haplotypes(num_haps + 10);
+    const auto* rows = data.words.row(0);
+    data.append_haplotypes(second);
+    REQUIRE(data.words.row(0) == rows);
+    REQUIRE(data.words.row_capacity() == num_haps + 10);
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      for (std::size_t i = 0; i < full.words.cols(); ++i) {
+        REQUIRE(data.words(hap_id, i) == full.words(hap_id, i));
+      }
+    }
+  }
+
+  // a cache saved after appending is not a cache of the files first loaded
+  {
+    HapData data("array", first, 16);
+    data.save(root + ".bin");
+    REQUIRE(HapData::is_cache_current(root + ".bin", first));
+    data.append_haplotypes(second);
+    data.save(root + ".bin");
+    REQUIRE_FALSE(HapData::is_cache_current(root + ".bin", first));
+  }
+
+  // hashes of the first batch are kept, and the second batch is then found as if hashed with it
+  const std::vector<std::string> engines = {"hash", "maf", "lsh", "pbwt"};
+  for (const std::string& name : engines) {
+    auto configure = [&](HapData& d) {
+      if (name == "maf") {
+        d.set_min_maf(0.3);
+      }
+      if (name == "lsh" || name == "pbwt") {
+        d.set_match_engine(name);
+      }
+    };
+    HapData reference("array", first, 16);
+    configure(reference);
+    reference.append_haplotypes(second);
+    HapData appended("array", first, 16);
+    configure(appended);
+    appended.add_range_to_hash(0, 30);
+    appended.save_hash_index(snapshot);
+    appended.add_range_to_hash(30, 40);
+    appended.append_haplotypes(second);
+    REQUIRE(appended.hashed_hap_ids.size() == 40);
+    REQUIRE(appended.num_hashed_sites() == reference.num_hashed_sites());
+    // a snapshot of the first batch loads into the whole data
+    HapData loaded("array", first, 16);
+    configure(loaded);
+    loaded.append_haplotypes(second);
+    loaded.load_hash_index(snapshot);
+    loaded.add_range_to_hash(30, 40);
+    reference.add_range_to_hash(0, 40);
+    for (std::size_t hap_id = 40; hap_id < num_haps; ++hap_id) {
+      const auto expected = reference.get_closest_cousins(hap_id, 3, 1, 0.1, 2, 2.);
+      REQUIRE(appended.get_closest_cousins(hap_id, 3, 1, 0.1, 2, 2.) == expected);
+      REQUIRE(loaded.get_closest_cousins(hap_id, 3, 1, 0.1, 2, 2.) == expected);
+      reference.add_to_hash(hap_id);
+      appended.add_to_hash(hap_id);
+      loaded.add_to_hash(hap_id);
+    }
+  }
+  std::filesystem::remove(snapshot);
+
+  // data holding a range of sites takes the same range of the batch
+  HapData range("array", first, 16, "", true, 1, 100, 900);
+  range.append_haplotypes(second);
+  REQUIRE(range.num_haps == num_haps);
+  for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+    for (std::size_t site_id = 0; site_id < range.num_sites; ++site_id) {
+      REQUIRE(range.allele(hap_id, site_id) == full.allele(hap_id, site_id + 100));
+    }
+  }
+
+  // the second batch is rejected if its files are missing or its sites differ, leaving the data
+  // as it was
+  std::vector<unsigned long> moved_positions = full.physical_positions;
+  moved_positions[100] += 1;
+  write_hap_batch(full, 40, num_haps, second, moved_positions);
+  HapData data("array", first, 16);
+  REQUIRE_THROWS_AS(data.append_haplotypes(second), std::logic_error);
+  REQUIRE(data.num_haps == 40);
+  REQUIRE(data.physical_positions == full.physical_positions);
+  REQUIRE_THROWS_AS(data.append_haplotypes(root + ".bin"), std::logic_error);
+  REQUIRE_THROWS_AS(data.append_haplotypes(root + "_missing"), std::logic_error);
+  write_hap_batch(full, 40, num_haps, second, full.physical_positions);
+  std::filesystem::remove(second + ".hap");
+  REQUIRE_THROWS_AS(data.append_haplotypes(second), std::logic_error);
+  REQUIRE(data.num_haps == 40);
+  REQUIRE(data.words.rows() == 40);
+  std::filesystem::remove(root + ".bin");
+  remove_hap_data(first);
+  remove_hap_data(second);
+}
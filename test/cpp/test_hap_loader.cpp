@@ -0,0 +1,142 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "FileUtils.hpp"
+#include "HapLoader.hpp"
+
+namespace {
+
+// Write a hap file large enough to be split into several blocks
+std::filesystem::path write_hap_file(std::size_t num_haps, std::size_t num_sites) {
+  auto path = std::filesystem::temp_directory_path() / "arg_needle_test_hap_loader.hap";
+  std::ofstream out(path);
+  std::uint64_t state = 12345u;
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    out << "1 SNP_" << site_id << " " << 1000 + site_id << " A G";
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+      out << ((state >> 60) < 3 ? " 1" : " 0");
+    }
+    out << "\n";
+  }
+  return path;
+}
+
+std::vector<HapLoader::HapBlock> load_blocks(const std::filesystem::path& path, std::size_t num_haps,
+                                             unsigned int word_size, unsigned int num_threads) {
+  std::vector<HapLoader::HapBlock> blocks;
+  FileUtils::AutoGzIfstream in;
+  in.openOrExit(path);
+  HapLoader::load(in, num_haps, word_size, num_threads, 0,
+                  [&](const HapLoader::HapBlock& block) { blocks.push_back(block); });
+  in.close();
+  return blocks;
+}
+
+} // namespace
+
+TEST_CASE("HapLoader::transpose_bits", "[test_hap_loader]") {
+  std::uint64_t tile[64];
+  std::uint64_t state = 7u;
+  for (auto& row : tile) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    row = state;
+  }
+  std::uint64_t transposed[64];
+  std::copy(tile, tile + 64, transposed);
+  HapLoader::transpose_bits(transposed);
+  for (std::size_t r = 0; r < 64; ++r) {
+    for (std::size_t c = 0; c < 64; ++c) {
+      REQUIRE(((transposed[c] >> r) & 1ull) == ((tile[r] >> c) & 1ull));
+    }
+  }
+}
+
+TEST_CASE("HapLoader::load packs alleles into haplotype words", "[test_hap_loader]") {
+  const std::size_t num_haps = 70;
+  const std::size_t num_sites = 150;
+  const auto path = write_hap_file(num_haps, num_sites);
+
+  std::ifstream in(path);
+  std::vector<std::vector<bool>> alleles(num_haps);
+  std::string field;
+  for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+    for (int i = 0; i < 5; ++i) {
+      in >> field;
+    }
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      char c;
+      in >> c;
+      alleles[hap_id].push_back(c == '1');
+    }
+  }
+
+  for (unsigned int word_size : {64u, 13u}) {
+    const auto blocks = load_blocks(path, num_haps, word_size, 1);
+    REQUIRE(blocks.size() == 1);
+    const auto& block = blocks.front();
+    for (std::size_t hap_id = 0; hap_id < num_haps; ++hap_id) {
+      for (std::size_t site_id = 0; site_id < num_sites; ++site_id) {
+        const std::uint64_t word = block.words[hap_id * block.num_words + site_id / word_size];
+        REQUIRE(((word >> (site_id % word_size)) & 1ull) == alleles[hap_id][site_id]);
+      }
+      // bits past word_size in each word stay clear
+      if (word_size < 64) {
+        for (std::size_t i = 0; i < block.num_words; ++i) {
+          REQUIRE((block.words[hap_id * block.num_words + i] >> word_size) == 0ull);
+        }
+      }
+    }
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("HapLoader::load is independent of thread count", "[test_hap_loader]") {
+  const std::size_t num_haps = 3000;
+  const std::size_t num_sites = 1500;
+  const auto path = write_hap_file(num_haps, num_sites);
+
+  for (unsigned int word_size : {64u, 13u}) {
+    const auto serial = load_blocks(path, num_haps, word_size, 1);
+    const auto parallel = load_blocks(path, num_haps, word_size, 4);
+    REQUIRE(serial.size() > 1);
+    REQUIRE(serial.size() == parallel.size());
+
+    std::size_t next_site = 0;
+    for (std::size_t i = 0; i < serial.size(); ++i) {
+      REQUIRE(serial[i].first_site == next_site);
+      REQUIRE(serial[i].first_site % word_size == 0);
+      REQUIRE(parallel[i].first_site == serial[i].first_site);
+      REQUIRE(parallel[i].words == serial[i].words);
+      REQUIRE(parallel[i].site_mafs == serial[i].site_mafs);
+      next_site += serial[i].num_sites;
+    }
+    REQUIRE(next_site == num_sites);
+  }
+  std::filesystem::remove(path);
+}
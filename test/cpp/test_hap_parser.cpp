@@ -0,0 +1,91 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "HapParser.hpp"
+
+
+TEST_CASE("HapParser::next_token", "[test_hap_parser]") {
+  std::string_view line = "  1\tSNP_1  0.5 100\r";
+  REQUIRE(HapParser::next_token(line) == "1");
+  REQUIRE(HapParser::next_token(line) == "SNP_1");
+  REQUIRE(HapParser::next_token(line) == "0.5");
+  REQUIRE(HapParser::next_token(line) == "100");
+  REQUIRE(HapParser::next_token(line).empty());
+}
+
+TEST_CASE("HapParser::parse_map_line", "[test_hap_parser]") {
+  HapParser::MapRecord record{};
+  REQUIRE(HapParser::parse_map_line("1\tSNP_1\t0.0012345\t10001457", record));
+  REQUIRE(record.genetic_position == 0.0012345);
+  REQUIRE(record.physical_position == 10001457ul);
+  REQUIRE_FALSE(HapParser::parse_map_line("  \r", record));
+  REQUIRE_THROWS(HapParser::parse_map_line("1 SNP_1 0.1", record));
+  REQUIRE_THROWS(HapParser::parse_map_line("1 SNP_1 abc 100", record));
+}
+
+TEST_CASE("HapParser::for_each_allele", "[test_hap_parser]") {
+  std::string_view alleles;
+
+  SECTION("strided layout") {
+    REQUIRE(HapParser::skip_hap_metadata("1 SNP_1 100 A G 0 1 1 0\r", alleles));
+    REQUIRE(HapParser::alleles_are_strided(alleles, 4));
+    std::string out;
+    HapParser::for_each_allele(alleles, 4, [&](size_t, char c) { out.push_back(c); });
+    REQUIRE(out == "0110");
+  }
+
+  SECTION("irregular whitespace matches stream extraction") {
+    REQUIRE(HapParser::skip_hap_metadata("1 SNP_1 100 A G 0  1\t10", alleles));
+    REQUIRE_FALSE(HapParser::alleles_are_strided(alleles, 4));
+    std::string out;
+    HapParser::for_each_allele(alleles, 4, [&](size_t, char c) { out.push_back(c); });
+    REQUIRE(out == "0110");
+  }
+
+  SECTION("blank and short lines") {
+    REQUIRE_FALSE(HapParser::skip_hap_metadata(" \t", alleles));
+    REQUIRE_THROWS(HapParser::skip_hap_metadata("1 SNP_1 100 A", alleles));
+    REQUIRE(HapParser::skip_hap_metadata("1 SNP_1 100 A G 0 1", alleles));
+    REQUIRE_THROWS(HapParser::for_each_allele(alleles, 3, [](size_t, char) {}));
+  }
+}
+
+TEST_CASE("HapParser::for_each_vcf_allele", "[test_hap_parser]") {
+  auto read = [](std::string_view samples, std::size_t num_samples, std::size_t gt_index) {
+    std::string out;
+    HapParser::for_each_vcf_allele(samples, num_samples, gt_index, [&](size_t, char c) { out.push_back(c); });
+    return out;
+  };
+
+  REQUIRE(read("0|1 1|1", 2, 0) == "0111");
+  REQUIRE(read("12:1|0:0.5 3:0|0", 2, 1) == "1000");
+  REQUIRE_THROWS(read("0|1", 2, 0));
+  // unphased, missing and multiallelic genotypes cannot be stored as one bit per haplotype
+  REQUIRE_THROWS(read("0|1 0/1", 2, 0));
+  REQUIRE_THROWS(read("0|1 .|1", 2, 0));
+  REQUIRE_THROWS(read("0|1 1|.", 2, 0));
+  REQUIRE_THROWS(read("0|2 1|1", 2, 0));
+  REQUIRE_THROWS(read("0 1|1", 2, 0));
+}
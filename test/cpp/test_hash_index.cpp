@@ -0,0 +1,151 @@
+/*
+  This file is part of the ARG-Needle genealogical inference and
+  analysis software suite.
+  Copyright (C) 2023-2025 ARG-Needle Developers.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "BinaryIO.hpp"
+#include "HashIndex.hpp"
+
+TEST_CASE("HashIndex matches a reference map", "[test_hash_index]") {
+  for (bool compressed : {false, true}) {
+    const std::size_t num_columns = 4;
+    HashIndex index;
+    REQUIRE(index.empty());
+    index.reset(num_columns, compressed);
+    REQUIRE(index.is_compressed() == compressed);
+    REQUIRE(index.num_columns() == num_columns);
+
+    // column 0 has many distinct keys, column 1 a few long lists, column 2 a single very long list,
+    // and column 3 lists that alternate between sparse and dense stretches of IDs
+    std::vector<std::map<std::uint64_t, std::vector<std::uint32_t>>> reference(num_columns);
+    std::uint64_t state = 99u;
+    for (std::uint32_t id = 0; id < 50000; ++id) {
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+      const bool dense_stretch = (id / 5000) % 2 == 0;
+      const std::uint64_t keys[num_columns] = {state >> 40, (state >> 60) % 5, 42u,
+                                               dense_stretch ? (state >> 62) % 2 : (state >> 56) % 100};
+      for (std::size_t column = 0; column < num_columns; ++column) {
+        index.insert(column, keys[column], id);
+        reference[column][keys[column]].push_back(id);
+      }
+    }
+
+    for (std::size_t column = 0; column < num_columns; ++column) {
+      std::size_t num_buckets = 0;
+      index.for_each_bucket(column, [&](const HashIndex::Bucket&) { ++num_buckets; });
+      REQUIRE(num_buckets == reference[column].size());
+
+      for (const auto& entry : reference[column]) {
+        const HashIndex::Bucket* bucket = index.find(column, entry.first);
+        REQUIRE(bucket != nullptr);
+        REQUIRE(bucket->key == entry.first);
+        std::vector<std::uint32_t> ids;
+        index.for_each_id(column, *bucket, [&](std::uint32_t id) { ids.push_back(id); });
+        REQUIRE(ids == entry.second);
+      }
+    }
+    REQUIRE(index.find(1, 17u) == nullptr);
+    REQUIRE(index.find(num_columns, 42u) == nullptr);
+  }
+}
+
+TEST_CASE("HashIndex compressed lists need increasing IDs", "[test_hash_index]") {
+  HashIndex index;
+  index.reset(1, true);
+  index.insert(0, 7u, 10u);
+  REQUIRE_THROWS_AS(index.insert(0, 7u, 10u), std::logic_error);
+  index.insert(0, 7u, 11u);
+  REQUIRE_THROWS_AS(index.insert(0, 7u, 3u), std::logic_error);
+  // other lists are unaffected
+  index.insert(0, 8u, 3u);
+}
+
+TEST_CASE("HashIndex snapshots", "[test_hash_index]") {
+  for (bool compressed : {false, true}) {
+    HashIndex index;
+    index.reset(3, compressed);
+    std::vector<std::map<std::uint64_t, std::vector<std::uint32_t>>> reference(3);
+    for (std::uint32_t id = 0; id < 3000; ++id) {
+      for (std::size_t column = 0; column < 3; ++column) {
+        const std::uint64_t key = (id * (column + 7)) % (column == 0 ? 1000 : 3);
+        index.insert(column, key, id);
+        reference[column][key].push_back(id);
+      }
+    }
+    std::ostringstream out;
+    index.write(out);
+    const std::string bytes = out.str();
+
+    HashIndex loaded;
+    BinaryIO::Reader in(bytes.data(), bytes.size(), "snapshot");
+    loaded.read(in);
+    REQUIRE(in.bytes_left() == 0);
+    REQUIRE(loaded.is_compressed() == compressed);
+    REQUIRE(loaded.num_columns() == 3);
+    REQUIRE(loaded.memory_usage().posting_lists <= index.memory_usage().posting_lists);
+
+    // the loaded index keeps growing like the original
+    for (std::size_t column = 0; column < 3; ++column) {
+      loaded.insert(column, 5u, 3000u);
+      reference[column][5u].push_back(3000u);
+      for (const auto& entry : reference[column]) {
+        const HashIndex::Bucket* bucket = loaded.find(column, entry.first);
+        REQUIRE(bucket != nullptr);
+        std::vector<std::uint32_t> ids;
+        loaded.for_each_id(column, *bucket, [&](std::uint32_t id) { ids.push_back(id); });
+        REQUIRE(ids == entry.second);
+      }
+    }
+
+    BinaryIO::Reader truncated(bytes.data(), bytes.size() - 1, "snapshot");
+    REQUIRE_THROWS_AS(HashIndex().read(truncated), std::logic_error);
+  }
+}
+
+TEST_CASE("HashIndex predicts its memory usage", "[test_hash_index]") {
+  for (bool compressed : {false, true}) {
+    for (std::size_t num_keys : {1u, 7u, 300u, 5000u}) {
+      const std::size_t num_columns = 3;
+      const std::size_t num_ids = 5000;
+      HashIndex index;
+      index.reset(num_columns, compressed);
+      for (std::uint32_t id = 0; id < num_ids; ++id) {
+        for (std::size_t column = 0; column < num_columns; ++column) {
+          index.insert(column, id % num_keys, id);
+        }
+      }
+      const HashIndex::MemoryUsage actual = index.memory_usage();
+      const HashIndex::MemoryUsage predicted =
+          HashIndex::predict_memory_usage(num_columns, num_ids, num_keys, compressed);
+      REQUIRE(actual.tables == predicted.tables);
+      REQUIRE(actual.posting_lists <= predicted.posting_lists);
+      REQUIRE(predicted.posting_lists <= 2 * actual.posting_lists + 8192 * num_columns);
+      if (num_keys == num_ids) {
+        REQUIRE(predicted.posting_lists == 0);
+      }
+    }
+  }
+}
@@ -0,0 +1,176 @@
+# This file is part of the ARG-Needle genealogical inference and
+# analysis software suite.
+# Copyright (C) 2023-2025 ARG-Needle Developers.
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+# Tests of the Python bindings of the hashing library. They need the compiled extension, e.g.
+# from running in the root of this repository:
+#
+# pip install .[dev]
+
+import logging
+
+import numpy as np
+import pytest
+
+hashing = pytest.importorskip("arg_needle.arg_needle_hashing_pybind")
+decoders = pytest.importorskip("arg_needle.decoders")
+HapData = hashing.HapData
+
+NUM_SITES = 600
+NUM_HAPS = 40
+
+
+@pytest.fixture
+def genotypes():
+    """A sites x haplotypes matrix of noisy copies of four founders, with its positions."""
+    rng = np.random.default_rng(42)
+    founders = rng.integers(0, 2, size=(NUM_SITES, 4), dtype=np.uint8)
+    matrix = founders[:, np.arange(NUM_HAPS) % 4]
+    matrix ^= (rng.random((NUM_SITES, NUM_HAPS)) < 0.01).astype(np.uint8)
+    physical = 1000 + 10 * np.arange(NUM_SITES, dtype=np.uint64)
+    genetic = 0.001 * np.arange(NUM_SITES, dtype=np.float64)
+    return matrix, physical, genetic
+
+
+def make_hashed(genotypes, word_size=16, refine_word_size=None):
+    matrix, physical, genetic = genotypes
+    data = HapData("array", matrix, physical, genetic, word_size)
+    if refine_word_size is not None:
+        data.add_refinement(refine_word_size)
+    data.add_range_to_hash(0, data.num_haps)
+    return data
+
+
+def test_numpy_constructor(genotypes):
+    matrix, physical, genetic = genotypes
+    data = HapData("array", matrix, physical, genetic, 16)
+    assert data.num_haps == NUM_HAPS
+    assert data.num_sites == NUM_SITES
+    assert list(data.physical_positions) == list(physical)
+    assert [data.sample_name(hap_id) for hap_id in range(3)] == ["sample_0", "sample_0", "sample_1"]
+
+    # the same haplotypes from a bit-packed or a non-contiguous matrix
+    expected = make_hashed(genotypes)
+    packed = HapData("array", np.packbits(matrix, axis=1), physical, genetic, 16, bit_packed=True,
+                     num_haps=NUM_HAPS)
+    strided = HapData("array", np.asfortranarray(matrix), physical, genetic, 16)
+    for other in (packed, strided):
+        assert other.num_haps == NUM_HAPS
+        other.add_range_to_hash(0, NUM_HAPS)
+        for hap_id in range(1, NUM_HAPS, 7):
+            assert other.get_closest_cousins(hap_id, 3, 0, 0.1) == expected.get_closest_cousins(hap_id, 3, 0, 0.1)
+
+    with pytest.raises(RuntimeError):
+        HapData("array", matrix[0], physical, genetic, 16)
+    with pytest.raises(RuntimeError):
+        HapData("array", matrix, physical[:-1], genetic, 16)
+    with pytest.raises(RuntimeError):
+        HapData("array", np.packbits(matrix, axis=1), physical, genetic, 16, bit_packed=True, num_haps=NUM_HAPS + 9)
+
+
+def test_cousin_arrays(genotypes):
+    data = make_hashed(genotypes)
+    k = 5
+    for hap_id in range(1, NUM_HAPS, 5):
+        for window_size in (0, 0.1):
+            cousins = data.get_closest_cousins(hap_id, k, 0, window_size)
+            starts, ends, ids, scores = data.get_closest_cousins_arrays(hap_id, k, 0, window_size)
+            assert ids.shape == scores.shape == (len(cousins), k)
+            assert list(starts) == [start for start, _, _ in cousins]
+            assert list(ends) == [end for _, end, _ in cousins]
+            for w, (_, _, found) in enumerate(cousins):
+                assert list(ids[w]) == [cousin for cousin, _ in found] + [-1] * (k - len(found))
+                assert list(scores[w]) == [score for _, score in found] + [0] * (k - len(found))
+
+
+def test_async_calls(genotypes):
+    expected = make_hashed(genotypes)
+    matrix, physical, genetic = genotypes
+    data = HapData("array", matrix, physical, genetic, 16)
+
+    futures = [data.add_to_hash_async(hap_id) for hap_id in range(NUM_HAPS)]
+    query = data.get_closest_cousins_async(NUM_HAPS - 1, 3, 0, 0.1)
+    arrays = data.get_closest_cousins_async(NUM_HAPS - 2, 3, 0, 0.1)
+    # a query sees every hash queued before it
+    assert query.result() == expected.get_closest_cousins(NUM_HAPS - 1, 3, 0, 0.1)
+    for got, want in zip(arrays.result_arrays(3), expected.get_closest_cousins_arrays(NUM_HAPS - 2, 3, 0, 0.1)):
+        np.testing.assert_array_equal(got, want)
+    for future in futures:
+        future.result()
+        assert future.done()
+
+    # errors are raised by result()
+    again = data.add_to_hash_async(0)
+    data.wait_pending()
+    with pytest.raises(RuntimeError):
+        again.result()
+    assert data.hashed_hap_ids == set(range(NUM_HAPS))
+
+
+def test_match_engine_at_construction(genotypes):
+    matrix, physical, genetic = genotypes
+    data = HapData("array", matrix, physical, genetic, 16, match_engine="pbwt")
+    assert data.match_engine == "pbwt"
+    data.add_range_to_hash(0, NUM_HAPS)
+    assert data.memory_usage().pbwt > 0
+    with pytest.raises(RuntimeError):
+        HapData("array", matrix, physical, genetic, 16, match_engine="suffix_tree")
+
+
+def test_refinement(genotypes):
+    coarse = make_hashed(genotypes, 32)
+    refined = make_hashed(genotypes, 32, refine_word_size=8)
+    assert refined.refinement_word_sizes == [8]
+    assert refined.memory_usage().hash_tables > coarse.memory_usage().hash_tables
+    with pytest.raises(RuntimeError):
+        refined.add_refinement(4)
+
+    matrix, physical, genetic = genotypes
+    incremental = HapData("array", matrix, physical, genetic, 32)
+    incremental.add_refinement(8)
+    for hap_id in range(NUM_HAPS):
+        incremental.add_to_hash(hap_id)
+    for hap_id in range(1, NUM_HAPS, 7):
+        # without thresholds, nothing is refined
+        assert refined.get_closest_cousins(hap_id, 3, 0, 0.1) == coarse.get_closest_cousins(hap_id, 3, 0, 0.1)
+        results = refined.get_closest_cousins(hap_id, 3, 0, 0.1, 4)
+        assert results == incremental.get_closest_cousins(hap_id, 3, 0, 0.1, 4)
+        assert all(len(found) <= 3 for _, _, found in results)
+
+
+def test_hash_index_file(genotypes, tmp_path, caplog):
+    matrix, physical, genetic = genotypes
+    saved = make_hashed(genotypes)
+    path = str(tmp_path / "hashes.idx")
+    saved.save_hash_index(path)
+
+    # skipped if missing or if it holds haplotypes at or above the limit, e.g. not yet threaded
+    data = HapData("array", matrix, physical, genetic, 16)
+    assert not decoders.load_hash_index(data, str(tmp_path / "missing.idx"), NUM_HAPS)
+    with caplog.at_level(logging.WARNING):
+        assert not decoders.load_hash_index(data, path, NUM_HAPS - 1)
+    assert "Not using hash index" in caplog.text
+    assert data.hashed_hap_ids == set()
+
+    assert decoders.load_hash_index(data, path, NUM_HAPS)
+    assert data.hashed_hap_ids == set(range(NUM_HAPS))
+    for hap_id in range(1, NUM_HAPS, 7):
+        assert data.get_closest_cousins(hap_id, 3, 0, 0.1) == saved.get_closest_cousins(hap_id, 3, 0, 0.1)
+
+    # rejected if built from other data
+    other = HapData("array", 1 - matrix, physical, genetic, 16)
+    assert not decoders.load_hash_index(other, path, NUM_HAPS)